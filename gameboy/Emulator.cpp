@@ -47,97 +47,551 @@ https://gekkio.fi/files/gb-docs/gbctr.pdf
 
 #include "Emulator.hpp"
 
+// The scanline renderer has AVX2 and WebAssembly SIMD paths (see 
+// mapShades and expandShades)
+#if defined(__x86_64__) && defined(__GNUC__)
+#define RENDER_AVX2
+#include <immintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
 /*
 ********************************************************************************
 SAVING AND LOADING STATES
 ********************************************************************************
 */
 
-void Emulator::saveState(string fileName) {
+/*
+
+A save state is a header followed by one chunk per subsystem:
 
-    cout << "called from saveState() | filename: " << fileName << endl;
+Header      "GBST", version (2 bytes), chunk count (2 bytes), ROM hash (8 bytes)
+Chunk       tag (4 bytes), payload size (4 bytes), payload
+
+"CPU "      AF BC DE HL SP PC, IME, halted
+"MMU "      ROM bank, RAM bank, RAM enabled, MBC1, MBC2, ROM banking, RAM size
+            (4 bytes), RAM banks, VRAM, Work RAM, 0xFE00-0xFFFF
+"TIMR"      timer counter, timer period, divider counter (4 bytes each)
+"PPU "      scanline cycle count (4 bytes)
+"JOYP"      joypad state
+
+Numbers are little endian, and every field is written on its own, so the 
+format doesn't depend on the layout of Emulator. The ROM is not saved, only 
+its hash, and the state only loads into an Emulator running the same ROM. The
+framebuffer is not saved either, the next frame draws it again. The parts of
+internalMem that nothing maps (the ROM area, external RAM and Echo RAM) are 
+left out. A state with 8KB of RAM is about 25KB.
+
+Chunks with other tags are skipped, so a newer version can add chunks 
+without breaking older readers. Changing a chunk means a new version.
+
+*/
+
+static const BYTE stateMagic[4] = {'G', 'B', 'S', 'T'};
+static const WORD stateVersion = 1;
+static const size_t stateHeaderSize = 16;
+
+static void putByte(vector<BYTE>& state, BYTE value) {
+    state.push_back(value);
+}
+
+static void putWord(vector<BYTE>& state, WORD value) {
+    state.push_back(value & 0xFF);
+    state.push_back(value >> 8);
+}
+
+static void putInt(vector<BYTE>& state, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        state.push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+static void putBytes(vector<BYTE>& state, const BYTE* bytes, size_t size) {
+    state.insert(state.end(), bytes, bytes + size);
+}
+
+// Returns where the chunk starts, for endChunk to fill in its size
+static size_t beginChunk(vector<BYTE>& state, const char* tag) {
+    putBytes(state, reinterpret_cast<const BYTE*>(tag), 4);
+    putInt(state, 0);
+    return state.size();
+}
+
+static void endChunk(vector<BYTE>& state, size_t start) {
+    uint32_t size = state.size() - start;
+    for (int i = 0; i < 4; i++) {
+        state[start - 4 + i] = (size >> (i * 8)) & 0xFF;
+    }
+}
+
+static BYTE getByte(const BYTE*& cursor) {
+    return *cursor++;
+}
+
+static WORD getWord(const BYTE*& cursor) {
+    WORD value = cursor[0] | (cursor[1] << 8);
+    cursor += 2;
+    return value;
+}
+
+static uint32_t getInt(const BYTE*& cursor) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)cursor[i] << (i * 8);
+    }
+    cursor += 4;
+    return value;
+}
+
+static void getBytes(const BYTE*& cursor, BYTE* bytes, size_t size) {
+    memcpy(bytes, cursor, size);
+    cursor += size;
+}
+
+void Emulator::saveState(string fileName, function<void(bool)> saved) {
+
+    // Only the copy happens here, the file is written in the background
+    vector<BYTE> state;
+    writeState(state);
+    FileWriter::shared().write(fileName, move(state), move(saved));
+
+}
+
+bool Emulator::loadState(string fileName) {
+
+    // It may still be being written
+    FileWriter::shared().flush();
+
+    ifstream fileStream(fileName, ios::binary);
+    if (!fileStream.good()) {
+        cout << "Could not open save state " << fileName << endl;
+        return false;
+    }
+
+    vector<BYTE> state((istreambuf_iterator<char>(fileStream)), istreambuf_iterator<char>());
+    return readState(state);
+
+}
+
+void Emulator::writeState(vector<BYTE>& state) {
+
+    const int chunkCount = 5;
+    state.clear();
+    state.reserve(stateHeaderSize + 0x6000 + RAMBanks.size + 128);
+
+    putBytes(state, stateMagic, 4);
+    putWord(state, stateVersion);
+    putWord(state, chunkCount);
+    putInt(state, ROM->hash() & 0xFFFFFFFF);
+    putInt(state, ROM->hash() >> 32);
 
-    ofstream fileStream(fileName, ios::binary);
-    
     // Registers
-    fileStream.write(reinterpret_cast<const char*>(&regAF.regstr), sizeof(regAF.regstr));
-    fileStream.write(reinterpret_cast<const char*>(&regBC.regstr), sizeof(regBC.regstr));
-    fileStream.write(reinterpret_cast<const char*>(&regDE.regstr), sizeof(regDE.regstr));
-    fileStream.write(reinterpret_cast<const char*>(&regHL.regstr), sizeof(regHL.regstr));
-    fileStream.write(reinterpret_cast<const char*>(&programCounter.regstr), sizeof(programCounter.regstr));
-    fileStream.write(reinterpret_cast<const char*>(&stackPointer.regstr), sizeof(stackPointer.regstr));
+    materializeFlags();
+    size_t chunk = beginChunk(state, "CPU ");
+    putWord(state, regAF.regstr);
+    putWord(state, regBC.regstr);
+    putWord(state, regDE.regstr);
+    putWord(state, regHL.regstr);
+    putWord(state, stackPointer.regstr);
+    putWord(state, programCounter.regstr);
+    putByte(state, InterruptMasterEnabled);
+    putByte(state, isHalted);
+    endChunk(state, chunk);
 
     // Memory items
-    fileStream.write(reinterpret_cast<const char*>(&internalMem[0]), sizeof(internalMem));
-    fileStream.write(reinterpret_cast<const char*>(&cartridgeMem[0]), sizeof(cartridgeMem));
-    fileStream.write(reinterpret_cast<const char*>(&currentROMBank), sizeof(currentROMBank));
-    fileStream.write(reinterpret_cast<const char*>(&RAMBanks[0]), sizeof(RAMBanks));
-    fileStream.write(reinterpret_cast<const char*>(&currentRAMBank), sizeof(currentRAMBank));
-    
-    fileStream.write(reinterpret_cast<const char*>(&enableRAM), sizeof(enableRAM));
-    fileStream.write(reinterpret_cast<const char*>(&MBC1), sizeof(MBC1));
-    fileStream.write(reinterpret_cast<const char*>(&MBC2), sizeof(MBC2));
-    fileStream.write(reinterpret_cast<const char*>(&ROMBanking), sizeof(ROMBanking));
+    chunk = beginChunk(state, "MMU ");
+    putByte(state, currentROMBank);
+    putByte(state, currentRAMBank);
+    putByte(state, enableRAM);
+    putByte(state, MBC1);
+    putByte(state, MBC2);
+    putByte(state, ROMBanking);
+    putInt(state, RAMBanks.size);
+    putBytes(state, RAMBanks.memory, RAMBanks.size);
+    putBytes(state, &internalMem[0x8000], 0x2000); // VRAM
+    putBytes(state, &internalMem[0xC000], 0x2000); // Work RAM
+    putBytes(state, &internalMem[0xFE00], 0x200); // OAM, I/O, HRAM
+    endChunk(state, chunk);
 
     // Timer attributes
-    fileStream.write(reinterpret_cast<const char*>(&timerCounter), sizeof(timerCounter));
-    fileStream.write(reinterpret_cast<const char*>(&timerUpdateConstant), sizeof(timerUpdateConstant));
-    fileStream.write(reinterpret_cast<const char*>(&dividerCounter), sizeof(dividerCounter));
+    chunk = beginChunk(state, "TIMR");
+    putInt(state, timerCounter);
+    putInt(state, timerUpdateConstant);
+    putInt(state, dividerCounter);
+    endChunk(state, chunk);
 
-    // Interrupt
-    fileStream.write(reinterpret_cast<const char*>(&InterruptMasterEnabled), sizeof(InterruptMasterEnabled));
-    fileStream.write(reinterpret_cast<const char*>(&isHalted), sizeof(isHalted));
+    // Graphics
+    chunk = beginChunk(state, "PPU ");
+    putInt(state, scanlineCycleCount);
+    endChunk(state, chunk);
 
     // Joypad
-    fileStream.write(reinterpret_cast<const char*>(&joypadState), sizeof(joypadState));
+    chunk = beginChunk(state, "JOYP");
+    putByte(state, joypadState);
+    endChunk(state, chunk);
+
+}
+
+// Checks the whole state before changing anything, a state that doesn't load 
+// leaves the Emulator as it was
+bool Emulator::readState(const vector<BYTE>& state) {
+
+    if (state.size() < stateHeaderSize || memcmp(state.data(), stateMagic, 4) != 0) {
+        cout << "Not a save state" << endl;
+        return false;
+    }
+
+    const BYTE* cursor = state.data() + 4;
+    WORD version = getWord(cursor);
+    WORD chunkCount = getWord(cursor);
+    uint64_t hash = getInt(cursor);
+    hash |= (uint64_t)getInt(cursor) << 32;
+
+    if (version != stateVersion) {
+        cout << "Save state version " << version << " is not supported" << endl;
+        return false;
+    }
+    if (hash != ROM->hash()) {
+        cout << "Save state is for a different ROM" << endl;
+        return false;
+    }
+
+    // Find the chunks this version knows
+    const char* tags[] = {"CPU ", "MMU ", "TIMR", "PPU ", "JOYP"};
+    const size_t sizes[] = {14, 10 + RAMBanks.size + 0x4200, 12, 4, 1};
+    const BYTE* payloads[5] = {};
+
+    const BYTE* end = state.data() + state.size();
+    for (int i = 0; i < chunkCount; i++) {
+        if (end - cursor < 8) {
+            cout << "Save state is truncated" << endl;
+            return false;
+        }
+        const BYTE* tag = cursor;
+        cursor += 4;
+        uint32_t size = getInt(cursor);
+        if ((size_t)(end - cursor) < size) {
+            cout << "Save state is truncated" << endl;
+            return false;
+        }
+
+        for (int known = 0; known < 5; known++) {
+            if (memcmp(tag, tags[known], 4) == 0) {
+                if (size != sizes[known]) {
+                    cout << "Save state chunk " << tags[known] << " has the wrong size" << endl;
+                    return false;
+                }
+                payloads[known] = cursor;
+            }
+        }
+        cursor += size;
+    }
+
+    for (int known = 0; known < 5; known++) {
+        if (payloads[known] == nullptr) {
+            cout << "Save state has no " << tags[known] << " chunk" << endl;
+            return false;
+        }
+    }
+
+    // Registers
+    cursor = payloads[0];
+    regAF.regstr = getWord(cursor);
+    flagOperation = FLAGS_READY;
+    regBC.regstr = getWord(cursor);
+    regDE.regstr = getWord(cursor);
+    regHL.regstr = getWord(cursor);
+    stackPointer.regstr = getWord(cursor);
+    programCounter.regstr = getWord(cursor);
+    InterruptMasterEnabled = getByte(cursor);
+    isHalted = getByte(cursor);
+
+    // Memory items
+    cursor = payloads[1];
+    currentROMBank = getByte(cursor);
+    currentRAMBank = getByte(cursor);
+    enableRAM = getByte(cursor);
+    MBC1 = getByte(cursor);
+    MBC2 = getByte(cursor);
+    ROMBanking = getByte(cursor);
+    getInt(cursor); // RAM size, checked with the chunk size
+    getBytes(cursor, RAMBanks.memory, RAMBanks.size);
+    RAMBanksChanged = true;
+    getBytes(cursor, &internalMem[0x8000], 0x2000);
+    getBytes(cursor, &internalMem[0xC000], 0x2000);
+    getBytes(cursor, &internalMem[0xFE00], 0x200);
+
+    // Timer attributes
+    cursor = payloads[2];
+    timerCounter = getInt(cursor);
+    timerUpdateConstant = getInt(cursor);
+    dividerCounter = getInt(cursor);
 
     // Graphics
-    fileStream.write(reinterpret_cast<const char*>(&displayPixels[0]), sizeof(displayPixels));
-    fileStream.write(reinterpret_cast<const char*>(&scanlineCycleCount), sizeof(scanlineCycleCount));
+    cursor = payloads[3];
+    scanlineCycleCount = getInt(cursor);
+
+    // Joypad
+    cursor = payloads[4];
+    joypadState = getByte(cursor);
 
-    cout << "reached end of saveState function" << endl;
+    // Nothing is pending after a load
+    lastSyncCycle = cycleCounter;
+    runTargetCycle = cycleCounter;
+
+    clearBlockCache();
+    decodeAllTiles();
+    updatePalettes();
+    spritesChanged = true;
+    mapMemory();
+    markAllDirty();
+
+    return true;
 
 }
 
-void Emulator::loadState(string fileName) {
+/*
+********************************************************************************
+SNAPSHOTS
+********************************************************************************
+*/
 
-    ifstream fileStream(fileName, ios::binary);
+/*
+
+snapshot and restore copy the state into and out of a buffer the caller owns,
+for tree search and speculative execution that branch off thousands of times
+a second. There is no file, no format and no allocation: the buffer holds a 
+SnapshotData, the fields as they are in the Emulator. Unlike save states it 
+keeps everything the next instruction depends on, down to the scheduler's 
+cycle counts, so running on from a restored snapshot does exactly what running
+on from the snapshot did. Lazy flags are stored worked out.
+
+The framebuffer is left out, the frame after a restore draws it again. Only 
+the RAM banks the cartridge has are copied, the rest of the buffer up to 
+snapshotSize is zeroed so that equal states are equal byte for byte.
+
+Cached blocks decoded from ROM stay valid across a restore. Blocks in Work 
+RAM or HRAM are thrown away only if the restored bytes under them differ.
+restore does only what the difference needs: memory is compared and copied a
+page at a time and only the pages that differ are marked dirty, tile rows are
+decoded again only where VRAM changed, and the banks are mapped and the 
+palettes worked out only if they changed. Restoring one frame back takes 2-4us
+(bench and game ROMs, -O2), most of it comparing memory.
+
+A snapshot belongs to the Emulator's ROM, restore refuses others. Snapshots
+aren't meant to outlive the process, use save states for that.
+
+*/
+
+void Emulator::snapshot(void* buffer) const {
+
+    static_assert(sizeof(SnapshotData) <= snapshotSize, "snapshotSize is too small");
+    static_assert(sizeof(SnapshotData::RAM) == maxRAMSize, "SnapshotData holds every RAM bank");
+
+    assert(reinterpret_cast<uintptr_t>(buffer) % alignof(SnapshotData) == 0);
+    SnapshotData& data = *static_cast<SnapshotData*>(buffer);
+
+    data.ROMHash = ROM->hash();
 
     // Registers
-    fileStream.read(reinterpret_cast<char*>(&regAF.regstr), sizeof(regAF.regstr));
-    fileStream.read(reinterpret_cast<char*>(&regBC.regstr), sizeof(regBC.regstr));
-    fileStream.read(reinterpret_cast<char*>(&regDE.regstr), sizeof(regDE.regstr));
-    fileStream.read(reinterpret_cast<char*>(&regHL.regstr), sizeof(regHL.regstr));
-    fileStream.read(reinterpret_cast<char*>(&programCounter.regstr), sizeof(programCounter.regstr));
-    fileStream.read(reinterpret_cast<char*>(&stackPointer.regstr), sizeof(stackPointer.regstr));
+    data.registers[0] = regAF;
+    data.registers[1] = regBC;
+    data.registers[2] = regDE;
+    data.registers[3] = regHL;
+    data.registers[4] = stackPointer;
+    data.registers[5] = programCounter;
+    // F is stored worked out, lazy or not, with the operands zeroed, so
+    // equal states are byte for byte equal whether the interpreter or the
+    // JIT ran them
+    data.registers[0].low = currentFlags();
+    data.flagOperation = FLAGS_READY;
+    data.flagOperand1 = 0;
+    data.flagOperand2 = 0;
+    data.flagResult = 0;
+
+    // Scheduler
+    data.cycleCounter = cycleCounter;
+    data.lastSyncCycle = lastSyncCycle;
+    data.nextSyncCycle = nextSyncCycle;
+    data.runTargetCycle = runTargetCycle;
+
+    // Timer attributes
+    data.timerCounter = timerCounter;
+    data.timerUpdateConstant = timerUpdateConstant;
+    data.dividerCounter = dividerCounter;
+
+    // Graphics
+    data.scanlineCycleCount = scanlineCycleCount;
+    data.framesToSkip = framesToSkip;
+
+    // Interrupt
+    data.InterruptMasterEnabled = InterruptMasterEnabled;
+    data.isHalted = isHalted;
+
+    // Joypad
+    data.joypadState = joypadState;
 
     // Memory items
-    fileStream.read(reinterpret_cast<char*>(&internalMem[0]), sizeof(internalMem));
-    fileStream.read(reinterpret_cast<char*>(&cartridgeMem[0]), sizeof(cartridgeMem));
-    fileStream.read(reinterpret_cast<char*>(&currentROMBank), sizeof(currentROMBank));
-    fileStream.read(reinterpret_cast<char*>(&RAMBanks[0]), sizeof(RAMBanks));
-    fileStream.read(reinterpret_cast<char*>(&currentRAMBank), sizeof(currentRAMBank));
-    
-    fileStream.read(reinterpret_cast<char*>(&enableRAM), sizeof(enableRAM));
-    fileStream.read(reinterpret_cast<char*>(&MBC1), sizeof(MBC1));
-    fileStream.read(reinterpret_cast<char*>(&MBC2), sizeof(MBC2));
-    fileStream.read(reinterpret_cast<char*>(&ROMBanking), sizeof(ROMBanking));
+    data.currentROMBank = currentROMBank;
+    data.currentRAMBank = currentRAMBank;
+    data.enableRAM = enableRAM;
+    data.MBC1 = MBC1;
+    data.MBC2 = MBC2;
+    data.ROMBanking = ROMBanking;
+    data.RAMSize = RAMBanks.size;
+    memcpy(data.VRAM, &internalMem[0x8000], sizeof(data.VRAM));
+    memcpy(data.workRAM, &internalMem[0xC000], sizeof(data.workRAM));
+    memcpy(data.highMem, &internalMem[0xFE00], sizeof(data.highMem));
+    memcpy(data.RAM, RAMBanks.memory, RAMBanks.size);
+    BYTE* end = static_cast<BYTE*>(buffer) + snapshotSize;
+    memset(data.RAM + RAMBanks.size, 0, end - (data.RAM + RAMBanks.size));
+
+}
+
+bool Emulator::restore(const void* buffer) {
+
+    assert(reinterpret_cast<uintptr_t>(buffer) % alignof(SnapshotData) == 0);
+    const SnapshotData& data = *static_cast<const SnapshotData*>(buffer);
+
+    if ((data.ROMHash != ROM->hash()) || (data.RAMSize != RAMBanks.size)) {
+        return false;
+    }
+
+    // Cached code in RAM that the snapshot overwrites has to be decoded again.
+    // Runs of changed code bytes are thrown away together. Only the words of
+    // codeBytes with code in them are compared, 32 bytes at a time
+    int runStart = -1;
+    for (int word = 0; word < 0x4000 / 32; word++) {
+        uint32_t changed = 0;
+        WORD first = 0xC000 + word * 32;
+        if ((codeBytes[word] != 0) && (first < 0xE000 || first >= 0xFE00)) {
+            const BYTE* restored = (first < 0xE000) ? &data.workRAM[first - 0xC000]
+                : &data.highMem[first - 0xFE00];
+            if (memcmp(restored, &internalMem[first], 32) != 0) {
+                for (int bit = 0; bit < 32; bit++) {
+                    changed |= uint32_t(restored[bit] != internalMem[first + bit]) << bit;
+                }
+                changed &= codeBytes[word];
+            }
+        }
+
+        if ((changed == 0) || (changed == 0xFFFFFFFF)) {
+            if ((changed == 0) && (runStart >= 0)) {
+                invalidateBlocks(runStart, first - 1);
+                runStart = -1;
+            } else if ((changed != 0) && (runStart < 0)) {
+                runStart = first;
+            }
+            continue;
+        }
+        for (int bit = 0; bit < 32; bit++) {
+            bool isChanged = (changed >> bit) & 0x1;
+            if (isChanged && (runStart < 0)) {
+                runStart = first + bit;
+            } else if (!isChanged && (runStart >= 0)) {
+                invalidateBlocks(runStart, first + bit - 1);
+                runStart = -1;
+            }
+        }
+    }
+    if (runStart >= 0) {
+        invalidateBlocks(runStart, 0xFFFF);
+    }
+
+    // Only what the snapshot changes is worked out again
+    bool banksChanged = (currentROMBank != data.currentROMBank) || (currentRAMBank != data.currentRAMBank);
+    bool palettesChanged = memcmp(&internalMem[0xFF47], &data.highMem[0x147], 3) != 0;
+    if (memcmp(&internalMem[0xFE00], data.highMem, 0xA0) != 0) {
+        spritesChanged = true;
+    }
+
+    // Registers
+    regAF = data.registers[0];
+    regBC = data.registers[1];
+    regDE = data.registers[2];
+    regHL = data.registers[3];
+    stackPointer = data.registers[4];
+    programCounter = data.registers[5];
+    flagOperation = data.flagOperation;
+    flagOperand1 = data.flagOperand1;
+    flagOperand2 = data.flagOperand2;
+    flagResult = data.flagResult;
+
+    // Scheduler
+    cycleCounter = data.cycleCounter;
+    lastSyncCycle = data.lastSyncCycle;
+    nextSyncCycle = data.nextSyncCycle;
+    runTargetCycle = data.runTargetCycle;
 
     // Timer attributes
-    fileStream.read(reinterpret_cast<char*>(&timerCounter), sizeof(timerCounter));
-    fileStream.read(reinterpret_cast<char*>(&timerUpdateConstant), sizeof(timerUpdateConstant));
-    fileStream.read(reinterpret_cast<char*>(&dividerCounter), sizeof(dividerCounter));
+    timerCounter = data.timerCounter;
+    timerUpdateConstant = data.timerUpdateConstant;
+    dividerCounter = data.dividerCounter;
+
+    // Graphics
+    scanlineCycleCount = data.scanlineCycleCount;
+    framesToSkip = min((int)data.framesToSkip, frameSkip);
 
     // Interrupt
-    fileStream.read(reinterpret_cast<char*>(&InterruptMasterEnabled), sizeof(InterruptMasterEnabled));
-    fileStream.read(reinterpret_cast<char*>(&isHalted), sizeof(isHalted));
+    InterruptMasterEnabled = data.InterruptMasterEnabled;
+    isHalted = data.isHalted;
 
     // Joypad
-    fileStream.read(reinterpret_cast<char*>(&joypadState), sizeof(joypadState));
+    joypadState = data.joypadState;
 
-    // Graphics
-    fileStream.read(reinterpret_cast<char*>(&displayPixels[0]), sizeof(displayPixels));
-    fileStream.read(reinterpret_cast<char*>(&scanlineCycleCount), sizeof(scanlineCycleCount));
+    // Memory items
+    currentROMBank = data.currentROMBank;
+    currentRAMBank = data.currentRAMBank;
+    enableRAM = data.enableRAM;
+    MBC1 = data.MBC1;
+    MBC2 = data.MBC2;
+    ROMBanking = data.ROMBanking;
+
+    // Only the tile rows that differ are decoded again, 8 bytes (4 rows) at
+    // a time
+    for (size_t i = 0; i < tileRowCount * 2; i += 8) {
+        if (memcmp(&internalMem[0x8000 + i], &data.VRAM[i], 8) != 0) {
+            memcpy(&internalMem[0x8000 + i], &data.VRAM[i], 8);
+            dirtyPages[(0x8000 + i) >> 8] = 1;
+            for (size_t row = i >> 1; row < (i + 8) >> 1; row++) {
+                decodeTileRow(row);
+            }
+        }
+    }
+
+    // Pages that differ are copied and marked dirty
+    auto restorePages = [](BYTE* memory, const BYTE* restored, size_t size, BYTE* dirty) {
+        bool changed = false;
+        for (size_t page = 0; page < (size >> 8); page++) {
+            if (memcmp(&memory[page << 8], &restored[page << 8], 0x100) != 0) {
+                memcpy(&memory[page << 8], &restored[page << 8], 0x100);
+                dirty[page] = 1;
+                changed = true;
+            }
+        }
+        return changed;
+    };
+    restorePages(&internalMem[0x8000], data.VRAM, sizeof(data.VRAM), &dirtyPages[0x80]);
+    restorePages(&internalMem[0xC000], data.workRAM, sizeof(data.workRAM), &dirtyPages[0xC0]);
+    restorePages(&internalMem[0xFE00], data.highMem, sizeof(data.highMem), &dirtyPages[0xFE]);
+    if (restorePages(RAMBanks.memory, data.RAM, RAMBanks.size, dirtyRAMPages)) {
+        RAMBanksChanged = true;
+    }
+
+    // Start again from a block lookup
+    currentBlock = nullptr;
+    idleLoopBlock = nullptr;
+    blockIndex = 0;
+
+    if (palettesChanged) {
+        updatePalettes();
+    }
+    if (banksChanged) {
+        mapMemory();
+    }
+
+    return true;
 
 }
 
@@ -149,6 +603,7 @@ TOP LEVEL CPU FUNCTIONS
 void Emulator::resetCPU() {
 
     regAF.regstr = 0x01B0; 
+    flagOperation = FLAGS_READY;
     regBC.regstr = 0x0013; 
     regDE.regstr = 0x00D8;
     regHL.regstr = 0x014D;
@@ -158,6 +613,10 @@ void Emulator::resetCPU() {
     // bootROM is not implemented for this emulator
     programCounter.regstr = 0x100; 
 
+    // Nothing left over from the last game, or a movie played from power on
+    // would start from whatever was in VRAM and work RAM
+    memset(internalMem + 0x8000, 0, 0x8000);
+
     internalMem[0xFF05] = 0x00; // TIMA
     internalMem[0xFF06] = 0x00; // TMA
     internalMem[0xFF07] = 0x00; // TAC
@@ -189,6 +648,8 @@ void Emulator::resetCPU() {
     internalMem[0xFF4A] = 0x00; // WX - window X
     internalMem[0xFF4B] = 0x00; // WY - window Y
     internalMem[0xFFFF] = 0x00; // IE - Interrupt enable
+    updatePalettes();
+    spritesChanged = true;
 
     MBC1 = false;
     MBC2 = false;
@@ -206,7 +667,10 @@ void Emulator::resetCPU() {
 
     currentROMBank = 1;
 
-    memset(RAMBanks, 0, sizeof(RAMBanks));
+    // As many RAM banks as the header asks for
+    allocateRAMBanks(cartridgeMem[0x149]);
+    memset(RAMBanks.memory, 0, RAMBanks.size);
+    RAMBanksChanged = false;
     currentRAMBank = 0;
 
     // Initialize timers. Initial clock speed is 4096hz
@@ -223,27 +687,54 @@ void Emulator::resetCPU() {
 
     // Graphics
     scanlineCycleCount = 456;
+    framesToSkip = frameSkip;
     doRenderPtr = nullptr;
-    memset(displayPixels, 0, sizeof(displayPixels));
+    allocateFramebuffers();
+    memset(shadePixels, 0, shadeBytes);
+    if (displayPixels != nullptr) {
+        memset(displayPixels, 0, displayBytes);
+    }
+    if (packedPixels != nullptr) {
+        memset(packedPixels, 0, packedBytes);
+    }
+    if (tileBuffer.memory == nullptr) {
+        tileBuffer.allocate(tileRowCount * 8, arena);
+        tileRows = reinterpret_cast<BYTE(*)[8]>(tileBuffer.memory);
+    }
+    decodeAllTiles();
+
+    // Scheduler
+    cycleCounter = 0;
+    lastSyncCycle = 0;
+    nextSyncCycle = 0;
+    runTargetCycle = 0;
+    idleCyclesSkipped = 0;
+
+    // Block cache
+    blockLookups = 0;
+    clearBlockCache();
+
+    mapMemory();
+    markAllDirty();
 
 }
 
 bool Emulator::loadGame(string file_path) {
 
-    memset(cartridgeMem, 0, sizeof(cartridgeMem));
+    // Mapped, or shared with other Emulators that loaded it already
+    shared_ptr<const ROMImage> image = ROMImage::open(file_path);
+    if (image == nullptr) {
+        return false;
+    }
 
-    // read rom into vector
-    ifstream file(file_path.c_str(), ios::binary);
-    // assert(file.good());
+    ROM = image;
+    cartridgeMem = ROM->data();
+    allocateRAMBanks(cartridgeMem[0x149]);
 
-    // resize & read rom
-    file.seekg(0, ios::end);
-    streampos size = file.tellg();
-    file.seekg(0, ios::beg);
-    file.read(reinterpret_cast<char *>(&cartridgeMem[0]), size);
-    
-    // Copy ROM banks 0 & 1 to internal memory
-    copy_n(&cartridgeMem[0], 0x8000, &internalMem[0]);
+    // ROM banks 0 & 1 are read from the image
+    clearBlockCache();
+    mapMemory();
+    markAllDirty();
 
     return true;
 
@@ -266,836 +757,1430 @@ bool Emulator::loadGame(string file_path) {
     // fread(cartridgeMem, fileSize, 1, in);
     // fclose(in);
 
-    // // Copy ROM Banks 0 & 1 to internal memory
-    // memcpy(internalMem, cartridgeMem, 0x8000) ; // this is read only and never changes
+    // // Copy ROM Banks 0 & 1 to internal memory
+    // memcpy(internalMem, cartridgeMem, 0x8000) ; // this is read only and never changes
+
+}
+
+uint64_t Emulator::getROMHash() const {
+    return ROM->hash();
+}
+
+// Cheap to call often, it only writes when the game wrote to RAM since
+void Emulator::saveGame(string fileName) {
+
+    // if (!MBC1 && !MBC2) return;
+    if (!RAMBanksChanged) {
+        return;
+    }
+
+    FileWriter::shared().write(fileName, vector<BYTE>(RAMBanks.memory, RAMBanks.memory + RAMBanks.size));
+    RAMBanksChanged = false;
+
+}
+
+void Emulator::update() { // MAIN UPDATE LOOP
+
+    // update function called 60 times per second -> screen rendered @ 60fps
+
+    // Always a whole frame from where the last one ended, cycles run past 
+    // it are not carried over
+    stopCondition = STOP_NONE;
+    run(cycleCounter + maxCycles);
+    runTargetCycle = cycleCounter;
+
+}
+
+/*
+********************************************************************************
+BATCH EXECUTION
+********************************************************************************
+*/
+
+/*
+
+update() runs one frame at a time for the SDL loop. runCycles, runFrames and 
+runUntilPC/runUntilMemory run any number of cycles without it, for tools and 
+tests. Nothing calls back per frame unless setRenderGraphics was given a 
+function.
+
+Instructions are never cut short, so a run usually ends a few cycles past its 
+budget. runTargetCycle remembers where it should have ended, and the next run
+ends that much earlier, so a sequence of runs adds up to exactly the cycles 
+asked for. A run that stops at its condition starts over from there.
+
+The conditions are checked after every instruction. While one is set, the JIT 
+is not used since compiled blocks only return to run() at a sync.
+
+*/
+
+Emulator::RunResult Emulator::runCycles(uint64_t cycles) {
+    stopCondition = STOP_NONE;
+    return runBatch(cycles);
+}
+
+Emulator::RunResult Emulator::runFrames(int frames) {
+    stopCondition = STOP_NONE;
+    return runBatch((uint64_t)frames * maxCycles);
+}
+
+// Stops after the first instruction that leaves PC at address, or when the 
+// budget runs out
+Emulator::RunResult Emulator::runUntilPC(WORD address, uint64_t budget) {
+    stopCondition = STOP_AT_PC;
+    stopAddress = address;
+    return runBatch(budget);
+}
+
+// Stops after the first instruction that leaves value at address, or when 
+// the budget runs out
+Emulator::RunResult Emulator::runUntilMemory(WORD address, BYTE value, uint64_t budget) {
+    stopCondition = STOP_AT_MEMORY;
+    stopAddress = address;
+    stopValue = value;
+    return runBatch(budget);
+}
+
+Emulator::RunResult Emulator::runBatch(uint64_t cycles) {
+
+    uint64_t startCycle = cycleCounter;
+    runTargetCycle += cycles;
+
+    RunResult result;
+    result.conditionMet = (runTargetCycle > cycleCounter) && run(runTargetCycle);
+
+    if (result.conditionMet) {
+        runTargetCycle = cycleCounter;
+    }
+
+    result.cycles = cycleCounter - startCycle;
+    result.overshoot = (cycleCounter > runTargetCycle) ? cycleCounter - runTargetCycle : 0;
+    return result;
+
+}
+
+// Runs until cycleCounter reaches endCycle, returns true if it stopped at 
+// stopCondition first
+bool Emulator::run(uint64_t endCycle) {
+
+    runEndCycle = endCycle;
+    idleCyclesSkipped = 0;
+    bool conditionMet = false;
+
+    // Buttons pressed or a state loaded since the last run may have changed
+    // what happens next
+    scheduleNextSync();
+
+    while (cycleCounter < endCycle) {
+
+        // Iterations of a busy-wait loop that end before the next sync all do
+        // the same, so they are skipped
+        if (idleLoopDetection) {
+            skipIdleLoop();
+        }
+
+        // Hot blocks run as native code, which keeps the cycle count and 
+        // syncs the hardware itself. Only where a new block starts, not 
+        // halfway through one the interpreter is running
+        bool blockStarts = (currentBlock == nullptr) 
+            || (blockIndex == currentBlock->instructions.size())
+            || (programCounter.regstr != nextBlockAddress);
+        if (JITEnabled && (stopCondition == STOP_NONE) && !isHalted && blockStarts 
+                && runCompiledBlock()) {
+            continue;
+        }
+
+        // While halted, skip straight to the next sync since nothing can 
+        // wake the CPU before it
+        int cycles = isHalted ? haltCycles() 
+            : executeNextOpcode(); //executeNextOpcode will return the number of cycles taken
+        cycleCounter += cycles;
+
+        // The timers, graphics and interrupts are only updated once they 
+        // can change something
+        if (cycleCounter >= nextSyncCycle) {
+            syncHardware();
+        }
+
+        if ((stopCondition != STOP_NONE) && stopConditionMet()) {
+            conditionMet = true;
+            break;
+        }
+
+    }
+
+    // Leave the timers and graphics up to date between runs
+    if (cycleCounter > lastSyncCycle) {
+        syncHardware();
+    }
+
+    return conditionMet;
+
+}
+
+bool Emulator::stopConditionMet() const {
+    switch (stopCondition) {
+        case STOP_AT_PC : return programCounter.regstr == stopAddress;
+        case STOP_AT_MEMORY : return readMem(stopAddress) == stopValue;
+        default : return false;
+    }
+}
+
+void Emulator::setRenderGraphics(void(*funcPtr)()) {
+    doRenderPtr = funcPtr;
+}
+
+int Emulator::executeNextOpcode() {
+    int clockCycles;
+
+    if (isHalted) {
+        return NOP();
+    }
+
+    // Continue with the next instruction of the current block if PC has
+    // fallen through to it, otherwise look up (or decode) the block at PC
+    if (currentBlock == nullptr 
+            || blockIndex == currentBlock->instructions.size()
+            || programCounter.regstr != nextBlockAddress) {
+        currentBlock = lookupBlock(programCounter.regstr);
+        blockIndex = 0;
+    }
+
+    // Code outside of ROM, WRAM and HRAM is interpreted directly
+    if (currentBlock == nullptr) {
+        BYTE opcode = readMem(programCounter.regstr);
+        programCounter.regstr++;
+        return executeOpcode(opcode);
+    }
+
+    const DecodedInstruction& instruction = currentBlock->instructions[blockIndex];
+    blockIndex++;
+    nextBlockAddress = programCounter.regstr + instruction.length;
+
+    // Operands were read when the block was decoded, so the handler picks 
+    // them up from decodedOperand through fetchByte instead of readMem
+    decodedOperand[0] = instruction.operand[0];
+    decodedOperand[1] = instruction.operand[1];
+    nextOperand = &decodedOperand[0];
+
+    programCounter.regstr++;
+    clockCycles = (this->*instruction.handler)();
+    nextOperand = nullptr;
+
+    return clockCycles;
+}
+
+BYTE Emulator::fetchByte() {
+    BYTE data = (nextOperand != nullptr) 
+        ? *nextOperand++ 
+        : readMem(programCounter.regstr);
+    programCounter.regstr++;
+    return data;
+}
+
+WORD Emulator::fetchWord() {
+    WORD lowByte = fetchByte();
+    WORD highByte = fetchByte();
+    return (highByte << 8) | lowByte;
+}
+
+int Emulator::executeOpcode(BYTE opcode) {
+    return (this->*opcodeTable[opcode])();
+}
+
+int Emulator::executeCBOpcode() {
+
+    BYTE opcode = fetchByte();
+
+    return (this->*CBOpcodeTable[opcode])();
+
+}
+
+/*
+********************************************************************************
+SCHEDULER
+********************************************************************************
+*/
+
+/*
+
+updateTimers, updateGraphics and handleInterrupts used to run after every 
+instruction, although most of the time all they do is count down. Instead, 
+cycleCounter counts every cycle since resetCPU, and the hardware is only 
+updated (syncHardware) with all cycles since lastSyncCycle once cycleCounter 
+reaches nextSyncCycle: the first cycle at which one of the updates would do 
+more than count down. That is the earliest of:
+
+- DIV increments: dividerCounter reaches 256
+- TIMA increments: timerCounter reaches 0, if the timer is enabled
+- the scanline ends: scanlineCycleCount reaches 0, if the LCD is enabled
+- the LCD mode changes: scanlineCycleCount drops below 376 or 204 (lines 0-143)
+
+setLCDStatus only sees a mode change on the update after the instruction that
+crossed into the new mode, so that update has to run right after the next 
+instruction. The same goes whenever the next setLCDStatus would change STAT or 
+request an interrupt (see LCDStatusChanging), and whenever an interrupt can be 
+serviced.
+
+Between two syncs the updates would only count down, so nothing the CPU can 
+read changes and running them once with the sum of the cycles gives exactly 
+the same result. Writes by the CPU that change the timing (TAC, IF, LCDC, STAT,
+LY, LYC, IE) first bring the hardware up to date with the cycles of the 
+instructions before (catchUpHardware), and force a sync when the instruction 
+is done, as do EI and RETI.
+
+This also means that a halted CPU can skip all cycles up to the next sync in
+one go (haltCycles), instead of spending them 4 at a time.
+
+There are only 4 event sources, so the next sync is worked out again from the 
+counters after each one rather than kept in a queue.
+
+*/
+
+// Updates the hardware with the cycles run since the last sync and works out
+// when the next one is due
+void Emulator::syncHardware() {
+
+    int cycles = cycleCounter - lastSyncCycle;
+    lastSyncCycle = cycleCounter;
+
+    updateTimers(cycles);
+    updateGraphics(cycles);
+    handleInterrupts();
+
+    scheduleNextSync();
+
+}
+
+// Called before a write to a register that changes the timing, in the middle
+// of an instruction. The cycles of this instruction are applied by the sync 
+// after it.
+void Emulator::catchUpHardware() {
+
+    int cycles = cycleCounter - lastSyncCycle;
+    if (cycles > 0) {
+        lastSyncCycle = cycleCounter;
+        updateTimers(cycles);
+        updateGraphics(cycles);
+    }
+
+    nextSyncCycle = cycleCounter;
+
+}
+
+// Returns the cycles a halted CPU spends until the next sync, or until the 
+// run ends if that comes first. Halting runs in steps of 4 cycles (as NOP),
+// so this is rounded up to the step that reaches it.
+int Emulator::haltCycles() {
+
+    uint64_t cycles = 0;
+    if (nextSyncCycle > cycleCounter) {
+        cycles = min(nextSyncCycle, runEndCycle) - cycleCounter;
+    }
+
+    return max<int>(4, (cycles + 3) & ~3);
+
+}
+
+void Emulator::scheduleNextSync() {
+
+    // DIV
+    int cycles = 256 - dividerCounter;
+
+    // TIMA
+    if (clockEnabled()) {
+        cycles = min(cycles, timerCounter);
+    }
+
+    if (LCDEnabled()) {
+
+        // LCD mode 2 -> 3 and 3 -> 0
+        if (internalMem[0xFF44] < 144) {
+            if (scanlineCycleCount >= 376) {
+                cycles = min(cycles, scanlineCycleCount - 375);
+            } else if (scanlineCycleCount >= 204) {
+                cycles = min(cycles, scanlineCycleCount - 203);
+            }
+        }
+
+        // End of the scanline
+        cycles = min(cycles, scanlineCycleCount);
+
+    }
+
+    // Sync right after the next instruction
+    bool interruptPending = InterruptMasterEnabled 
+        && ((internalMem[0xFF0F] & internalMem[0xFFFF]) > 0);
+    if (LCDStatusChanging() || interruptPending) {
+        cycles = 0;
+    }
+
+    nextSyncCycle = lastSyncCycle + max(cycles, 0);
+
+}
+
+// Returns true if the next setLCDStatus would change STAT or request an 
+// interrupt
+bool Emulator::LCDStatusChanging() {
+
+    BYTE status = internalMem[0xFF41];
+    BYTE currentLine = internalMem[0xFF44];
+
+    if (!LCDEnabled()) {
+        return ((status & 0x3) != 0x1) || (currentLine != 0) || (scanlineCycleCount != 456);
+    }
+
+    BYTE mode = 0;
+    if (currentLine >= 144) mode = 1;
+    else if (scanlineCycleCount >= 376) mode = 2;
+    else if (scanlineCycleCount >= 204) mode = 3;
+
+    bool coincidence = (currentLine == internalMem[0xFF45]);
+
+    // With the coincidence interrupt enabled, every update requests it again
+    return ((status & 0x3) != mode) 
+        || (isBitSet(status, 2) != coincidence)
+        || (coincidence && isBitSet(status, 6));
+
+}
+
+/*
+********************************************************************************
+IDLE LOOPS
+********************************************************************************
+*/
+
+/*
+
+Games that do not HALT wait in busy loops instead, polling a register until 
+the hardware changes it:
+
+    wait:   LD A, (FF00+44)     ; LY
+            CP 144
+            JR NZ, wait
+
+Between two syncs nothing but the CPU writes to memory (see SCHEDULER). So if 
+one iteration of a loop that only reads memory and changes registers ends with
+the registers as they were when it started, and no sync happened during it, 
+every further iteration does exactly the same until the next sync.
+
+decodeBlock marks blocks whose first idleLoopLength instructions have no side
+effects (hasNoSideEffects) and end with a branch back to the start. Whenever 
+such a block branches back to its start, skipIdleLoop compares the registers 
+with those of the previous time. blockLookups tells whether anything else ran
+in between. If they match, all iterations that end before the next sync (or 
+the end of the run) are skipped by adding their cycles at once. The next 
+iteration then runs normally and meets the sync, as it would have.
+
+While detection is on, the JIT compiles only the loop of these blocks and
+returns to run() after each pass instead of looping in native code, so the 
+passes are still compared. setIdleLoopDetection(false) turns it off, to 
+compare against plain execution. idleCyclesSkipped counts the skipped cycles
+of a whole run, a frame for update() but every frame of a runFrames. It is set
+back to 0 when the next run starts.
+
+*/
+
+void Emulator::setIdleLoopDetection(bool enabled) {
+    idleLoopDetection = enabled;
+    idleLoopBlock = nullptr;
+}
+
+bool Emulator::isIdleLoopDetectionEnabled() const {
+    return idleLoopDetection;
+}
+
+uint64_t Emulator::getIdleCyclesSkippedInRun() const {
+    return idleCyclesSkipped;
+}
+
+// Skips the iterations of an idle loop at PC, if there is one
+void Emulator::skipIdleLoop() {
+
+    // Only when a loop has branched back to its start
+    CodeBlock* block = currentBlock;
+    if ((block == nullptr) || (programCounter.regstr != block->start) 
+            || (programCounter.regstr == nextBlockAddress)
+            || (blockIndex > block->idleLoopLength)) {
+        return;
+    }
+
+    materializeFlags();
+    WORD registers[5] = {regAF.regstr, regBC.regstr, regDE.regstr, regHL.regstr, stackPointer.regstr};
+
+    // Was the previous iteration the same loop, with nothing else running 
+    // in between, no sync and the same registers at the start?
+    bool sameIteration = (block == idleLoopBlock)
+        && (blockLookups == idleLoopLookups + 1)
+        && (lastSyncCycle == idleLoopSyncCycle)
+        && (memcmp(registers, idleLoopRegisters, sizeof(registers)) == 0);
+
+    if (sameIteration) {
+
+        // Iterations that end before the next sync and the end of the run
+        uint64_t iterationCycles = cycleCounter - idleLoopCycle;
+        uint64_t endCycle = min(nextSyncCycle, runEndCycle);
+        uint64_t iterations = (endCycle > cycleCounter) ? (endCycle - cycleCounter - 1) / iterationCycles : 0;
+
+        uint64_t skipped = iterations * iterationCycles;
+        cycleCounter += skipped;
+        idleCyclesSkipped += skipped;
+    }
+
+    idleLoopBlock = block;
+    memcpy(idleLoopRegisters, registers, sizeof(registers));
+    idleLoopCycle = cycleCounter;
+    idleLoopSyncCycle = lastSyncCycle;
+    idleLoopLookups = blockLookups;
+
+}
+
+/*
+********************************************************************************
+LAZY FLAGS
+********************************************************************************
+*/
+
+/*
+
+The 8 bit ALU instructions (ADD, ADC, SUB, SBC, AND, XOR, OR, CP, INC, DEC) 
+don't set F themselves. They store which kind of operation it was, its operands
+and its result, and the flags are only worked out from those when something 
+reads F. Most of the time another ALU instruction overwrites them before that 
+happens.
+
+flagOperation  flagOperand1     flagOperand2  F
+FLAGS_READY    -                -             regAF.low is up to date
+FLAGS_ADD      A                operand       Z 0 H C
+FLAGS_SUB      A                operand       Z 1 H C
+FLAGS_AND      -                -             Z 0 1 0
+FLAGS_OR       -                -             Z 0 0 0  (also XOR)
+FLAGS_INC      bits of F kept   -             Z 0 H  + kept bits
+FLAGS_DEC      bits of F kept   -             Z 1 H  + kept bits
+
+ADC and SBC store the operand with the carry already added. 
+
+Instructions that read F or only change some of its bits call materializeFlags 
+first (see readsFlags), as do saveState and the JIT.
+
+*/
+
+void Emulator::setLazyFlags(FlagOperation operation, BYTE operand1, BYTE operand2, BYTE result) {
+    flagOperation = operation;
+    flagOperand1 = operand1;
+    flagOperand2 = operand2;
+    flagResult = result;
+}
+
+// Works out F from the last ALU operation
+void Emulator::materializeFlags() {
+
+    regAF.low = currentFlags();
+    flagOperation = FLAGS_READY;
+
+}
+
+// F as materializeFlags would leave it
+BYTE Emulator::currentFlags() const {
+
+    BYTE flags = 0;
+    BYTE zero = (flagResult == 0) ? (1 << FLAG_ZERO) : 0;
+
+    switch (flagOperation) {
+        case FLAGS_READY:
+            return regAF.low;
+
+        case FLAGS_ADD:
+            flags = zero;
+            if ((flagOperand1 ^ flagOperand2 ^ flagResult) & 0x10) {
+                flags = bitSet(flags, FLAG_HALFCARRY);
+            }
+            if (flagResult < flagOperand1) {
+                flags = bitSet(flags, FLAG_CARRY);
+            }
+            break;
+
+        case FLAGS_SUB:
+            flags = bitSet(zero, FLAG_SUB);
+            if ((flagOperand1 & 0x0F) < (flagOperand2 & 0x0F)) {
+                flags = bitSet(flags, FLAG_HALFCARRY);
+            }
+            if (flagOperand1 < flagOperand2) {
+                flags = bitSet(flags, FLAG_CARRY);
+            }
+            break;
+
+        case FLAGS_AND:
+            flags = bitSet(zero, FLAG_HALFCARRY);
+            break;
+
+        case FLAGS_OR:
+            flags = zero;
+            break;
+
+        // Half carry if the lower nibble overflowed to 0x0 
+        case FLAGS_INC:
+            flags = flagOperand1 | zero;
+            if ((flagResult & 0x0F) == 0x00) {
+                flags = bitSet(flags, FLAG_HALFCARRY);
+            }
+            break;
+
+        // Half carry if the lower nibble borrowed, leaving 0xF
+        case FLAGS_DEC:
+            flags = bitSet(flagOperand1 | zero, FLAG_SUB);
+            if ((flagResult & 0x0F) == 0x0F) {
+                flags = bitSet(flags, FLAG_HALFCARRY);
+            }
+            break;
+    }
+
+    return flags;
+
+}
+
+// The carry flag, without materializing the rest of F
+bool Emulator::lazyCarry() const {
+    switch (flagOperation) {
+        case FLAGS_ADD: return flagResult < flagOperand1;
+        case FLAGS_SUB: return flagOperand1 < flagOperand2;
+        case FLAGS_AND:
+        case FLAGS_OR: return false;
+        case FLAGS_INC:
+        case FLAGS_DEC: return isBitSet(flagOperand1, FLAG_CARRY);
+        default: return isBitSet(regAF.low, FLAG_CARRY);
+    }
+}
+
+// The bits of F that INC and DEC leave alone: the carry and the unused bits
+BYTE Emulator::preservedFlags() const {
+    switch (flagOperation) {
+        case FLAGS_READY: return regAF.low & 0x1F;
+        case FLAGS_INC:
+        case FLAGS_DEC: return flagOperand1;
+        default: return lazyCarry() ? (1 << FLAG_CARRY) : 0x00;
+    }
+}
+
+// Instructions that need F to be up to date before they run: conditional 
+// jumps, calls and returns, PUSH/POP AF, the rotates, DAA, CPL, SCF, CCF, 
+// ADD HL, rr, ADD SP, dd, LD HL, SP + dd and every CB-prefixed instruction
+constexpr bool readsFlags(int opcode) {
+
+    int x = opcode >> 6;
+    int z = opcode & 0x7;
+
+    if (x == 0) {
+        return (z == 7) 
+            || ((z == 0) && (opcode >= 0x20)) 
+            || ((z == 1) && (opcode & 0x08));
+    }
+
+    if (x == 3) {
+        return ((opcode < 0xE0) && ((z == 0) || (z == 2) || (z == 4))) 
+            || opcode == 0xF1 || opcode == 0xF5 
+            || opcode == 0xE8 || opcode == 0xF8 
+            || opcode == 0xCB;
+    }
+
+    return false;
+
+}
+
+/*
+********************************************************************************
+OPCODE DISPATCH TABLES
+********************************************************************************
+*/
+
+/*
+
+Instead of switching over all 256 opcodes (and another 256 for the CB prefix)
+on every instruction, the opcode is used to index into a table of handlers. The
+tables are generated at compile time: each entry is an instantiation of
+executeOp<opcode> / executeCBOp<opcode>, which decodes the opcode's bit fields
+with if constexpr so that only the matching helper call survives, with its
+register operands already resolved.
+
+Opcodes are decoded as:
+Bits  7 6 | 5 4 3 | 2 1 0
+        x |   y   |   z
+where y = p q (p is bits 5-4, q is bit 3)
+
+8 bit register operands (y or z):
+0: B, 1: C, 2: D, 3: E, 4: H, 5: L, 6: (HL), 7: A
+
+16 bit register operands (p):
+0: BC, 1: DE, 2: HL, 3: SP (AF for PUSH/POP)
+
+*/
+
+template <size_t... opcodes>
+constexpr array<Emulator::OpcodeHandler, 256> Emulator::makeOpcodeTable(index_sequence<opcodes...>) {
+    return {{ &Emulator::executeOp<opcodes>... }};
+}
+
+template <size_t... opcodes>
+constexpr array<Emulator::OpcodeHandler, 256> Emulator::makeCBOpcodeTable(index_sequence<opcodes...>) {
+    return {{ &Emulator::executeCBOp<opcodes>... }};
+}
+
+template <int r>
+BYTE& Emulator::reg8() {
+    static_assert(r >= 0 && r <= 7 && r != 6, "(HL) is not a register");
+    if constexpr (r == 0) return regBC.high;
+    else if constexpr (r == 1) return regBC.low;
+    else if constexpr (r == 2) return regDE.high;
+    else if constexpr (r == 3) return regDE.low;
+    else if constexpr (r == 4) return regHL.high;
+    else if constexpr (r == 5) return regHL.low;
+    else return regAF.high;
+}
+
+template <int rr>
+Register& Emulator::reg16() {
+    if constexpr (rr == 0) return regBC;
+    else if constexpr (rr == 1) return regDE;
+    else if constexpr (rr == 2) return regHL;
+    else return stackPointer;
+}
+
+template <int rr>
+Register& Emulator::reg16Stack() {
+    // PUSH and POP use AF in place of SP
+    if constexpr (rr == 3) return regAF;
+    else return reg16<rr>();
+}
+
+template <int op, int r>
+int Emulator::executeALU() {
+
+    // ALU A, (HL)
+    if constexpr (r == 6) {
+        if constexpr (op == 0) return ADD_A_HL();
+        else if constexpr (op == 1) return ADC_A_HL();
+        else if constexpr (op == 2) return SUB_HL();
+        else if constexpr (op == 3) return SBC_A_HL();
+        else if constexpr (op == 4) return AND_HL();
+        else if constexpr (op == 5) return XOR_HL();
+        else if constexpr (op == 6) return OR_HL();
+        else return CP_HL();
+    }
+
+    // ALU A, r
+    else {
+        if constexpr (op == 0) return ADD_A_r(reg8<r>());
+        else if constexpr (op == 1) return ADC_A_r(reg8<r>());
+        else if constexpr (op == 2) return SUB_r(reg8<r>());
+        else if constexpr (op == 3) return SBC_A_r(reg8<r>());
+        else if constexpr (op == 4) return AND_r(reg8<r>());
+        else if constexpr (op == 5) return XOR_r(reg8<r>());
+        else if constexpr (op == 6) return OR_r(reg8<r>());
+        else return CP_r(reg8<r>());
+    }
+
+}
+
+template <int opcode>
+int Emulator::executeOp() {
+
+    constexpr int x = opcode >> 6;
+    constexpr int y = (opcode >> 3) & 0x7;
+    constexpr int z = opcode & 0x7;
+    constexpr int p = y >> 1;
+    constexpr int q = y & 0x1;
+
+    // Flags left pending by the last ALU instruction
+    if constexpr (readsFlags(opcode)) {
+        materializeFlags();
+    }
+
+    /*
+    ************************************************************************
+    0x40 - 0x7F: 8 bit Load Commands, LD r, R/(HL) and LD (HL), r
+    ************************************************************************
+    */
+    if constexpr (opcode == 0x76) return HALT();
+    else if constexpr (x == 1) {
+        if constexpr (y == 6) return LD_HL_r(reg8<z>());
+        else if constexpr (z == 6) return LD_r_HL(reg8<y>());
+        else return LD_r_R(reg8<y>(), reg8<z>());
+    }
+
+    /*
+    ************************************************************************
+    0x80 - 0xBF: 8 bit Arithmetic/Logical Commands, ALU A, r/(HL)
+    ************************************************************************
+    */
+    else if constexpr (x == 2) return executeALU<y, z>();
+
+    /*
+    ************************************************************************
+    0x00 - 0x3F
+    ************************************************************************
+    */
+    else if constexpr (x == 0) {
+
+        // NOP, LD (nn) SP, STOP, JR PC + dd, JR f, PC + dd
+        if constexpr (z == 0) {
+            if constexpr (y == 0) return NOP();
+            else if constexpr (y == 1) return LD_nn_SP();
+            else if constexpr (y == 2) return STOP();
+            else if constexpr (y == 3) return JR_PCdd();
+            else return JR_f_PCdd(opcode);
+        }
+
+        // LD rr, nn and ADD HL, rr
+        else if constexpr (z == 1) {
+            if constexpr (q == 0) return LD_rr_nn(reg16<p>());
+            else return ADD_HL_rr(reg16<p>().regstr);
+        }
+
+        // Load (BC)/(DE)/(HL+)/(HL-), A and vice versa
+        else if constexpr (z == 2) {
+            if constexpr (opcode == 0x02) return LD_BC_A();
+            else if constexpr (opcode == 0x12) return LD_DE_A();
+            else if constexpr (opcode == 0x22) return LDI_HL_A();
+            else if constexpr (opcode == 0x32) return LDD_HL_A();
+            else if constexpr (opcode == 0x0A) return LD_A_BC();
+            else if constexpr (opcode == 0x1A) return LD_A_DE();
+            else if constexpr (opcode == 0x2A) return LDI_A_HL();
+            else return LDD_A_HL();
+        }
+
+        // INC rr and DEC rr
+        else if constexpr (z == 3) {
+            if constexpr (q == 0) return INC_rr(reg16<p>().regstr);
+            else return DEC_rr(reg16<p>().regstr);
+        }
+
+        // INC r/(HL)
+        else if constexpr (z == 4) {
+            if constexpr (y == 6) return INC_HL();
+            else return INC_r(reg8<y>());
+        }
+
+        // DEC r/(HL)
+        else if constexpr (z == 5) {
+            if constexpr (y == 6) return DEC_HL();
+            else return DEC_r(reg8<y>());
+        }
+
+        // LD r/(HL), n
+        else if constexpr (z == 6) {
+            if constexpr (y == 6) return LD_HL_n();
+            else return LD_r_n(reg8<y>());
+        }
+
+        // Non CB-prefixed rotate commands, DAA, CPL, SCF, CCF
+        else {
+            if constexpr (y == 0) return RLCA();
+            else if constexpr (y == 1) return RRCA();
+            else if constexpr (y == 2) return RLA();
+            else if constexpr (y == 3) return RRA();
+            else if constexpr (y == 4) return DAA();
+            else if constexpr (y == 5) return CPL();
+            else if constexpr (y == 6) return SCF();
+            else return CCF();
+        }
+
+    }
+
+    /*
+    ************************************************************************
+    0xC0 - 0xFF
+    ************************************************************************
+    */
+    else {
+
+        // RET f, LD (FF00+n), A, ADD SP, dd, LD A, (FF00+n), LD HL, SP + dd
+        if constexpr (z == 0) {
+            if constexpr (y < 4) return RET_f(opcode);
+            else if constexpr (y == 4) return LD_FF00n_A();
+            else if constexpr (y == 5) return ADD_SP_dd();
+            else if constexpr (y == 6) return LD_A_FF00n();
+            else return LD_HL_SPdd();
+        }
+
+        // POP rr, RET, RETI, JP HL, LD SP, HL
+        else if constexpr (z == 1) {
+            if constexpr (q == 0) return POP_rr(reg16Stack<p>());
+            else if constexpr (p == 0) return RET();
+            else if constexpr (p == 1) return RETI();
+            else if constexpr (p == 2) return JP_HL();
+            else return LD_SP_HL();
+        }
+
+        // JP f, nn, LD (FF00+C), A, LD (nn), A, LD A, (FF00+C), LD A, (nn)
+        else if constexpr (z == 2) {
+            if constexpr (y < 4) return JP_f_nn(opcode);
+            else if constexpr (y == 4) return LD_FF00C_A();
+            else if constexpr (y == 5) return LD_nn_A();
+            else if constexpr (y == 6) return LD_A_FF00C();
+            else return LD_A_nn();
+        }
+
+        // JP nn, CB prefix, DI, EI
+        else if constexpr (opcode == 0xC3) return JP_nn();
+        else if constexpr (opcode == 0xCB) return executeCBOpcode();
+        else if constexpr (opcode == 0xF3) return DI();
+        else if constexpr (opcode == 0xFB) return EI();
+
+        // CALL f, nn
+        else if constexpr (z == 4 && y < 4) return CALL_f_nn(opcode);
+
+        // PUSH rr, CALL nn
+        else if constexpr (z == 5 && q == 0) return PUSH_rr(reg16Stack<p>());
+        else if constexpr (opcode == 0xCD) return CALL_nn();
+
+        // ALU A, n
+        else if constexpr (z == 6) {
+            if constexpr (y == 0) return ADD_A_n();
+            else if constexpr (y == 1) return ADC_A_n();
+            else if constexpr (y == 2) return SUB_n();
+            else if constexpr (y == 3) return SBC_A_n();
+            else if constexpr (y == 4) return AND_n();
+            else if constexpr (y == 5) return XOR_n();
+            else if constexpr (y == 6) return OR_n();
+            else return CP_n();
+        }
+
+        // RST n
+        else if constexpr (z == 7) return RST_n(opcode);
+
+        // Unused opcodes (0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB, 0xEC, 0xED,
+        // 0xF4, 0xFC, 0xFD) lock up the real CPU, here they behave as NOP
+        else return NOP();
+
+    }
+
+}
+
+template <int opcode>
+int Emulator::executeCBOp() {
+
+    constexpr int x = opcode >> 6;
+    constexpr int y = (opcode >> 3) & 0x7;
+    constexpr int z = opcode & 0x7;
+
+    /*
+    ************************************************************************
+    Rotate and Shift commands
+    ************************************************************************
+    */
+    if constexpr (x == 0 && z == 6) {
+        if constexpr (y == 0) return RLC_HL();
+        else if constexpr (y == 1) return RRC_HL();
+        else if constexpr (y == 2) return RL_HL();
+        else if constexpr (y == 3) return RR_HL();
+        else if constexpr (y == 4) return SLA_HL();
+        else if constexpr (y == 5) return SRA_HL();
+        else if constexpr (y == 6) return SWAP_HL();
+        else return SRL_HL();
+    }
+    else if constexpr (x == 0) {
+        if constexpr (y == 0) return RLC_r(reg8<z>());
+        else if constexpr (y == 1) return RRC_r(reg8<z>());
+        else if constexpr (y == 2) return RL_r(reg8<z>());
+        else if constexpr (y == 3) return RR_r(reg8<z>());
+        else if constexpr (y == 4) return SLA_r(reg8<z>());
+        else if constexpr (y == 5) return SRA_r(reg8<z>());
+        else if constexpr (y == 6) return SWAP_r(reg8<z>());
+        else return SRL_r(reg8<z>());
+    }
+
+    /*
+    ************************************************************************
+    Single bit operation commands, y is the bit number
+    ************************************************************************
+    */
+    else if constexpr (x == 1) {
+        if constexpr (z == 6) return BIT_n_HL(y);
+        else return BIT_n_r(reg8<z>(), y);
+    }
+    else if constexpr (x == 2) {
+        if constexpr (z == 6) return RES_n_HL(y);
+        else return RES_n_r(reg8<z>(), y);
+    }
+    else {
+        if constexpr (z == 6) return SET_n_HL(y);
+        else return SET_n_r(reg8<z>(), y);
+    }
+
+}
+
+const array<Emulator::OpcodeHandler, 256> Emulator::opcodeTable =
+    Emulator::makeOpcodeTable(make_index_sequence<256>());
+
+const array<Emulator::OpcodeHandler, 256> Emulator::CBOpcodeTable =
+    Emulator::makeCBOpcodeTable(make_index_sequence<256>());
+
+
+/*
+********************************************************************************
+BLOCK CACHE
+********************************************************************************
+*/
+
+/*
+
+Straight-line runs of instructions are decoded once into a CodeBlock: for each
+instruction its handler from opcodeTable, its length and its operand bytes.
+executeNextOpcode then runs instructions from the block without fetching the
+opcode or operands through readMem.
+
+Blocks are cached by start address. Blocks in the switchable ROM bank area
+(0x4000-0x7FFF) also include currentROMBank in the key. Only code in ROM, Work
+RAM (0xC000-0xDFFF) and High RAM (0xFF80-0xFFFE) is cached. ROM never changes
+while a game is loaded, but a write to RAM covered by a cached block throws
+away every block containing that byte. codeBytes marks which RAM bytes are
+covered, so other writes only cost a bit test. RAMBlocks lists the blocks on
+each 256 byte page of RAM, so throwing them away only looks at the blocks on
+the pages written to.
+
+A block ends after an unconditional jump, return, RST, HALT or STOP, at the end
+of its memory region, or after maxBlockLength instructions. Conditional
+branches do not end a block. If the branch is taken, PC no longer matches
+nextBlockAddress and the target block is looked up instead.
+
+*/
+
+// Number of bytes taken by each opcode, including the opcode itself
+constexpr BYTE instructionLength(BYTE opcode) {
+
+    int x = opcode >> 6;
+    int y = (opcode >> 3) & 0x7;
+    int z = opcode & 0x7;
+
+    if (x == 0) {
+        if (z == 0) return (y == 0 || y == 2) ? 1 : (y == 1) ? 3 : 2;
+        if (z == 1) return (y & 0x1) ? 1 : 3;
+        if (z == 6) return 2;
+        return 1;
+    }
+
+    if (x == 3) {
+        if (z == 0) return (y < 4) ? 1 : 2;
+        if (z == 2) return (y < 4 || y == 5 || y == 7) ? 3 : 1;
+        if (z == 3) return (opcode == 0xC3) ? 3 : (opcode == 0xCB) ? 2 : 1;
+        if (z == 4) return (y < 4) ? 3 : 1;
+        if (z == 5) return (opcode == 0xCD) ? 3 : 1;
+        if (z == 6) return 2;
+        return 1;
+    }
+
+    return 1;
+
+}
+
+// Instructions after which execution never falls through
+constexpr bool endsBlock(BYTE opcode) {
+    return opcode == 0x18 || opcode == 0xC3 || opcode == 0xC9 
+        || opcode == 0xD9 || opcode == 0xE9 || opcode == 0x76 
+        || opcode == 0x10 || ((opcode & 0xC7) == 0xC7);
+}
+
+// Instructions that change nothing but the registers, as allowed in an idle 
+// loop. CB prefixed ones are identified by operand, the CB opcode.
+constexpr bool hasNoSideEffects(BYTE opcode, BYTE operand) {
+
+    int x = opcode >> 6;
+    int y = (opcode >> 3) & 0x7;
+    int z = opcode & 0x7;
+
+    // LD r, R/(HL), not LD (HL), r or HALT
+    if (x == 1) return y != 6;
+
+    // ALU A, r/(HL)
+    if (x == 2) return true;
+
+    if (x == 0) {
+        if (z == 0) return (y == 0) || (y >= 3); // NOP, JR, JR f
+        if (z == 2) return (y & 0x1); // LD A, (BC)/(DE)/(HL+)/(HL-)
+        if (z >= 4 && z <= 6) return y != 6; // INC r, DEC r, LD r, n
+        return true; // LD rr, nn, ADD HL, rr, INC rr, DEC rr, rotate A, DAA, CPL, SCF, CCF
+    }
+
+    // RLC r ... SRL r, BIT n, r/(HL), RES n, r, SET n, r
+    if (opcode == 0xCB) return ((operand & 0x7) != 6) || ((operand >> 6) == 1);
+
+    return (opcode == 0xC3) // JP nn
+        || (z == 2 && y < 4) // JP f, nn
+        || (opcode == 0xF0) || (opcode == 0xF2) || (opcode == 0xFA) // LD A, (FF00+n)/(FF00+C)/(nn)
+        || (z == 6); // ALU A, n
+
+}
+
+// Returns the address a JR or JP nn at address jumps to when taken, or -1
+constexpr int branchTarget(BYTE opcode, WORD address, const BYTE* operand) {
+    if (opcode == 0x18 || ((opcode & 0xE7) == 0x20)) {
+        return (WORD)(address + 2 + (SIGNED_BYTE)operand[0]);
+    }
+    if (opcode == 0xC3 || ((opcode & 0xE7) == 0xC2)) {
+        return (operand[1] << 8) | operand[0];
+    }
+    return -1;
+}
+
+// Returns the end of the cacheable region containing address, or 0 if code
+// at address is not cached
+WORD Emulator::codeRegionEnd(WORD address) const {
+    if (address < 0x4000) return 0x4000;
+    if (address < 0x8000) return 0x8000;
+    if ((address >= 0xC000) && (address < 0xE000)) return 0xE000;
+    if ((address >= 0xFF80) && (address < 0xFFFF)) return 0xFFFF;
+    return 0;
+}
+
+Emulator::CodeBlock* Emulator::lookupBlock(WORD address) {
+
+    WORD regionEnd = codeRegionEnd(address);
+    if (regionEnd == 0) {
+        return nullptr;
+    }
+
+    uint32_t key = address;
+    if ((address >= 0x4000) && (address <= 0x7FFF)) {
+        key |= currentROMBank << 16;
+    }
+
+    blockLookups++;
+
+    auto found = blockCache.find(key);
+    if (found == blockCache.end()) {
+        found = blockCache.emplace(key, decodeBlock(address, regionEnd)).first;
+
+        // A block in RAM covers one or two pages
+        if (address >= 0xC000) {
+            const CodeBlock& block = found->second;
+            int lastPage = max(block.start, (WORD)(block.end - 1)) >> 8;
+            for (int page = block.start >> 8; page <= lastPage; page++) {
+                RAMBlocks[page - 0xC0].push_back(address);
+            }
+        }
+    }
+
+    CodeBlock* block = &found->second;
+    return block->instructions.empty() ? nullptr : block;
+
+}
+
+Emulator::CodeBlock Emulator::decodeBlock(WORD address, WORD regionEnd) {
+
+    CodeBlock block;
+    block.start = address;
+    block.executionCount = 0;
+    block.nativeCode = nullptr;
+    block.idleLoopLength = 0;
+    bool sideEffects = false;
+
+    while (block.instructions.size() < maxBlockLength) {
+
+        BYTE opcode = readMem(address);
+        BYTE length = instructionLength(opcode);
+
+        // Instruction runs past the end of the region
+        if (address + length > regionEnd) {
+            break;
+        }
+
+        DecodedInstruction instruction;
+        instruction.handler = opcodeTable[opcode];
+        instruction.length = length;
+        instruction.opcode = opcode;
+        instruction.operand[0] = (length > 1) ? readMem(address + 1) : 0;
+        instruction.operand[1] = (length > 2) ? readMem(address + 2) : 0;
+        block.instructions.push_back(instruction);
+
+        // Up to a branch back to the start without side effects before it, 
+        // the block may be an idle loop
+        sideEffects = sideEffects || !hasNoSideEffects(opcode, instruction.operand[0]);
+        if (!sideEffects && (branchTarget(opcode, address, instruction.operand) == block.start)) {
+            block.idleLoopLength = block.instructions.size();
+        }
+
+        address += length;
+
+        if (endsBlock(opcode)) {
+            break;
+        }
+    }
+
+    block.end = address;
+
+    // Mark the bytes of blocks in RAM so writes to them can be detected
+    if (block.start >= 0xC000) {
+        markCodeBytes(block);
+        mapWorkRAMWrites();
+    }
+
+    return block;
 
 }
 
-void Emulator::saveGame(string fileName) {
+bool Emulator::isCodeByte(WORD address) const {
+    int bit = address - 0xC000;
+    return (codeBytes[bit >> 5] >> (bit & 0x1F)) & 0x1;
+}
 
-    // if (!MBC1 && !MBC2) return;
-    ofstream save_file(fileName, ios::binary);
-    save_file.write(reinterpret_cast<char *>(&RAMBanks[0]), 0x8000);
+void Emulator::markCodeBytes(const CodeBlock& block) {
+    for (int i = block.start; i < block.end; i++) {
+        int bit = i - 0xC000;
+        codeBytes[bit >> 5] |= (1u << (bit & 0x1F));
+    }
+}
 
+// Throw away every cached block in RAM that contains address
+void Emulator::invalidateBlocks(WORD address) {
+    invalidateBlocks(address, address);
 }
 
-void Emulator::update() { // MAIN UPDATE LOOP
+// Throw away every cached block in RAM that overlaps first to last, both 
+// included. Only the blocks on those pages are looked at, and only the pages
+// of the blocks thrown away are marked again
+void Emulator::invalidateBlocks(WORD first, WORD last) {
 
-    // update function called 60 times per second -> screen rendered @ 60fps
+    uint64_t clearedPages = 0;
 
-    const int maxCycles = 70224;
-    int cyclesCount = 0;
-    int cycles;
+    for (int page = first >> 8; page <= (last >> 8); page++) {
 
-    while (cyclesCount < maxCycles) {
+        vector<WORD>& starts = RAMBlocks[page - 0xC0];
 
-        int cycles = executeNextOpcode(); //executeNextOpcode will return the number of cycles taken
-        cyclesCount += cycles;
+        for (size_t i = 0; i < starts.size();) {
 
-        updateTimers(cycles);
-        updateGraphics(cycles);
-        handleInterrupts();
+            auto found = blockCache.find(starts[i]);
+            CodeBlock& block = found->second;
 
+            if ((block.start > last) || (block.end <= first)) {
+                i++;
+                continue;
+            }
+
+            if (&block == currentBlock) {
+                currentBlock = nullptr;
+            }
+            idleLoopBlock = nullptr;
+
+            // Unlist it from the other page it covers
+            int lastPage = max(block.start, (WORD)(block.end - 1)) >> 8;
+            for (int covered = block.start >> 8; covered <= lastPage; covered++) {
+                clearedPages |= 1ull << (covered - 0xC0);
+                if (covered != page) {
+                    vector<WORD>& other = RAMBlocks[covered - 0xC0];
+                    other.erase(find(other.begin(), other.end(), block.start));
+                }
+            }
+
+            blockCache.erase(found);
+            blockCacheGeneration++;
+            starts[i] = starts.back();
+            starts.pop_back();
+        }
+    }
+
+    if (clearedPages == 0) {
+        return;
+    }
+
+    // Re-mark the bytes of the blocks that survive on the cleared pages
+    for (int page = 0; page < 0x40; page++) {
+        if ((clearedPages >> page) & 0x1) {
+            memset(&codeBytes[page * 8], 0, 8 * sizeof(uint32_t));
+        }
+    }
+    for (int page = 0; page < 0x40; page++) {
+        if ((clearedPages >> page) & 0x1) {
+            for (WORD start : RAMBlocks[page]) {
+                markCodeBytes(blockCache.find(start)->second);
+            }
+        }
     }
 
+    mapWorkRAMWrites();
+
 }
 
-void Emulator::setRenderGraphics(void(*funcPtr)()) {
-    doRenderPtr = funcPtr;
+void Emulator::clearBlockCache() {
+    blockCache.clear();
+    blockCacheGeneration++;
+    JITCode.clear();
+    currentBlock = nullptr;
+    idleLoopBlock = nullptr;
+    blockIndex = 0;
+    nextOperand = nullptr;
+    memset(codeBytes, 0, sizeof(codeBytes));
+    for (vector<WORD>& starts : RAMBlocks) {
+        starts.clear();
+    }
+    mapWorkRAMWrites();
 }
 
-int Emulator::executeNextOpcode() {
-    int clockCycles;
+/*
+********************************************************************************
+MEMORY MANAGEMENT FUNCTIONS
+********************************************************************************
+*/
 
-    BYTE opcode = readMem(programCounter.regstr);
+/*
 
-    // if (opcode != 0) {
-    //     //cout << "opcode: " << hex << (int) opcode << endl;
-    // }
+readMem and writeMem first look the address up in a table of 256 byte pages.
+A page that is plain memory has a host pointer, so the access is a single 
+indexed load or store. Pages without one (nullptr) go through the checks 
+below:
+
+Reads:
+0x0000-0x3FFF   cartridgeMem (ROM bank 0)
+0x4000-0x7FFF   cartridgeMem, currentROMBank
+0x8000-0x9FFF   internalMem (VRAM)
+0xA000-0xBFFF   RAMBanks, currentRAMBank
+0xC000-0xDFFF   internalMem (Work RAM)
+0xE000-0xFDFF   internalMem, 0x2000 lower (Echo RAM)
+0xFE00-0xFFFF   checks (unusable area, joypad)
+
+Writes:
+0x9800-0x9FFF   internalMem (tile maps)
+0xC000-0xDFFF   internalMem, unless the page holds cached code
+everything else checks (banking, tile data, external RAM, Echo RAM, I/O 
+                registers)
+
+mapMemory fills the tables and is called whenever the ROM or RAM bank 
+changes. The pointers point into the Emulator and its RAM banks, so it is also
+called by resetCPU, loadGame and loadState. Work RAM pages with cached code 
+are taken out of the write table by the block cache (mapWorkRAMWrites), so 
+that writes to them still invalidate the code.
 
-    if (isHalted) {
-        clockCycles = NOP();
-    } else {
-        programCounter.regstr++;
-        clockCycles = executeOpcode(opcode);
-    }
+*/
 
-    return clockCycles;
-}
+void Emulator::mapMemory() {
 
-int Emulator::executeOpcode(BYTE opcode) {
-    
-    int cycles;
+    for (int page = 0; page < 0x100; page++) {
+        readPages[page] = nullptr;
+        writePages[page] = nullptr;
+    }
 
-    switch (opcode) {
+    for (int page = 0x00; page < 0x40; page++) {
+        readPages[page] = &cartridgeMem[page << 8];
+    }
 
-        /* 
-        ************************************************************************
-        8 bit Load Commands
-        ************************************************************************
-        */
-        
-        // Load B, R/(HL)
-        case 0x40: cycles = LD_r_R(regBC.high, regBC.high); break;
-        case 0x41: cycles = LD_r_R(regBC.high, regBC.low); break;
-        case 0x42: cycles = LD_r_R(regBC.high, regDE.high); break;
-        case 0x43: cycles = LD_r_R(regBC.high, regDE.low); break;
-        case 0x44: cycles = LD_r_R(regBC.high, regHL.high); break;
-        case 0x45: cycles = LD_r_R(regBC.high, regHL.low); break;
-        case 0x46: cycles = LD_r_HL(regBC.high); break;
-        case 0x47: cycles = LD_r_R(regBC.high, regAF.high); break;
-
-        // Load C, R/(HL)
-        case 0x48: cycles = LD_r_R(regBC.low, regBC.high); break;
-        case 0x49: cycles = LD_r_R(regBC.low, regBC.low); break;
-        case 0x4A: cycles = LD_r_R(regBC.low, regDE.high); break;
-        case 0x4B: cycles = LD_r_R(regBC.low, regDE.low); break;
-        case 0x4C: cycles = LD_r_R(regBC.low, regHL.high); break;
-        case 0x4D: cycles = LD_r_R(regBC.low, regHL.low); break;
-        case 0x4E: cycles = LD_r_HL(regBC.low); break;
-        case 0x4F: cycles = LD_r_R(regBC.low, regAF.high); break;
-
-        // Load D, R/(HL)
-        case 0x50: cycles = LD_r_R(regDE.high, regBC.high); break;
-        case 0x51: cycles = LD_r_R(regDE.high, regBC.low); break;
-        case 0x52: cycles = LD_r_R(regDE.high, regDE.high); break;
-        case 0x53: cycles = LD_r_R(regDE.high, regDE.low); break;
-        case 0x54: cycles = LD_r_R(regDE.high, regHL.high); break;
-        case 0x55: cycles = LD_r_R(regDE.high, regHL.low); break;
-        case 0x56: cycles = LD_r_HL(regDE.high); break;
-        case 0x57: cycles = LD_r_R(regDE.high, regAF.high); break;
-
-        // Load E, R/(HL)
-        case 0x58: cycles = LD_r_R(regDE.low, regBC.high); break;
-        case 0x59: cycles = LD_r_R(regDE.low, regBC.low); break;
-        case 0x5A: cycles = LD_r_R(regDE.low, regDE.high); break;
-        case 0x5B: cycles = LD_r_R(regDE.low, regDE.low); break;
-        case 0x5C: cycles = LD_r_R(regDE.low, regHL.high); break;
-        case 0x5D: cycles = LD_r_R(regDE.low, regHL.low); break;
-        case 0x5E: cycles = LD_r_HL(regDE.low); break;
-        case 0x5F: cycles = LD_r_R(regDE.low, regAF.high); break;
-
-        // Load H, R/(HL)
-        case 0x60: cycles = LD_r_R(regHL.high, regBC.high); break;
-        case 0x61: cycles = LD_r_R(regHL.high, regBC.low); break;
-        case 0x62: cycles = LD_r_R(regHL.high, regDE.high); break;
-        case 0x63: cycles = LD_r_R(regHL.high, regDE.low); break;
-        case 0x64: cycles = LD_r_R(regHL.high, regHL.high); break;
-        case 0x65: cycles = LD_r_R(regHL.high, regHL.low); break;
-        case 0x66: cycles = LD_r_HL(regHL.high); break;
-        case 0x67: cycles = LD_r_R(regHL.high, regAF.high); break;
-
-        // Load L, R/(HL)
-        case 0x68: cycles = LD_r_R(regHL.low, regBC.high); break;
-        case 0x69: cycles = LD_r_R(regHL.low, regBC.low); break;
-        case 0x6A: cycles = LD_r_R(regHL.low, regDE.high); break;
-        case 0x6B: cycles = LD_r_R(regHL.low, regDE.low); break;
-        case 0x6C: cycles = LD_r_R(regHL.low, regHL.high); break;
-        case 0x6D: cycles = LD_r_R(regHL.low, regHL.low); break;
-        case 0x6E: cycles = LD_r_HL(regHL.low); break;
-        case 0x6F: cycles = LD_r_R(regHL.low, regAF.high); break;
-
-        // Load (HL), R
-        case 0x70: cycles = LD_HL_r(regBC.high); break;
-        case 0x71: cycles = LD_HL_r(regBC.low); break;
-        case 0x72: cycles = LD_HL_r(regDE.high); break;
-        case 0x73: cycles = LD_HL_r(regDE.low); break;
-        case 0x74: cycles = LD_HL_r(regHL.high); break;
-        case 0x75: cycles = LD_HL_r(regHL.low); break;
-        case 0x77: cycles = LD_HL_r(regAF.high); break;
-
-        // Load A, R/(HL)
-        case 0x78: cycles = LD_r_R(regAF.high, regBC.high); break;
-        case 0x79: cycles = LD_r_R(regAF.high, regBC.low); break;
-        case 0x7A: cycles = LD_r_R(regAF.high, regDE.high); break;
-        case 0x7B: cycles = LD_r_R(regAF.high, regDE.low); break;
-        case 0x7C: cycles = LD_r_R(regAF.high, regHL.high); break;
-        case 0x7D: cycles = LD_r_R(regAF.high, regHL.low); break;
-        case 0x7E: cycles = LD_r_HL(regAF.high); break;
-        case 0x7F: cycles = LD_r_R(regAF.high, regAF.high); break;
-
-        // Load R, n
-        case 0x06: cycles = LD_r_n(regBC.high); break;
-        case 0x0E: cycles = LD_r_n(regBC.low); break;
-        case 0x16: cycles = LD_r_n(regDE.high); break;
-        case 0x1E: cycles = LD_r_n(regDE.low); break;
-        case 0x26: cycles = LD_r_n(regHL.high); break;
-        case 0x2E: cycles = LD_r_n(regHL.low); break;
-        case 0x36: cycles = LD_HL_n(); break;
-        case 0x3E: cycles = LD_r_n(regAF.high); break;
-
-        // Load A, RR
-        case 0x0A: cycles = LD_A_BC(); break;
-        case 0x1A: cycles = LD_A_DE(); break;
-
-        // Load RR, A
-        case 0x02: cycles = LD_BC_A(); break;
-        case 0x12: cycles = LD_DE_A(); break;
-
-        // Load A, nn
-        case 0xFA: cycles = LD_A_nn(); break;
-
-        // Load nn, A
-        case 0xEA: cycles = LD_nn_A(); break;
-
-        // Load A, FF00+n, FF00+c, vice versa
-        case 0xF0: cycles = LD_A_FF00n(); break;
-        case 0xE0: cycles = LD_FF00n_A(); break;
-        case 0xF2: cycles = LD_A_FF00C(); break;
-        case 0xE2: cycles = LD_FF00C_A(); break;
-
-        // Load increment/decrement HL, A, vice versa
-        case 0x22: cycles = LDI_HL_A(); break;
-        case 0x2A: cycles = LDI_A_HL(); break;
-        case 0x32: cycles = LDD_HL_A(); break;
-        case 0x3A: cycles = LDD_A_HL(); break;
-
-        /* 
-        ************************************************************************
-        16 bit Load Commands
-        ************************************************************************
-        */
+    // The bank offset wraps around at 16 bits, like the address readMem used 
+    // to work out
+    WORD bankOffset = currentROMBank * 0x4000;
+    for (int page = 0x40; page < 0x80; page++) {
+        readPages[page] = &cartridgeMem[(WORD)(bankOffset + ((page - 0x40) << 8))];
+    }
 
-        // Load rr, nn
-        case 0x01: cycles = LD_rr_nn(regBC); break;
-        case 0x11: cycles = LD_rr_nn(regDE); break;
-        case 0x21: cycles = LD_rr_nn(regHL); break;
-        case 0x31: cycles = LD_rr_nn(stackPointer); break;
-
-        // Load SP, HL
-        case 0xF9: cycles = LD_SP_HL(); break;
-
-        // Load nn, SP
-        case 0x08: cycles = LD_nn_SP(); break;
-
-        // Push rr
-        case 0xC5: cycles = PUSH_rr(regBC); break;
-        case 0xD5: cycles = PUSH_rr(regDE); break;
-        case 0xE5: cycles = PUSH_rr(regHL); break;
-        case 0xF5: cycles = PUSH_rr(regAF); break;
-
-        // Pop rr
-        case 0xC1: cycles = POP_rr(regBC); break;
-        case 0xD1: cycles = POP_rr(regDE); break;
-        case 0xE1: cycles = POP_rr(regHL); break;
-        case 0xF1: cycles = POP_rr(regAF); break;
-
-        /* 
-        ************************************************************************
-        8 bit Arithmetic/Logical commands
-        ************************************************************************
-        */
+    // Tile data (0x8000-0x97FF) is written through writeUnmapped, which 
+    // keeps the tile cache up to date
+    for (int page = 0x80; page < 0xA0; page++) {
+        readPages[page] = &internalMem[page << 8];
+    }
+    for (int page = 0x98; page < 0xA0; page++) {
+        writePages[page] = &internalMem[page << 8];
+    }
 
-        // Add A, r
-        case 0x80: cycles = ADD_A_r(regBC.high); break;
-        case 0x81: cycles = ADD_A_r(regBC.low); break;
-        case 0x82: cycles = ADD_A_r(regDE.high); break;
-        case 0x83: cycles = ADD_A_r(regDE.low); break;
-        case 0x84: cycles = ADD_A_r(regHL.high); break;
-        case 0x85: cycles = ADD_A_r(regHL.low); break;
-        case 0x86: cycles = ADD_A_HL(); break;
-        case 0x87: cycles = ADD_A_r(regAF.high); break;
-
-        // Add A, n
-        case 0xC6: cycles = ADD_A_n(); break;
-
-        // ADC A, r
-        case 0x88: cycles = ADC_A_r(regBC.high); break;
-        case 0x89: cycles = ADC_A_r(regBC.low); break;
-        case 0x8A: cycles = ADC_A_r(regDE.high); break;
-        case 0x8B: cycles = ADC_A_r(regDE.low); break;
-        case 0x8C: cycles = ADC_A_r(regHL.high); break;
-        case 0x8D: cycles = ADC_A_r(regHL.low); break;
-        case 0x8E: cycles = ADC_A_HL(); break;
-        case 0x8F: cycles = ADC_A_r(regAF.high); break;
-
-        // ADC A, n
-        case 0xCE: cycles = ADC_A_n(); break;
-
-        // Sub r
-        case 0x90: cycles = SUB_r(regBC.high); break;
-        case 0x91: cycles = SUB_r(regBC.low); break;
-        case 0x92: cycles = SUB_r(regDE.high); break;
-        case 0x93: cycles = SUB_r(regDE.low); break;
-        case 0x94: cycles = SUB_r(regHL.high); break;
-        case 0x95: cycles = SUB_r(regHL.low); break;
-        case 0x96: cycles = SUB_HL(); break;
-        case 0x97: cycles = SUB_r(regAF.high); break;
-
-        // Sub n
-        case 0xD6: cycles = SUB_n(); break;
-
-        // SBC A, r
-        case 0x98: cycles = SBC_A_r(regBC.high); break;
-        case 0x99: cycles = SBC_A_r(regBC.low); break;
-        case 0x9A: cycles = SBC_A_r(regDE.high); break;
-        case 0x9B: cycles = SBC_A_r(regDE.low); break;
-        case 0x9C: cycles = SBC_A_r(regHL.high); break;
-        case 0x9D: cycles = SBC_A_r(regHL.low); break;
-        case 0x9E: cycles = SBC_A_HL(); break;
-        case 0x9F: cycles = SBC_A_r(regAF.high); break;  
-
-        // SBC A, n
-        case 0xDE: cycles = SBC_A_n(); break;
-
-        // AND r
-        case 0xA0: cycles = AND_r(regBC.high); break;
-        case 0xA1: cycles = AND_r(regBC.low); break;
-        case 0xA2: cycles = AND_r(regDE.high); break;
-        case 0xA3: cycles = AND_r(regDE.low); break;
-        case 0xA4: cycles = AND_r(regHL.high); break;
-        case 0xA5: cycles = AND_r(regHL.low); break;
-        case 0xA6: cycles = AND_HL(); break;
-        case 0xA7: cycles = AND_r(regAF.high); break;
-
-        // AND n 
-        case 0xE6: cycles = AND_n(); break;
-
-        // XOR r
-        case 0xA8: cycles = XOR_r(regBC.high); break;
-        case 0xA9: cycles = XOR_r(regBC.low); break;
-        case 0xAA: cycles = XOR_r(regDE.high); break;
-        case 0xAB: cycles = XOR_r(regDE.low); break;
-        case 0xAC: cycles = XOR_r(regHL.high); break;
-        case 0xAD: cycles = XOR_r(regHL.low); break;
-        case 0xAE: cycles = XOR_HL(); break;
-        case 0xAF: cycles = XOR_r(regAF.high); break;
-
-        // XOR n
-        case 0xEE: cycles = XOR_n(); break;
-
-        // OR r
-        case 0xB0: cycles = OR_r(regBC.high); break;
-        case 0xB1: cycles = OR_r(regBC.low); break;
-        case 0xB2: cycles = OR_r(regDE.high); break;
-        case 0xB3: cycles = OR_r(regDE.low); break;
-        case 0xB4: cycles = OR_r(regHL.high); break;
-        case 0xB5: cycles = OR_r(regHL.low); break;
-        case 0xB6: cycles = OR_HL(); break;
-        case 0xB7: cycles = OR_r(regAF.high); break;
-
-        // OR n 
-        case 0xF6: cycles = OR_n(); break;
-
-        // CPr
-        case 0xB8: cycles = CP_r(regBC.high); break;
-        case 0xB9: cycles = CP_r(regBC.low); break;
-        case 0xBA: cycles = CP_r(regDE.high); break;
-        case 0xBB: cycles = CP_r(regDE.low); break;
-        case 0xBC: cycles = CP_r(regHL.high); break;
-        case 0xBD: cycles = CP_r(regHL.low); break;
-        case 0xBE: cycles = CP_HL(); break;
-        case 0xBF: cycles = CP_r(regAF.high); break;
-
-        // CP n
-        case 0xFE: cycles = CP_n(); break;
-
-        // INC r
-        case 0x04: cycles = INC_r(regBC.high); break;
-        case 0x14: cycles = INC_r(regDE.high); break;
-        case 0x24: cycles = INC_r(regHL.high); break;
-        case 0x34: cycles = INC_HL(); break;
-        case 0x0C: cycles = INC_r(regBC.low); break; 
-        case 0x1C: cycles = INC_r(regDE.low); break;
-        case 0x2C: cycles = INC_r(regHL.low); break;
-        case 0x3C: cycles = INC_r(regAF.high); break;  
-
-        // DEC r
-        case 0x05: cycles = DEC_r(regBC.high); break;
-        case 0x15: cycles = DEC_r(regDE.high); break;
-        case 0x25: cycles = DEC_r(regHL.high); break;
-        case 0x35: cycles = DEC_HL(); break;
-        case 0x0D: cycles = DEC_r(regBC.low); break; 
-        case 0x1D: cycles = DEC_r(regDE.low); break;
-        case 0x2D: cycles = DEC_r(regHL.low); break;
-        case 0x3D: cycles = DEC_r(regAF.high); break;
-
-        // DAA
-        case 0x27: cycles = DAA(); break;
-
-        // CPL
-        case 0x2F: cycles = CPL(); break;
-
-        /* 
-        ************************************************************************
-        16 bit Arithmetic/Logical commands
-        ************************************************************************
-        */
+    for (int page = 0xA0; page < 0xC0; page++) {
+        readPages[page] = &RAMBanks.memory[((currentRAMBank * 0x2000) + ((page - 0xA0) << 8)) & (RAMBanks.size - 1)];
+    }
 
-        // Add HL, rr
-        case 0x09: cycles = ADD_HL_rr(regBC.regstr); break;
-        case 0x19: cycles = ADD_HL_rr(regDE.regstr); break;
-        case 0x29: cycles = ADD_HL_rr(regHL.regstr); break;
-        case 0x39: cycles = ADD_HL_rr(stackPointer.regstr); break;
-
-        // INC rr
-        case 0x03: cycles = INC_rr(regBC.regstr); break;
-        case 0x13: cycles = INC_rr(regDE.regstr); break;
-        case 0x23: cycles = INC_rr(regHL.regstr); break;
-        case 0x33: cycles = INC_rr(stackPointer.regstr); break;
-
-        // DEC rr
-        case 0x0B: cycles = DEC_rr(regBC.regstr); break;
-        case 0x1B: cycles = DEC_rr(regDE.regstr); break;
-        case 0x2B: cycles = DEC_rr(regHL.regstr); break;
-        case 0x3B: cycles = DEC_rr(stackPointer.regstr); break;
-
-        // Add SP, dd
-        case 0xE8: cycles = ADD_SP_dd(); break;
-
-        // Load HL, SP + dd
-        case 0xF8: cycles = LD_HL_SPdd(); break;
-
-        /* 
-        ************************************************************************
-        Rotate and Shift commands
-        ************************************************************************
-        */
+    for (int page = 0xC0; page < 0xE0; page++) {
+        readPages[page] = &internalMem[page << 8];
+    }
 
-        // Non CB-prefixed Rotate commands
-        case 0x07: cycles = RLCA(); break; // RLCA        
-        case 0x17: cycles = RLA(); break; // RLA
-        case 0x0F: cycles = RRCA(); break; // RRCA
-        case 0x1F: cycles = RRA(); break; // RRA
+    for (int page = 0xE0; page < 0xFE; page++) {
+        readPages[page] = &internalMem[(page - 0x20) << 8];
+    }
 
-        /* 
-        ************************************************************************
-        CPU Control commands
-        ************************************************************************
-        */
+    mapWorkRAMWrites();
 
-        case 0x3F: cycles = CCF(); break; // CCF
-        case 0x37: cycles = SCF(); break; // SCF
-        case 0x00: cycles = NOP(); break; // NOP
-        case 0x76: cycles = HALT(); break; // HALT
-        case 0x10: cycles = STOP(); break; // STOP
-        case 0xF3: cycles = DI(); break; // DI
-        case 0xFB: cycles = EI(); break; // EI
-
-        /* 
-        ************************************************************************
-        Jump commands
-        ************************************************************************
-        */
+}
 
-        // JP nn
-        case 0xC3: cycles = JP_nn(); break;
+// Work RAM pages are written directly unless cached code was decoded from them
+void Emulator::mapWorkRAMWrites() {
+    for (int page = 0xC0; page < 0xE0; page++) {
+        writePages[page] = pageHasCode(page) ? nullptr : &internalMem[page << 8];
+    }
+}
 
-        // JP HL
-        case 0xE9: cycles = JP_HL(); break;
+bool Emulator::pageHasCode(int page) const {
+    const uint32_t* words = &codeBytes[((page << 8) - 0xC000) >> 5];
+    for (int i = 0; i < 8; i++) {
+        if (words[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        // JP f, nn
-        case 0xC2: cycles = JP_f_nn(opcode); break;
-        case 0xCA: cycles = JP_f_nn(opcode); break;
-        case 0xD2: cycles = JP_f_nn(opcode); break;
-        case 0xDA: cycles = JP_f_nn(opcode); break;
+/*
+********************************************************************************
+DIRTY PAGES
+********************************************************************************
+*/
 
-        // JR PC + dd
-        case 0x18: cycles = JR_PCdd(); break;
+/*
 
-        // JR f, PC + dd
-        case 0x20: cycles = JR_f_PCdd(opcode); break;
-        case 0x28: cycles = JR_f_PCdd(opcode); break;
-        case 0x30: cycles = JR_f_PCdd(opcode); break;
-        case 0x38: cycles = JR_f_PCdd(opcode); break;
+Every store to emulated memory marks its 256 byte page dirty: writeMem, and
+the registers the hardware updates directly in internalMem (DIV, LY). Pages of
+the address space are marked by address, so Echo RAM shows up as Work RAM and
+the ROM area never does. External RAM is marked by its offset in the RAM 
+banks, since the same address can be any bank.
 
-        // Call nn
-        case 0xCD: cycles = CALL_nn(); break;
+Marking is a byte store next to the page tables, cheap enough for the write 
+fast path. takeDirtyPages hands the set out as bitsets and starts over, so 
+save states, rewind and network sync can send only the pages that changed 
+since their last call. resetCPU, loadGame and loadState mark everything.
 
-        // Call f, nn
-        case 0xC4: cycles = CALL_f_nn(opcode); break;
-        case 0xCC: cycles = CALL_f_nn(opcode); break;
-        case 0xD4: cycles = CALL_f_nn(opcode); break;
-        case 0xDC: cycles = CALL_f_nn(opcode); break;
+*/
 
-        // RET
-        case 0xC9: cycles = RET(); break;
-        
-        // RET f
-        case 0xC0: cycles = RET_f(opcode); break; 
-        case 0xC8: cycles = RET_f(opcode); break;
-        case 0xD0: cycles = RET_f(opcode); break;
-        case 0xD8: cycles = RET_f(opcode); break;
+Emulator::DirtyPages Emulator::takeDirtyPages() {
 
-        // RETI
-        case 0xD9: cycles = RETI(); break;
+    DirtyPages dirty;
 
-        // RST n
-        case 0xC7: cycles = RST_n(opcode); break;
-        case 0xD7: cycles = RST_n(opcode); break;
-        case 0xE7: cycles = RST_n(opcode); break;
-        case 0xF7: cycles = RST_n(opcode); break;
-        case 0xCF: cycles = RST_n(opcode); break;
-        case 0xDF: cycles = RST_n(opcode); break;
-        case 0xEF: cycles = RST_n(opcode); break;
-        case 0xFF: cycles = RST_n(opcode); break;
+    for (int page = 0; page < 0x100; page++) {
+        dirty.memory[page] = (dirtyPages[page] != 0);
+    }
+    for (int page = 0; page < 0x80; page++) {
+        dirty.RAM[page] = (dirtyRAMPages[page] != 0);
+    }
 
-        /* 
-        ************************************************************************
-        CB-prefix commands
-        ************************************************************************
-        */ 
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+    memset(dirtyRAMPages, 0, sizeof(dirtyRAMPages));
 
-        case 0xCB: cycles = executeCBOpcode(); break;
-    }
+    return dirty;
 
-    return cycles;
+}
 
+void Emulator::markDirty(WORD address) {
+    dirtyPages[address >> 8] = 1;
 }
 
-int Emulator::executeCBOpcode() {
-    
-    BYTE opcode = readMem(programCounter.regstr);
-    programCounter.regstr++;
-    int cycles;
+// Every page that holds state, for when all of it changes at once
+void Emulator::markAllDirty() {
 
-    switch (opcode) {
+    // VRAM, Work RAM, OAM and I/O with HRAM. External RAM is in dirtyRAMPages
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+    memset(&dirtyPages[0x80], 1, 0x20);
+    memset(&dirtyPages[0xC0], 1, 0x20);
+    dirtyPages[0xFE] = 1;
+    dirtyPages[0xFF] = 1;
+    memset(dirtyRAMPages, 0, sizeof(dirtyRAMPages));
+    memset(dirtyRAMPages, 1, RAMBanks.size >> 8);
 
-        /* 
-        ************************************************************************
-        Rotate and Shift commands
-        ************************************************************************
-        */
+}
 
-        // RLC r
-        case 0x00: cycles = RLC_r(regBC.high); break;
-        case 0x01: cycles = RLC_r(regBC.low); break;
-        case 0x02: cycles = RLC_r(regDE.high); break;
-        case 0x03: cycles = RLC_r(regDE.low); break;
-        case 0x04: cycles = RLC_r(regHL.high); break;
-        case 0x05: cycles = RLC_r(regHL.low); break;
-        case 0x06: cycles = RLC_HL(); break;
-        case 0x07: cycles = RLC_r(regAF.high); break;
-
-        // RRC r
-        case 0x08: cycles = RRC_r(regBC.high); break;
-        case 0x09: cycles = RRC_r(regBC.low); break;
-        case 0x0A: cycles = RRC_r(regDE.high); break;
-        case 0x0B: cycles = RRC_r(regDE.low); break;
-        case 0x0C: cycles = RRC_r(regHL.high); break;
-        case 0x0D: cycles = RRC_r(regHL.low); break;
-        case 0x0E: cycles = RRC_HL(); break;
-        case 0x0F: cycles = RRC_r(regAF.high); break;
-
-        // RL r
-        case 0x10: cycles = RL_r(regBC.high); break;
-        case 0x11: cycles = RL_r(regBC.low); break;
-        case 0x12: cycles = RL_r(regDE.high); break;
-        case 0x13: cycles = RL_r(regDE.low); break;
-        case 0x14: cycles = RL_r(regHL.high); break;
-        case 0x15: cycles = RL_r(regHL.low); break;
-        case 0x16: cycles = RL_HL(); break;
-        case 0x17: cycles = RL_r(regAF.high); break;
-
-        // RR r
-        case 0x18: cycles = RR_r(regBC.high); break;
-        case 0x19: cycles = RR_r(regBC.low); break;
-        case 0x1A: cycles = RR_r(regDE.high); break;
-        case 0x1B: cycles = RR_r(regDE.low); break;
-        case 0x1C: cycles = RR_r(regHL.high); break;
-        case 0x1D: cycles = RR_r(regHL.low); break;
-        case 0x1E: cycles = RR_HL(); break;
-        case 0x1F: cycles = RR_r(regAF.high); break;
-
-        // SLA r
-        case 0x20: cycles = SLA_r(regBC.high); break;
-        case 0x21: cycles = SLA_r(regBC.low); break;
-        case 0x22: cycles = SLA_r(regDE.high); break;
-        case 0x23: cycles = SLA_r(regDE.low); break;
-        case 0x24: cycles = SLA_r(regHL.high); break;
-        case 0x25: cycles = SLA_r(regHL.low); break;
-        case 0x26: cycles = SLA_HL(); break;
-        case 0x27: cycles = SLA_r(regAF.high); break;
-
-        // SRA r
-        case 0x28: cycles = SRA_r(regBC.high); break;
-        case 0x29: cycles = SRA_r(regBC.low); break;
-        case 0x2A: cycles = SRA_r(regDE.high); break;
-        case 0x2B: cycles = SRA_r(regDE.low); break;
-        case 0x2C: cycles = SRA_r(regHL.high); break;
-        case 0x2D: cycles = SRA_r(regHL.low); break;
-        case 0x2E: cycles = SRA_HL(); break;
-        case 0x2F: cycles = SRA_r(regAF.high); break;
-
-        // Swap r
-        case 0x30: cycles = SWAP_r(regBC.high); break;
-        case 0x31: cycles = SWAP_r(regBC.low); break;
-        case 0x32: cycles = SWAP_r(regDE.high); break;
-        case 0x33: cycles = SWAP_r(regDE.low); break;
-        case 0x34: cycles = SWAP_r(regHL.high); break;
-        case 0x35: cycles = SWAP_r(regHL.low); break;
-        case 0x36: cycles = SWAP_HL(); break;
-        case 0x37: cycles = SWAP_r(regAF.high); break;
-
-        // SRL r
-        case 0x38: cycles = SRL_r(regBC.high); break;
-        case 0x39: cycles = SRL_r(regBC.low); break;
-        case 0x3A: cycles = SRL_r(regDE.high); break;
-        case 0x3B: cycles = SRL_r(regDE.low); break;
-        case 0x3C: cycles = SRL_r(regHL.high); break;
-        case 0x3D: cycles = SRL_r(regHL.low); break;
-        case 0x3E: cycles = SRL_HL(); break;
-        case 0x3F: cycles = SRL_r(regAF.high); break;
-
-        /* 
-        ************************************************************************
-        Single bit operation commands
-        ************************************************************************
-        */   
-
-        // BIT 0, r
-        case 0x40: cycles = BIT_n_r(regBC.high, 0); break;
-        case 0x41: cycles = BIT_n_r(regBC.low, 0); break;
-        case 0x42: cycles = BIT_n_r(regDE.high, 0); break;
-        case 0x43: cycles = BIT_n_r(regDE.low, 0); break;
-        case 0x44: cycles = BIT_n_r(regHL.high, 0); break;
-        case 0x45: cycles = BIT_n_r(regHL.low, 0); break;
-        case 0x46: cycles = BIT_n_HL(0); break;
-        case 0x47: cycles = BIT_n_r(regAF.high, 0); break;
-
-        // BIT 1, r
-        case 0x48: cycles = BIT_n_r(regBC.high, 1); break;
-        case 0x49: cycles = BIT_n_r(regBC.low, 1); break;
-        case 0x4A: cycles = BIT_n_r(regDE.high, 1); break;
-        case 0x4B: cycles = BIT_n_r(regDE.low, 1); break;
-        case 0x4C: cycles = BIT_n_r(regHL.high, 1); break;
-        case 0x4D: cycles = BIT_n_r(regHL.low, 1); break;
-        case 0x4E: cycles = BIT_n_HL(1); break;
-        case 0x4F: cycles = BIT_n_r(regAF.high, 1); break;
-
-        // BIT 2, r
-        case 0x50: cycles = BIT_n_r(regBC.high, 2); break;
-        case 0x51: cycles = BIT_n_r(regBC.low, 2); break;
-        case 0x52: cycles = BIT_n_r(regDE.high, 2); break;
-        case 0x53: cycles = BIT_n_r(regDE.low, 2); break;
-        case 0x54: cycles = BIT_n_r(regHL.high, 2); break;
-        case 0x55: cycles = BIT_n_r(regHL.low, 2); break;
-        case 0x56: cycles = BIT_n_HL(2); break;
-        case 0x57: cycles = BIT_n_r(regAF.high, 2); break;
-
-        // BIT 3, r
-        case 0x58: cycles = BIT_n_r(regBC.high, 3); break;
-        case 0x59: cycles = BIT_n_r(regBC.low, 3); break;
-        case 0x5A: cycles = BIT_n_r(regDE.high, 3); break;
-        case 0x5B: cycles = BIT_n_r(regDE.low, 3); break;
-        case 0x5C: cycles = BIT_n_r(regHL.high, 3); break;
-        case 0x5D: cycles = BIT_n_r(regHL.low, 3); break;
-        case 0x5E: cycles = BIT_n_HL(3); break;
-        case 0x5F: cycles = BIT_n_r(regAF.high, 3); break;
-
-        // BIT 4, r
-        case 0x60: cycles = BIT_n_r(regBC.high, 4); break;
-        case 0x61: cycles = BIT_n_r(regBC.low, 4); break;
-        case 0x62: cycles = BIT_n_r(regDE.high, 4); break;
-        case 0x63: cycles = BIT_n_r(regDE.low, 4); break;
-        case 0x64: cycles = BIT_n_r(regHL.high, 4); break;
-        case 0x65: cycles = BIT_n_r(regHL.low, 4); break;
-        case 0x66: cycles = BIT_n_HL(4); break;
-        case 0x67: cycles = BIT_n_r(regAF.high, 4); break;
-
-        // BIT 5, r
-        case 0x68: cycles = BIT_n_r(regBC.high, 5); break;
-        case 0x69: cycles = BIT_n_r(regBC.low, 5); break;
-        case 0x6A: cycles = BIT_n_r(regDE.high, 5); break;
-        case 0x6B: cycles = BIT_n_r(regDE.low, 5); break;
-        case 0x6C: cycles = BIT_n_r(regHL.high, 5); break;
-        case 0x6D: cycles = BIT_n_r(regHL.low, 5); break;
-        case 0x6E: cycles = BIT_n_HL(5); break;
-        case 0x6F: cycles = BIT_n_r(regAF.high, 5); break;
-
-        // BIT 6, r
-        case 0x70: cycles = BIT_n_r(regBC.high, 6); break;
-        case 0x71: cycles = BIT_n_r(regBC.low, 6); break;
-        case 0x72: cycles = BIT_n_r(regDE.high, 6); break;
-        case 0x73: cycles = BIT_n_r(regDE.low, 6); break;
-        case 0x74: cycles = BIT_n_r(regHL.high, 6); break;
-        case 0x75: cycles = BIT_n_r(regHL.low, 6); break;
-        case 0x76: cycles = BIT_n_HL(6); break;
-        case 0x77: cycles = BIT_n_r(regAF.high, 6); break;
-
-        // BIT 7, r
-        case 0x78: cycles = BIT_n_r(regBC.high, 7); break;
-        case 0x79: cycles = BIT_n_r(regBC.low, 7); break;
-        case 0x7A: cycles = BIT_n_r(regDE.high, 7); break;
-        case 0x7B: cycles = BIT_n_r(regDE.low, 7); break;
-        case 0x7C: cycles = BIT_n_r(regHL.high, 7); break;
-        case 0x7D: cycles = BIT_n_r(regHL.low, 7); break;
-        case 0x7E: cycles = BIT_n_HL(7); break;
-        case 0x7F: cycles = BIT_n_r(regAF.high, 7); break;
-
-        // RES 0, r
-        case 0x80: cycles = RES_n_r(regBC.high, 0); break;
-        case 0x81: cycles = RES_n_r(regBC.low, 0); break;
-        case 0x82: cycles = RES_n_r(regDE.high, 0); break;
-        case 0x83: cycles = RES_n_r(regDE.low, 0); break;
-        case 0x84: cycles = RES_n_r(regHL.high, 0); break;
-        case 0x85: cycles = RES_n_r(regHL.low, 0); break;
-        case 0x86: cycles = RES_n_HL(0); break;
-        case 0x87: cycles = RES_n_r(regAF.high, 0); break;
-
-        // RES 1, r
-        case 0x88: cycles = RES_n_r(regBC.high, 1); break;
-        case 0x89: cycles = RES_n_r(regBC.low, 1); break;
-        case 0x8A: cycles = RES_n_r(regDE.high, 1); break;
-        case 0x8B: cycles = RES_n_r(regDE.low, 1); break;
-        case 0x8C: cycles = RES_n_r(regHL.high, 1); break;
-        case 0x8D: cycles = RES_n_r(regHL.low, 1); break;
-        case 0x8E: cycles = RES_n_HL(1); break;
-        case 0x8F: cycles = RES_n_r(regAF.high, 1); break;
-
-        // RES 2, r
-        case 0x90: cycles = RES_n_r(regBC.high, 2); break;
-        case 0x91: cycles = RES_n_r(regBC.low, 2); break;
-        case 0x92: cycles = RES_n_r(regDE.high, 2); break;
-        case 0x93: cycles = RES_n_r(regDE.low, 2); break;
-        case 0x94: cycles = RES_n_r(regHL.high, 2); break;
-        case 0x95: cycles = RES_n_r(regHL.low, 2); break;
-        case 0x96: cycles = RES_n_HL(2); break;
-        case 0x97: cycles = RES_n_r(regAF.high, 2); break;
-
-        // RES 3, r
-        case 0x98: cycles = RES_n_r(regBC.high, 3); break;
-        case 0x99: cycles = RES_n_r(regBC.low, 3); break;
-        case 0x9A: cycles = RES_n_r(regDE.high, 3); break;
-        case 0x9B: cycles = RES_n_r(regDE.low, 3); break;
-        case 0x9C: cycles = RES_n_r(regHL.high, 3); break;
-        case 0x9D: cycles = RES_n_r(regHL.low, 3); break;
-        case 0x9E: cycles = RES_n_HL(3); break;
-        case 0x9F: cycles = RES_n_r(regAF.high, 3); break;
-
-        // RES 4, r
-        case 0xA0: cycles = RES_n_r(regBC.high, 4); break;
-        case 0xA1: cycles = RES_n_r(regBC.low, 4); break;
-        case 0xA2: cycles = RES_n_r(regDE.high, 4); break;
-        case 0xA3: cycles = RES_n_r(regDE.low, 4); break;
-        case 0xA4: cycles = RES_n_r(regHL.high, 4); break;
-        case 0xA5: cycles = RES_n_r(regHL.low, 4); break;
-        case 0xA6: cycles = RES_n_HL(4); break;
-        case 0xA7: cycles = RES_n_r(regAF.high, 4); break;
-
-        // RES 5, r
-        case 0xA8: cycles = RES_n_r(regBC.high, 5); break;
-        case 0xA9: cycles = RES_n_r(regBC.low, 5); break;
-        case 0xAA: cycles = RES_n_r(regDE.high, 5); break;
-        case 0xAB: cycles = RES_n_r(regDE.low, 5); break;
-        case 0xAC: cycles = RES_n_r(regHL.high, 5); break;
-        case 0xAD: cycles = RES_n_r(regHL.low, 5); break;
-        case 0xAE: cycles = RES_n_HL(5); break;
-        case 0xAF: cycles = RES_n_r(regAF.high, 5); break;
-
-        // RES 6, r
-        case 0xB0: cycles = RES_n_r(regBC.high, 6); break;
-        case 0xB1: cycles = RES_n_r(regBC.low, 6); break;
-        case 0xB2: cycles = RES_n_r(regDE.high, 6); break;
-        case 0xB3: cycles = RES_n_r(regDE.low, 6); break;
-        case 0xB4: cycles = RES_n_r(regHL.high, 6); break;
-        case 0xB5: cycles = RES_n_r(regHL.low, 6); break;
-        case 0xB6: cycles = RES_n_HL(6); break;
-        case 0xB7: cycles = RES_n_r(regAF.high, 6); break;
-
-        // RES 7, r
-        case 0xB8: cycles = RES_n_r(regBC.high, 7); break;
-        case 0xB9: cycles = RES_n_r(regBC.low, 7); break;
-        case 0xBA: cycles = RES_n_r(regDE.high, 7); break;
-        case 0xBB: cycles = RES_n_r(regDE.low, 7); break;
-        case 0xBC: cycles = RES_n_r(regHL.high, 7); break;
-        case 0xBD: cycles = RES_n_r(regHL.low, 7); break;
-        case 0xBE: cycles = RES_n_HL(7); break;
-        case 0xBF: cycles = RES_n_r(regAF.high, 7); break;
-
-        // SET 0, r
-        case 0xC0: cycles = SET_n_r(regBC.high, 0); break;
-        case 0xC1: cycles = SET_n_r(regBC.low, 0); break;
-        case 0xC2: cycles = SET_n_r(regDE.high, 0); break;
-        case 0xC3: cycles = SET_n_r(regDE.low, 0); break;
-        case 0xC4: cycles = SET_n_r(regHL.high, 0); break;
-        case 0xC5: cycles = SET_n_r(regHL.low, 0); break;
-        case 0xC6: cycles = SET_n_HL(0); break;
-        case 0xC7: cycles = SET_n_r(regAF.high, 0); break;
-
-        // SET 1, r
-        case 0xC8: cycles = SET_n_r(regBC.high, 1); break;
-        case 0xC9: cycles = SET_n_r(regBC.low, 1); break;
-        case 0xCA: cycles = SET_n_r(regDE.high, 1); break;
-        case 0xCB: cycles = SET_n_r(regDE.low, 1); break;
-        case 0xCC: cycles = SET_n_r(regHL.high, 1); break;
-        case 0xCD: cycles = SET_n_r(regHL.low, 1); break;
-        case 0xCE: cycles = SET_n_HL(1); break;
-        case 0xCF: cycles = SET_n_r(regAF.high, 1); break;
-
-        // SET 2, r
-        case 0xD0: cycles = SET_n_r(regBC.high, 2); break;
-        case 0xD1: cycles = SET_n_r(regBC.low, 2); break;
-        case 0xD2: cycles = SET_n_r(regDE.high, 2); break;
-        case 0xD3: cycles = SET_n_r(regDE.low, 2); break;
-        case 0xD4: cycles = SET_n_r(regHL.high, 2); break;
-        case 0xD5: cycles = SET_n_r(regHL.low, 2); break;
-        case 0xD6: cycles = SET_n_HL(2); break;
-        case 0xD7: cycles = SET_n_r(regAF.high, 2); break;
-
-        // SET 3, r
-        case 0xD8: cycles = SET_n_r(regBC.high, 3); break;
-        case 0xD9: cycles = SET_n_r(regBC.low, 3); break;
-        case 0xDA: cycles = SET_n_r(regDE.high, 3); break;
-        case 0xDB: cycles = SET_n_r(regDE.low, 3); break;
-        case 0xDC: cycles = SET_n_r(regHL.high, 3); break;
-        case 0xDD: cycles = SET_n_r(regHL.low, 3); break;
-        case 0xDE: cycles = SET_n_HL(3); break;
-        case 0xDF: cycles = SET_n_r(regAF.high, 3); break;
-
-        // SET 4, r
-        case 0xE0: cycles = SET_n_r(regBC.high, 4); break;
-        case 0xE1: cycles = SET_n_r(regBC.low, 4); break;
-        case 0xE2: cycles = SET_n_r(regDE.high, 4); break;
-        case 0xE3: cycles = SET_n_r(regDE.low, 4); break;
-        case 0xE4: cycles = SET_n_r(regHL.high, 4); break;
-        case 0xE5: cycles = SET_n_r(regHL.low, 4); break;
-        case 0xE6: cycles = SET_n_HL(4); break;
-        case 0xE7: cycles = SET_n_r(regAF.high, 4); break;
-
-        // SET 5, r
-        case 0xE8: cycles = SET_n_r(regBC.high, 5); break;
-        case 0xE9: cycles = SET_n_r(regBC.low, 5); break;
-        case 0xEA: cycles = SET_n_r(regDE.high, 5); break;
-        case 0xEB: cycles = SET_n_r(regDE.low, 5); break;
-        case 0xEC: cycles = SET_n_r(regHL.high, 5); break;
-        case 0xED: cycles = SET_n_r(regHL.low, 5); break;
-        case 0xEE: cycles = SET_n_HL(5); break;
-        case 0xEF: cycles = SET_n_r(regAF.high, 5); break;
-
-        // SET 6, r
-        case 0xF0: cycles = SET_n_r(regBC.high, 6); break;
-        case 0xF1: cycles = SET_n_r(regBC.low, 6); break;
-        case 0xF2: cycles = SET_n_r(regDE.high, 6); break;
-        case 0xF3: cycles = SET_n_r(regDE.low, 6); break;
-        case 0xF4: cycles = SET_n_r(regHL.high, 6); break;
-        case 0xF5: cycles = SET_n_r(regHL.low, 6); break;
-        case 0xF6: cycles = SET_n_HL(6); break;
-        case 0xF7: cycles = SET_n_r(regAF.high, 6); break;
-
-        // SET 7, r
-        case 0xF8: cycles = SET_n_r(regBC.high, 7); break;
-        case 0xF9: cycles = SET_n_r(regBC.low, 7); break;
-        case 0xFA: cycles = SET_n_r(regDE.high, 7); break;
-        case 0xFB: cycles = SET_n_r(regDE.low, 7); break;
-        case 0xFC: cycles = SET_n_r(regHL.high, 7); break;
-        case 0xFD: cycles = SET_n_r(regHL.low, 7); break;
-        case 0xFE: cycles = SET_n_HL(7); break;
-        case 0xFF: cycles = SET_n_r(regAF.high, 7); break;
-    }
-
-    return cycles;
+BYTE Emulator::readMem(WORD address) const {
 
-}
+    const BYTE* page = readPages[address >> 8];
+    if (page != nullptr) {
+        return page[address & 0xFF];
+    }
 
+    return readUnmapped(address);
 
-/*
-********************************************************************************
-MEMORY MANAGEMENT FUNCTIONS
-********************************************************************************
-*/
+}
 
-BYTE Emulator::readMem(WORD address) const {
+// Reads from pages that are not in readPages
+BYTE Emulator::readUnmapped(WORD address) const {
 
     // If reading from switchable ROM banking area
     if ((address >= 0x4000) && (address <= 0x7FFF)) {
@@ -1107,8 +2192,9 @@ BYTE Emulator::readMem(WORD address) const {
     else if ((address >= 0xA000) && (address <= 0xBFFF)) {
         // if in ROM mode, only RAM bank 0 can be accessed
         // assert(ROMBanking == (currentRAMBank == 0));
-        WORD newAddress = (currentRAMBank * 0x2000) + (address - 0xA000);
-        return RAMBanks[newAddress];
+        // Banks past the ones the cartridge has wrap around
+        WORD newAddress = ((currentRAMBank * 0x2000) + (address - 0xA000)) & (RAMBanks.size - 1);
+        return RAMBanks.memory[newAddress];
     }
     
     // Since ECHO RAM is the same as Work RAM
@@ -1121,9 +2207,9 @@ BYTE Emulator::readMem(WORD address) const {
         return 0x00;
     }
 
-    // Joypad Register
-    else if (address == 0xFF00) { 
-        return getJoypadState();
+    // I/O registers, see I/O REGISTERS
+    else if ((address >= 0xFF00) && (address <= 0xFF7F)) {
+        return (this->*IOReadTable[address & 0x7F])(address);
     }
 
     // else return what's in the memory
@@ -1133,19 +2219,42 @@ BYTE Emulator::readMem(WORD address) const {
 
 void Emulator::writeMem(WORD address, BYTE data) {
 
+    BYTE* page = writePages[address >> 8];
+    if (page != nullptr) {
+        page[address & 0xFF] = data;
+        dirtyPages[address >> 8] = 1;
+        return;
+    }
+
+    writeUnmapped(address, data);
+
+}
+
+// Writes to pages that are not in writePages
+void Emulator::writeUnmapped(WORD address, BYTE data) {
+
     // write attempts to ROM
     if (address < 0x8000) {
         //cout << "banking occured" << endl;
         handleBanking(address, data);
     }
 
+    // Tile data, decoded again for the tile cache
+    else if (address < 0x9800) {
+        internalMem[address] = data;
+        markDirty(address);
+        decodeTileRow((address - 0x8000) >> 1);
+    }
+
     // write attempts to external RAM
     else if ((address >= 0xA000) && (address <= 0xBFFF)) {
         if (enableRAM) {
             // In ROM mode, only RAM bank 0 can be accessed
             assert(ROMBanking == (currentRAMBank == 0));
-            WORD newAddress = (address - 0xA000) + (currentRAMBank * 0x2000);
-            RAMBanks[newAddress] = data;
+            WORD newAddress = ((address - 0xA000) + (currentRAMBank * 0x2000)) & (RAMBanks.size - 1);
+            RAMBanks.memory[newAddress] = data;
+            dirtyRAMPages[newAddress >> 8] = 1;
+            RAMBanksChanged = true;
         }
     }
 
@@ -1155,69 +2264,194 @@ void Emulator::writeMem(WORD address, BYTE data) {
         writeMem(address - 0x2000, data);
     }
 
+    // OAM, the sprites on each line are selected again
+    else if ((address >= 0xFE00) && (address < 0xFEA0)) {
+        internalMem[address] = data;
+        markDirty(address);
+        spritesChanged = true;
+    }
+
     else if ((address >= 0xFEA0) && (address <= 0xFEFF)) {
         //cout << "Something wrong in WriteMem. Unusable location." << endl;
         //assert(false);
     }
 
-    // FF04 is divider register, its value is reset to 0 if game attempts to 
-    // write to it
-    else if (address == DIVIDER) { 
-        internalMem[DIVIDER] = 0;
-    }
-
-    // if game changes the freq, the counter must change accordingly
-    else if (address == TAC) { 
-        // get the currentFreq, do the writing, then compare with newFreq. if different, counter must be updated
-
-        // to extract bit 1 and 0 of timer controller register
-        BYTE currentFreq = readMem(TAC) & 0x3; 
-        internalMem[TAC] = data; // write the data to the address
-        BYTE newFreq = readMem(TAC) & 0x3;
-
-        // if the freq has changed
-        if (currentFreq != newFreq) { 
-            switch (newFreq) {
-                case 0b00: 
-                    timerCounter = 1024; 
-                    timerUpdateConstant = 1024; 
-                    break; // 4096Hz
-                case 0b01: 
-                    timerCounter = 16;
-                    timerUpdateConstant = 16;
-                    break; // 262144Hz
-                case 0b10: 
-                    timerCounter = 64; 
-                    timerUpdateConstant = 64;
-                    break; // 65536Hz
-                case 0b11: 
-                    timerCounter = 256; 
-                    timerUpdateConstant = 256; 
-                    break; // 16384Hz
-                default:
-                    break;
-                    //cout << "Something is wrong!" << endl;
-            }
-        }
+    // I/O registers, see I/O REGISTERS
+    else if ((address >= 0xFF00) && (address <= 0xFF7F)) {
+        markDirty(address);
+        (this->*IOWriteTable[address & 0x7F])(address, data);
     }
 
-    // reset the current scanline to 0 if game tries to write to it
-    else if (address == 0xFF44) {
-        internalMem[address] = 0;
-    }
-    
-    // launches a DMA to access the Sprites Attributes table
-    else if (address == 0xFF46) {
-        doDMATransfer(data);
+    // Interrupt Enable register, changes when interrupts are serviced
+    else if (address == 0xFFFF) {
+        catchUpHardware();
+        internalMem[address] = data;
+        markDirty(address);
     }
 
     else {
+        // Cached code in RAM has to be decoded again once it is overwritten
+        if ((address >= 0xC000) && isCodeByte(address)) {
+            invalidateBlocks(address);
+        }
         internalMem[address] = data;
+        markDirty(address);
+    }
+
+}
+
+/*
+********************************************************************************
+I/O REGISTERS
+********************************************************************************
+*/
+
+/*
+
+Accesses to 0xFF00-0xFF7F are dispatched through IOReadTable and IOWriteTable,
+one handler per register, generated at compile time. Registers without a 
+handler of their own read and write internalMem. A new register only needs an
+entry here, and does not slow down accesses to any other address.
+
+0xFF00 Joypad       read: getJoypadState
+0xFF04 DIV          write: reset to 0
+0xFF07 TAC          write: the timer frequency may change
+0xFF0F IF           write: catch up the hardware first
+0xFF40 LCDC         write: catch up the hardware first
+0xFF41 STAT         write: catch up the hardware first
+0xFF44 LY           write: reset to 0
+0xFF45 LYC          write: catch up the hardware first
+0xFF46 DMA          write: copy to OAM
+0xFF47-0xFF49       write: palette colours updated (see PALETTES)
+
+Writes that change when the hardware next needs updating catch up with the 
+cycles run so far and force a sync after the instruction (see SCHEDULER).
+
+*/
+
+constexpr array<Emulator::IOReadHandler, 0x80> Emulator::makeIOReadTable() {
+
+    array<IOReadHandler, 0x80> table {};
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = &Emulator::readIORegister;
+    }
+
+    table[0x00] = &Emulator::readJoypad;
+
+    return table;
+
+}
+
+constexpr array<Emulator::IOWriteHandler, 0x80> Emulator::makeIOWriteTable() {
+
+    array<IOWriteHandler, 0x80> table {};
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = &Emulator::writeIORegister;
+    }
+
+    table[DIVIDER & 0x7F] = &Emulator::writeDivider;
+    table[TAC & 0x7F] = &Emulator::writeTimerControl;
+    table[0x0F] = &Emulator::writeTimingRegister; // IF
+    table[0x40] = &Emulator::writeTimingRegister; // LCDC
+    table[0x41] = &Emulator::writeTimingRegister; // STAT
+    table[0x44] = &Emulator::writeScanline;
+    table[0x45] = &Emulator::writeTimingRegister; // LYC
+    table[0x46] = &Emulator::writeDMA;
+    table[0x47] = &Emulator::writePalette; // BGP
+    table[0x48] = &Emulator::writePalette; // OBP0
+    table[0x49] = &Emulator::writePalette; // OBP1
+
+    return table;
+
+}
+
+const array<Emulator::IOReadHandler, 0x80> Emulator::IOReadTable = Emulator::makeIOReadTable();
+
+const array<Emulator::IOWriteHandler, 0x80> Emulator::IOWriteTable = Emulator::makeIOWriteTable();
+
+BYTE Emulator::readIORegister(WORD address) const {
+    return internalMem[address];
+}
+
+BYTE Emulator::readJoypad(WORD /* address */) const {
+    return getJoypadState();
+}
+
+void Emulator::writeIORegister(WORD address, BYTE data) {
+    internalMem[address] = data;
+}
+
+// Registers that change when the hardware next needs updating
+void Emulator::writeTimingRegister(WORD address, BYTE data) {
+    catchUpHardware();
+    internalMem[address] = data;
+}
+
+// FF04 is divider register, its value is reset to 0 if game attempts to 
+// write to it
+void Emulator::writeDivider(WORD /* address */, BYTE /* data */) {
+    internalMem[DIVIDER] = 0;
+}
+
+// if game changes the freq, the counter must change accordingly
+void Emulator::writeTimerControl(WORD /* address */, BYTE data) {
+
+    catchUpHardware();
+
+    // get the currentFreq, do the writing, then compare with newFreq. if different, counter must be updated
+
+    // to extract bit 1 and 0 of timer controller register
+    BYTE currentFreq = readMem(TAC) & 0x3; 
+    internalMem[TAC] = data; // write the data to the address
+    BYTE newFreq = readMem(TAC) & 0x3;
+
+    // if the freq has changed
+    if (currentFreq != newFreq) { 
+        switch (newFreq) {
+            case 0b00: 
+                timerCounter = 1024; 
+                timerUpdateConstant = 1024; 
+                break; // 4096Hz
+            case 0b01: 
+                timerCounter = 16;
+                timerUpdateConstant = 16;
+                break; // 262144Hz
+            case 0b10: 
+                timerCounter = 64; 
+                timerUpdateConstant = 64;
+                break; // 65536Hz
+            case 0b11: 
+                timerCounter = 256; 
+                timerUpdateConstant = 256; 
+                break; // 16384Hz
+            default:
+                break;
+                //cout << "Something is wrong!" << endl;
+        }
     }
 
 }
 
+// reset the current scanline to 0 if game tries to write to it
+void Emulator::writeScanline(WORD address, BYTE /* data */) {
+    catchUpHardware();
+    internalMem[address] = 0;
+}
+
+// launches a DMA to access the Sprites Attributes table
+void Emulator::writeDMA(WORD /* address */, BYTE data) {
+    doDMATransfer(data);
+}
+
+void Emulator::writePalette(WORD address, BYTE data) {
+    internalMem[address] = data;
+    updatePalettes();
+}
+
 void Emulator::handleBanking(WORD address, BYTE data) {
+    BYTE previousROMBank = currentROMBank;
+    BYTE previousRAMBank = currentRAMBank;
+
     // do RAM enabling
     if (address < 0x2000) {
         doRAMBankEnable(address, data);
@@ -1250,6 +2484,15 @@ void Emulator::handleBanking(WORD address, BYTE data) {
         }
     }
 
+    // Games write the bank they already have, and enable RAM, all the time. 
+    // Only a new mapping needs the pages mapped again, and the current block
+    // may have been decoded from the previous ROM bank
+    if ((currentROMBank != previousROMBank) || (currentRAMBank != previousRAMBank)) {
+        currentBlock = nullptr;
+        blockCacheGeneration++;
+        mapMemory();
+    }
+
 }
 
 void Emulator::doRAMBankEnable(WORD address, BYTE data) {
@@ -1454,6 +2697,7 @@ void Emulator::updateTimers(int cycles) {
     if (dividerCounter >= 256) {
        dividerCounter = 0; // reset it to start counting for upcoming cycles
        internalMem[DIVIDER]++; // directly modifying instead of using writeMem
+       markDirty(DIVIDER);
     }
 
     if (clockEnabled()) {
@@ -1709,13 +2953,20 @@ void Emulator::updateGraphics(int cycles) {
         // need to update directly since gameboy will always reset scanline to 0
         // if attempting to write to 0xFF44 in memory
         internalMem[0xFF44]++;
+        markDirty(0xFF44);
         BYTE currentLine = readMem(0xFF44);
 
         scanlineCycleCount = 456;
 
-        // encountered vblank period
+        // encountered vblank period, the frame is shown unless it was 
+        // skipped (see FRAME SKIP)
         if (currentLine == 144) {
-            renderGraphics();
+            if (framesToSkip == 0) {
+                renderGraphics();
+                framesToSkip = frameSkip;
+            } else {
+                framesToSkip--;
+            }
             flagInterrupt(0);
         }
 
@@ -1725,7 +2976,7 @@ void Emulator::updateGraphics(int cycles) {
         }
 
         // draw the current scanline
-        else if (currentLine < 144) {
+        else if (currentLine < 144 && framesToSkip == 0) {
             drawScanLine();
         }
     }
@@ -1740,6 +2991,7 @@ void Emulator::setLCDStatus() {
         // set the mode to 1 (vblank) during lcd disabled and reset scanline
         scanlineCycleCount = 456;
         internalMem[0xFF44] = 0;
+        markDirty(0xFF44);
         // set last 2 bits of status to 01
         status = bitSet(status, 0);
         status = bitReset(status, 1);
@@ -1792,56 +3044,237 @@ void Emulator::setLCDStatus() {
             status = bitSet(status, 1);
         }
 
-        // mode 0
-        else {
-            newMode = 0;
-            // set last 2 bits of status to 00
-            status = bitReset(status, 0);
-            status = bitReset(status, 1);
-            // check if hblank interrupt (bit 3) is enabled
-            needInterrupt = isBitSet(status, 3);
-        }
+        // mode 0
+        else {
+            newMode = 0;
+            // set last 2 bits of status to 00
+            status = bitReset(status, 0);
+            status = bitReset(status, 1);
+            // check if hblank interrupt (bit 3) is enabled
+            needInterrupt = isBitSet(status, 3);
+        }
+    }
+
+    // if a new mode is entered, request interrupt
+    if (needInterrupt && (newMode != currentMode)) {
+        flagInterrupt(1);
+    }
+
+    // check for the coincidence flag
+    if (currentLine == readMem(0xFF45)) {
+        // set coincidence flag (bit 2) to 1
+        status = bitSet(status, 2);
+        // check if coincidence flag interrupt (bit 6) is enabled
+        if (isBitSet(status, 6)) {
+            flagInterrupt(1);
+        }
+    } else {
+        // set coincidence flag (bit 2) to 0
+        status = bitReset(status, 2);
+    }
+
+    writeMem(0xFF41, status);
+
+}
+
+bool Emulator::LCDEnabled() {
+    return isBitSet(readMem(0xFF40), 7);
+}
+
+void Emulator::drawScanLine() {
+    BYTE lcdControl = readMem(0xFF40);
+
+    // Draw only if LCD is enabled
+    if (LCDEnabled()) {
+        if (isBitSet(lcdControl, 0)) {
+            renderTiles(lcdControl);
+        }
+
+        if (isBitSet(lcdControl, 1)) {
+            renderSprites(lcdControl);
+        }
+
+        // ARGB8888 and packed pixels (see FRAMEBUFFERS)
+        if ((lcdControl & 0x3) != 0) {
+            outputLine(readMem(0xFF44));
+        }
+    }
+}
+
+/*
+
+renderTiles builds a line of colour numbers 8 pixels at a time: each tile in
+the line is one row copied from the tile cache, and the two that SCX cuts off
+are copied whole into spare bytes on either side of the line. The tile map 
+and tile data addresses are worked out once per tile instead of per pixel.
+
+mapShades then turns the colour numbers into shades through BGP, into 
+shadePixels. With a byte shuffle BGP is a 4 byte table and one shuffle looks
+up a whole vector of pixels: AVX2 does 32 pixels a shuffle, picked when the 
+CPU has it since the default x86-64 build only assumes SSE2. WebAssembly 
+built with -msimd128 does 16 with i8x16.swizzle. Every other host looks them 
+up one by one.
+
+expandShades turns a line of shades into ARGB8888 the same way, through the 
+palette of 4 entries, as a pass of its own (see FRAMEBUFFERS). The palette is
+a 16 byte table: shade n becomes the byte indices 4n to 4n+3 of its entry. 
+AVX2 does 8 pixels a shuffle and WebAssembly 4. SSE2 has no byte shuffle, and
+selecting entries with compares and masks came out no faster than looking 
+them up one by one.
+
+A line of 160 pixels, full frame of backgrounds and windows (Tetris, 
+drawScanLine without sprites):
+    per pixel, through readMem and getColour:   348us
+    a tile at a time, AVX2:                     15us
+    a tile at a time, looked up one by one:     27us
+
+*/
+
+#ifdef RENDER_AVX2
+
+__attribute__((target("avx2")))
+static void mapShadesAVX2(const BYTE* colours, const BYTE* palette, BYTE* shades, int count) {
+
+    uint32_t entries;
+    memcpy(&entries, palette, 4);
+    const __m256i table = _mm256_set1_epi32(entries);
+
+    for (int pixel = 0; pixel < count; pixel += 32) {
+        __m256i indices = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&colours[pixel]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&shades[pixel]), _mm256_shuffle_epi8(table, indices));
+    }
+
+}
+
+__attribute__((target("avx2")))
+static void expandShadesAVX2(const BYTE* shades, const uint32_t* palette, uint32_t* pixels, int count) {
+
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(palette)));
+    const __m256i spread = _mm256_setr_epi8(
+        0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+        4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+    const __m256i bytes = _mm256_set1_epi32(0x03020100);
+
+    for (int pixel = 0; pixel < count; pixel += 8) {
+        int64_t eight;
+        memcpy(&eight, &shades[pixel], 8);
+        // Each shade n in the 4 bytes of its pixel, then 4n + 0-3
+        __m256i indices = _mm256_shuffle_epi8(_mm256_set1_epi64x(eight), spread);
+        indices = _mm256_add_epi32(_mm256_slli_epi32(indices, 2), bytes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&pixels[pixel]), _mm256_shuffle_epi8(table, indices));
+    }
+
+}
+
+__attribute__((target("avx2")))
+static void packShadesAVX2(const BYTE* shades, BYTE* packed, int count) {
+
+    // Shades times 64, 16, 4 and 1, summed in fours
+    const __m256i weights = _mm256_set1_epi32(0x01041040);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i lowBytes = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i firstWords = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+    for (int pixel = 0; pixel < count; pixel += 32) {
+        __m256i sums = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&shades[pixel]));
+        sums = _mm256_madd_epi16(_mm256_maddubs_epi16(sums, weights), ones);
+        // The 8 sums are bytes 0, 4, 8 and 12 of both lanes
+        sums = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(sums, lowBytes), firstWords);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&packed[pixel / 4]), _mm256_castsi256_si128(sums));
+    }
+
+}
+
+static const bool hasAVX2 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+}();
+
+#endif
+
+// count is a multiple of 32
+static void mapShades(const BYTE* colours, const BYTE* palette, BYTE* shades, int count) {
+
+#ifdef RENDER_AVX2
+    if (hasAVX2) {
+        mapShadesAVX2(colours, palette, shades, count);
+        return;
     }
+#endif
 
-    // if a new mode is entered, request interrupt
-    if (needInterrupt && (newMode != currentMode)) {
-        flagInterrupt(1);
+#if defined(__wasm_simd128__)
+
+    uint32_t entries;
+    memcpy(&entries, palette, 4);
+    const v128_t table = wasm_i32x4_splat(entries);
+
+    for (int pixel = 0; pixel < count; pixel += 16) {
+        wasm_v128_store(&shades[pixel], wasm_i8x16_swizzle(table, wasm_v128_load(&colours[pixel])));
     }
 
-    // check for the coincidence flag
-    if (currentLine == readMem(0xFF45)) {
-        // set coincidence flag (bit 2) to 1
-        status = bitSet(status, 2);
-        // check if coincidence flag interrupt (bit 6) is enabled
-        if (isBitSet(status, 6)) {
-            flagInterrupt(1);
-        }
-    } else {
-        // set coincidence flag (bit 2) to 0
-        status = bitReset(status, 2);
+#else
+
+    for (int pixel = 0; pixel < count; pixel++) {
+        shades[pixel] = palette[colours[pixel]];
     }
 
-    writeMem(0xFF41, status);
+#endif
 
 }
 
-bool Emulator::LCDEnabled() {
-    return isBitSet(readMem(0xFF40), 7);
-}
+// count is a multiple of 8
+static void expandShades(const BYTE* shades, const uint32_t* palette, uint32_t* pixels, int count) {
 
-void Emulator::drawScanLine() {
-    BYTE lcdControl = readMem(0xFF40);
+#ifdef RENDER_AVX2
+    if (hasAVX2) {
+        expandShadesAVX2(shades, palette, pixels, count);
+        return;
+    }
+#endif
 
-    // Draw only if LCD is enabled
-    if (LCDEnabled()) {
-        if (isBitSet(lcdControl, 0)) {
-            renderTiles(lcdControl);
-        }
+#if defined(__wasm_simd128__)
 
-        if (isBitSet(lcdControl, 1)) {
-            renderSprites(lcdControl);
-        }
+    const v128_t table = wasm_v128_load(palette);
+    const v128_t spread = wasm_i32x4_splat(0x04040404);
+    const v128_t bytes = wasm_i32x4_splat(0x03020100);
+
+    for (int pixel = 0; pixel < count; pixel += 4) {
+        // Shade n in each 32 bit lane, then 4n + 0-3 in its bytes
+        v128_t indices = wasm_u32x4_load8x4(&shades[pixel]);
+        indices = wasm_i32x4_add(wasm_i32x4_mul(indices, spread), bytes);
+        wasm_v128_store(&pixels[pixel], wasm_i8x16_swizzle(table, indices));
+    }
+
+#else
+
+    for (int pixel = 0; pixel < count; pixel++) {
+        pixels[pixel] = palette[shades[pixel]];
+    }
+
+#endif
+
+}
+
+// count is a multiple of 32
+static void packShades(const BYTE* shades, BYTE* packed, int count) {
+
+#ifdef RENDER_AVX2
+    if (hasAVX2) {
+        packShadesAVX2(shades, packed, count);
+        return;
     }
+#endif
+
+    for (int pixel = 0; pixel < count; pixel += 4) {
+        uint32_t four;
+        memcpy(&four, &shades[pixel], 4);
+        // Pixel n of the 4 (byte n) lands in bits 7-2n and 6-2n of the top 
+        // byte
+        packed[pixel / 4] = (uint32_t)(four * 0x40100401) >> 24;
+    }
+
 }
 
 void Emulator::renderTiles(BYTE lcdControl) {
@@ -1913,22 +3346,8 @@ void Emulator::renderTiles(BYTE lcdControl) {
         tileYOffset = (BYTE)((currentLine - windowY) % 8);
     }
 
-    // For loop to draw the current line of pixels
-    for (int pixel = 0; pixel < 160; pixel++) {
-
-        // Get tile x
-        BYTE tileX = (BYTE)(((scrollX + pixel) / 8) % 32);
-
-        if (usingWindow && (pixel >= windowX)) {
-            // This suggests that the window tile map only ever starts 
-            // displaying from the left
-            tileX = (BYTE)((pixel - windowX) / 8);
-        }
-
-        // Calculate tile identifier number from tileY & tileX
-        BYTE tileNum = readMem(tileMapLocation + (tileY*32) + tileX);
-        
-        // Get tile data address
+    // The tile cache row of a tile number, in either addressing mode
+    auto tileRow = [&](BYTE tileNum) {
         WORD tileDataAddress;
         if (unsignedAddressing) {
             // Tile number is unsigned and each tile is 16 bytes
@@ -1939,64 +3358,46 @@ void Emulator::renderTiles(BYTE lcdControl) {
             // tileDataAddress here is in the region 0x8800-97FF
             assert(((tileDataAddress >= 0x8800) && (tileDataAddress <= 0x97FF))== true);
         }
+        return tileRows[((tileDataAddress - 0x8000) >> 1) + tileYOffset];
+    };
+
+    // Colour numbers of the line, pixel 0 at colours[8]. Whole tile rows are
+    // stored, the ones cut off by SCX spill into the 8 bytes on either side
+    alignas(16) BYTE colours[8 + 160 + 16];
+
+    // Background, a tile at a time from the one SCX is in
+    int fineX = scrollX % 8;
+    for (int tile = 0; tile < 21; tile++) {
+        BYTE tileX = (BYTE)(((scrollX / 8) + tile) % 32);
+        BYTE tileNum = internalMem[tileMapLocation + (tileY*32) + tileX];
+        memcpy(&colours[8 + (tile * 8) - fineX], tileRow(tileNum), 8);
+    }
 
-        // Each line is 2 bytes long, to get the current line, add the offset
-        tileDataAddress += (tileYOffset << 1);
-
-        // Read the 2 bytes of data
-        BYTE b1 = readMem(tileDataAddress);
-        BYTE b2 = readMem(tileDataAddress + 1);
-
-        // Figure out the colour palette
-        BYTE bit = 7 - ((scrollX + pixel) % 8);
-        BYTE colourBit0 = isBitSet(b1, bit) ? 0b01 : 0b00;
-        BYTE colourBit1 = isBitSet(b2, bit) ? 0b10 : 0b00;
-
-        // //cout << "Palette: " << (int) readMem(0xFF47) << " | colour bits: " << (int) (colourBit0 + colourBit1) << " | Colour: ";
-
-        // Get the colour
-        COLOUR colour = getColour(colourBit1 + colourBit0, 0xFF47);
-        
-        // Default colour is black where RGB = [0,0,0]
-        int red, green, blue; 
-
-        switch (colour) {
-            case WHITE: 
-                red = 255;
-                green = 255;
-                blue = 255;
-                // //cout << "white" << endl;
-                break;
-            case LIGHT_GRAY:
-                red = 0xCC;
-                green = 0xCC;
-                blue = 0xCC;
-                // //cout << "light gray" << endl;
-                break;
-            case DARK_GRAY:
-                red = 0x77;
-                green = 0x77;
-                blue = 0x77;
-                // //cout << "dark gray" << endl;
-                break;
-            default:
-                red = green = blue = 0;
-                // //cout << "black" << endl;
-                break;
+    // Window from windowX on. Its tiles start at windowX, but the pixels 
+    // are still picked from the tile rows by SCX, so each row is rotated by
+    // (SCX + windowX) % 8. Byte order is pixel order on a little endian host
+    if (usingWindow && (windowX < 160)) {
+        int shift = ((scrollX + windowX) % 8) * 8;
+        for (int tile = 0; windowX + (tile * 8) < 160; tile++) {
+            BYTE tileNum = internalMem[tileMapLocation + (tileY*32) + tile];
+            uint64_t row;
+            memcpy(&row, tileRow(tileNum), 8);
+            if (shift != 0) {
+                row = (row >> shift) | (row << (64 - shift));
+            }
+            memcpy(&colours[8 + windowX + (tile * 8)], &row, 8);
         }
-
-        // Update Screen pixels
-        // Store in pixel format ARGB8888
-        displayPixels[pixel + (currentLine * 160)] = (0xFF << 24) | (red << 16) | (green << 8) | blue;
-
     }
 
+    // Colour numbers to shades
+    mapShades(&colours[8], paletteShades[0], &shadePixels[currentLine * 160], 160);
+
 }
 
 COLOUR Emulator::getColour(BYTE colourNum, WORD address) const {
 
     // Reading colour palette from memory
-    BYTE palette = readMem(address);
+    BYTE palette = internalMem[address];
     /*
     Register FF47 contains the colour palette for background. It assigns gray 
     shades to the colour numbers as follows:
@@ -2029,112 +3430,145 @@ void Emulator::renderSprites(BYTE lcdControl) {
     if (isBitSet(lcdControl, 2)) {
         use8x16 = true;
     }
-    
-    // Cycling through the 40 sprites in OAM for draw loop
-    for (int sprite = 0; sprite < 40; sprite++) {
+    int ySize = use8x16 ? 16 : 8;
+
+    // The sprites on each line, picked again after OAM or the sprite size 
+    // changed (see SPRITE SELECTION)
+    if (spritesChanged || (use8x16 != spritesTall)) {
+        selectSprites(use8x16);
+    }
+
+    int scanLine = internalMem[0xFF44];
+    int count = lineSpriteCounts[scanLine];
+    if (count == 0) {
+        return;
+    }
+
+    // Pixels of this line a sprite with a higher priority has already taken
+    bool taken[160] = {};
+    BYTE* line = &shadePixels[scanLine * 160];
+
+    // Highest priority first
+    for (int i = 0; i < count; i++) {
 
         // Sprite occupies 4 bytes in OAM
         // BYTE0: Y position - 16
         // BYTE1: X position - 8
         // BYTE2: Tile identifier number. Used to look up tile pattern in VRAM
         // BYTE3: Sprite attributes
-        BYTE index = sprite << 2;
-        BYTE yPos = readMem(0xFE00 + index) - 16;
-        BYTE xPos = readMem(0xFE00 + index + 1) - 8;
-        BYTE tileNum = readMem(0xFE00 + index + 2);
-        BYTE attributes = readMem(0xFE00 + index + 3);
+        const BYTE* entry = &internalMem[0xFE00 + (lineSprites[scanLine][i] << 2)];
+        int yPos = entry[0] - 16;
+        int xPos = entry[1] - 8;
+        BYTE tileNum = entry[2];
+        BYTE attributes = entry[3];
 
         bool yFlip = isBitSet(attributes, 6);
         bool xFlip = isBitSet(attributes, 5);
 
-        int scanLine = readMem(0xFF44);
+        // Get the offset for the current line being drawn in the tile
+        int tileYOffset = scanLine - yPos;
+
+        // Read the sprite backwards in y axis if yFlip == true
+        if (yFlip) {
+            tileYOffset -= ySize;
+            tileYOffset *= -1;
+        }
 
-        int ySize = use8x16 ? 16 : 8;
+        // Get the row for the current line from the tile number. A flipped
+        // sprite starts a row further down, in the next tile
+        const BYTE* row = tileRows[(tileNum * 8) + tileYOffset];
 
-        // Is the current scanline being drawn at the sprite location?
-        if ((scanLine >= yPos) && (scanLine < (yPos + ySize))) {
+        // OBP1 or OBP0
+        int palette = isBitSet(attributes, 4) ? 2 : 1;
 
-            // Get the offset for the current line being drawn in the tile
-            int tileYOffset = scanLine - yPos;
+        for (int column = 0; column < 8; column++) {
 
-            // Read the sprite backwards in y axis if yFlip == true
-            if (yFlip) {
-                tileYOffset -= ySize;
-                tileYOffset *= -1;
+            // Off either edge of the screen
+            int pixel = xPos + column;
+            if ((pixel < 0) || (pixel >= 160)) {
+                continue;
             }
 
-            tileYOffset <<= 1; // since each line is 2 bytes long
-            // Get the data address for the current line from the tile number
-            WORD lineDataAddress = (0x8000 + (tileNum * 16)) + tileYOffset;
+            // Read the sprite backwards in x axis if xFlip == true
+            BYTE colourNum = row[xFlip ? (7 - column) : column];
+            BYTE shade = paletteShades[palette][colourNum];
 
-            // Read the 2 bytes of data
-            BYTE b1 = readMem(lineDataAddress);
-            BYTE b2 = readMem(lineDataAddress + 1);
+            // White is transparent for sprites, whatever is behind shows
+            if ((shade == WHITE) || taken[pixel]) {
+                continue;
+            }
+            taken[pixel] = true;
 
-            // It is easier to read in from right to left as
-            // pixel 0 is bit 7
-            // pixel 1 is bit 6...
-            for (int tilePixel = 7; tilePixel >= 0; tilePixel--) {
-                
-                int colourBit = tilePixel;
-                
-                // read the sprite backwards in x axis if xFlip == true
-                if (xFlip) {
-                    colourBit -= 7;
-                    colourBit *= -1;
-                }
+            // check if pixel is hidden behind background
+            if (isBitSet(attributes, 7) && (line[pixel] != WHITE)) {
+                continue;
+            }
 
-                // The rest is the same as in renderTiles
-                // Figure out the colour palette
-                BYTE colourBit0 = isBitSet(b1, colourBit) ? 0b01 : 0b00;
-                BYTE colourBit1 = isBitSet(b2, colourBit) ? 0b10 : 0b00;
-
-                // Get the colour
-                WORD cAddress = isBitSet(attributes, 4) ? 0xFF49 : 0xFF48;
-                COLOUR colour = getColour(colourBit1 + colourBit0, cAddress);
-
-                // Default colour is black where RGB = [0,0,0]
-                int red, green, blue;
-
-                switch (colour) {
-                    case WHITE:
-                        // White is transparent for sprites
-                        continue;
-                    case LIGHT_GRAY:
-                        red = 0xCC;
-                        green = 0xCC;
-                        blue = 0xCC;
-                        break;
-                    case DARK_GRAY:
-                        red = 0x77;
-                        green = 0x77;
-                        blue = 0x77;
-                        break;        
-                    default:
-                        red = green = blue = 0;
-                        break;
-                }
+            // Update Screen pixels
+            line[pixel] = shade;
 
-                // Get the pixel to draw
-                int pixel = xPos + (0 - tilePixel + 7);
+        }
 
-                // check if pixel is hidden behind background
-                if (isBitSet(attributes, 7)) {
+    }
 
-                    if (displayPixels[pixel + (scanLine * 160)] != 0xFFFFFFFF) {
-                        continue ;
-                    }
-                    
-                }
-                // Update Screen pixels
-                displayPixels[pixel + (scanLine * 160)] = (0xFF << 24) | (red << 16) | (green << 8) | blue;
+}
 
-            }
+/*
+********************************************************************************
+SPRITE SELECTION
+********************************************************************************
+*/
+
+/*
+
+The hardware looks through OAM at the start of each line and draws the first
+10 sprites, in OAM order, that are on it. Sprites off the left or right edge 
+count, so games hide sprites at X = 0. Where sprites overlap, the one further
+left wins, and of two at the same X the one first in OAM. 
+
+selectSprites goes through OAM once and files each sprite under the lines it
+covers, up to 10 a line, then orders each line by priority. It runs on the 
+first line drawn after OAM is written (DMA, or writes to 0xFE00-0xFE9F) or 
+the sprite size changes, so usually once a frame, and renderSprites only 
+looks at the sprites on its line.
 
+A pixel belongs to the first sprite in priority order that isn't white 
+there. If that sprite is behind the background, the background shows even 
+where a sprite below it wouldn't be.
+
+*/
+
+void Emulator::selectSprites(bool use8x16) {
+
+    int ySize = use8x16 ? 16 : 8;
+    memset(lineSpriteCounts, 0, sizeof(lineSpriteCounts));
+
+    for (int sprite = 0; sprite < 40; sprite++) {
+        int yPos = internalMem[0xFE00 + (sprite << 2)] - 16;
+        for (int line = max(yPos, 0); line < min(yPos + ySize, 144); line++) {
+            if (lineSpriteCounts[line] < 10) {
+                lineSprites[line][lineSpriteCounts[line]++] = sprite;
+            }
         }
+    }
 
+    // Further left first, OAM order kept between equal X
+    for (int line = 0; line < 144; line++) {
+        BYTE* sprites = lineSprites[line];
+        for (int i = 1; i < lineSpriteCounts[line]; i++) {
+            BYTE sprite = sprites[i];
+            BYTE x = internalMem[0xFE00 + (sprite << 2) + 1];
+            int j = i;
+            for (; (j > 0) && (internalMem[0xFE00 + (sprites[j - 1] << 2) + 1] > x); j--) {
+                sprites[j] = sprites[j - 1];
+            }
+            sprites[j] = sprite;
+        }
     }
 
+    spritesChanged = false;
+    spritesTall = use8x16;
+
 }
 
 void Emulator::doDMATransfer(BYTE data) {
@@ -2161,6 +3595,238 @@ void Emulator::renderGraphics() {
     }
 }
 
+/*
+********************************************************************************
+TILE CACHE
+********************************************************************************
+*/
+
+/*
+
+Tile data is two bit planes per row: the first byte holds bit 0 of the colour
+numbers of the 8 pixels, the second bit 1, leftmost pixel in bit 7. The tile
+cache keeps all 384 tiles of 0x8000-0x97FF decoded, one colour number (0-3) 
+per byte, leftmost pixel first, so the renderers index a row instead of 
+pulling bits out of two VRAM bytes for every pixel.
+
+Rows are in VRAM order, row (address - 0x8000) / 2, so the row of a tile is
+tile * 8 + line in either addressing mode. Writes to tile data go through 
+writeUnmapped, which decodes the row written again. resetCPU and loadState 
+write VRAM directly and decode every row, restore only the rows that differ.
+
+24KB, in an ArenaBuffer next to the framebuffer.
+
+*/
+
+// Each bit of a byte spread out to a byte of its own, bit 7 first
+static const array<uint64_t, 0x100> spreadBits = [] {
+    array<uint64_t, 0x100> table = {};
+    for (int value = 0; value < 0x100; value++) {
+        for (int pixel = 0; pixel < 8; pixel++) {
+            uint64_t bit = (value >> (7 - pixel)) & 1;
+            table[value] |= bit << (pixel * 8);
+        }
+    }
+    return table;
+}();
+
+void Emulator::decodeTileRow(int row) {
+
+    BYTE low = internalMem[0x8000 + (row << 1)];
+    BYTE high = internalMem[0x8000 + (row << 1) + 1];
+
+    // Byte order in memory is pixel order on a little endian host
+    uint64_t colours = spreadBits[low] | (spreadBits[high] << 1);
+    memcpy(tileRows[row], &colours, 8);
+
+}
+
+void Emulator::decodeAllTiles() {
+    for (size_t row = 0; row < tileRowCount; row++) {
+        decodeTileRow(row);
+    }
+}
+
+/*
+********************************************************************************
+PALETTES
+********************************************************************************
+*/
+
+/*
+
+BGP, OBP0 and OBP1 give each colour number a shade (see getColour), and the 
+palette gives each shade an ARGB8888 colour. paletteShades holds the shade 
+of every colour number for each of the three registers, so the renderers 
+look a pixel up with one index. It is worked out again when a palette 
+register is written (writePalette), by resetCPU, loadState and restore. The
+palette only comes in when shades are turned into ARGB8888 (see 
+FRAMEBUFFERS), setPalette applies from the next line drawn.
+
+The palette isn't part of save states or snapshots, it is up to the front 
+end. A sprite pixel is transparent and a background pixel lets sprites behind
+it show when its shade is white, whatever colour the palette gives white.
+
+*/
+
+const array<uint32_t, 4> Emulator::greyPalette = {0xFFFFFFFF, 0xFFCCCCCC, 0xFF777777, 0xFF000000};
+const array<uint32_t, 4> Emulator::greenPalette = {0xFF9BBC0F, 0xFF8BAC0F, 0xFF306230, 0xFF0F380F};
+
+void Emulator::setPalette(const array<uint32_t, 4>& colours) {
+    shades = colours;
+}
+
+array<uint32_t, 4> Emulator::getPalette() const {
+    return shades;
+}
+
+void Emulator::updatePalettes() {
+    for (int palette = 0; palette < 3; palette++) {
+        for (int colourNum = 0; colourNum < 4; colourNum++) {
+            paletteShades[palette][colourNum] = getColour(colourNum, 0xFF47 + palette);
+        }
+    }
+}
+
+/*
+********************************************************************************
+FRAMEBUFFERS
+********************************************************************************
+*/
+
+/*
+
+The renderers draw shades, one byte per pixel from WHITE (0) to BLACK (3), 
+into shadePixels. That is all the picture there is: sprites behind the 
+background look at it, and lines that aren't drawn keep what it holds. After
+a line is drawn, outputLine turns it into the framebuffers that are turned 
+on:
+
+- displayPixels, ARGB8888 through the palette (expandShades), on by default 
+  for the SDL front end.
+- packedPixels, 2 bits per pixel and 40 bytes per line, the leftmost pixel of
+  each byte in its top bits. AVX2 packs 32 shades at a time with multiply
+  and add instructions (packShades). Other hosts pack 4 with one multiply, 
+  each shade lands in its own bits of the top byte and nothing carries.
+
+Something that never looks at colour (agents, video encoders, streaming) can
+turn ARGB8888 off and read shadePixels or packedPixels, 23KB or 5.6KB a frame
+instead of 90KB. Its buffer is released, and shadesToARGB converts a frame 
+when one is wanted after all. A framebuffer turned on starts from the 
+picture in shadePixels, and is kept up from the next line drawn.
+
+A frame of Tetris, AVX2: drawing the shades takes about 25us, expandShades 
+5us more and packShades 1us. memoryFootprint() goes from 233KB to 141KB 
+with ARGB8888 off.
+
+Movies hash shadePixels, so they play back the same whatever the palette and
+the framebuffers turned on.
+
+*/
+
+void Emulator::setARGBOutputEnabled(bool enabled) {
+    ARGBOutput = enabled;
+    allocateFramebuffers();
+}
+
+bool Emulator::isARGBOutputEnabled() const {
+    return ARGBOutput;
+}
+
+void Emulator::setPackedOutputEnabled(bool enabled) {
+    packedOutput = enabled;
+    allocateFramebuffers();
+}
+
+bool Emulator::isPackedOutputEnabled() const {
+    return packedOutput;
+}
+
+void Emulator::shadesToARGB(const BYTE* from, uint32_t* pixels, int count) const {
+    expandShades(from, shades.data(), pixels, count);
+}
+
+// Allocates the framebuffers that are turned on and releases the others
+void Emulator::allocateFramebuffers() {
+
+    if (shadeBuffer.memory == nullptr) {
+        shadeBuffer.allocate(shadeBytes, arena);
+        shadePixels = shadeBuffer.memory;
+    }
+
+    if (!ARGBOutput) {
+        displayBuffer.release();
+        displayPixels = nullptr;
+    } else if (displayBuffer.memory == nullptr) {
+        displayBuffer.allocate(displayBytes, arena);
+        displayPixels = reinterpret_cast<uint32_t*>(displayBuffer.memory);
+        shadesToARGB(shadePixels, displayPixels, 160 * 144);
+    }
+
+    if (!packedOutput) {
+        packedBuffer.release();
+        packedPixels = nullptr;
+    } else if (packedBuffer.memory == nullptr) {
+        packedBuffer.allocate(packedBytes, arena);
+        packedPixels = packedBuffer.memory;
+        packShades(shadePixels, packedPixels, 160 * 144);
+    }
+
+}
+
+void Emulator::updateFramebuffers() {
+    for (int line = 0; line < 144; line++) {
+        outputLine(line);
+    }
+}
+
+void Emulator::outputLine(int line) {
+    if (displayPixels != nullptr) {
+        expandShades(&shadePixels[line * 160], shades.data(), &displayPixels[line * 160], 160);
+    }
+    if (packedPixels != nullptr) {
+        packShades(&shadePixels[line * 160], &packedPixels[line * 40], 160);
+    }
+}
+
+/*
+********************************************************************************
+FRAME SKIP
+********************************************************************************
+*/
+
+/*
+
+With setFrameSkip(n) only one frame in every n + 1 is drawn, for fast forward
+and for agents that only look at every few frames. The CPU, LY, STAT and the 
+interrupts run exactly as before, updateGraphics just leaves out drawScanLine
+on the lines of a skipped frame and doesn't call the render callback at its 
+vblank. framesToSkip counts down at every vblank. The n frames after a 
+setFrameSkip or resetCPU are skipped and the one after is drawn, so every 
+runFrames(n + 1) from then on draws its last frame and only that one.
+
+Nothing the renderer needs is built while drawing: the tile cache is updated 
+when VRAM is written and the sprites on each line are selected again after an
+OAM write, so the first frame drawn after skipped ones is the frame that 
+would have been drawn anyway. The exception is what was drawn before: lines 
+with the background off keep the picture of the last frame drawn, not of the
+frame just before. Movies and the rewind buffer hash or keep every frame, 
+they expect frame skip off.
+
+framesToSkip is part of snapshots, so a run from a snapshot draws the same 
+frames. It isn't part of save states.
+
+*/
+
+void Emulator::setFrameSkip(int frames) {
+    frameSkip = max(frames, 0);
+    framesToSkip = frameSkip;
+}
+
+int Emulator::getFrameSkip() const {
+    return frameSkip;
+}
+
 /*
 ********************************************************************************
 Utility Functions
@@ -2219,8 +3885,7 @@ int Emulator::LD_r_R(BYTE& loadTo, BYTE loadFrom) {
     Flags affected(znhc): ----
  */
 int Emulator::LD_r_n(BYTE& reg) {
-    BYTE n = readMem(programCounter.regstr);
-    programCounter.regstr++;
+    BYTE n = fetchByte();
     reg = n;
 
     //cout << "LD_r_n" << endl;
@@ -2273,8 +3938,7 @@ int Emulator::LD_HL_r(BYTE reg) {
     Flags affected(znhc): ----
  */
 int Emulator::LD_HL_n() {
-    BYTE imm = readMem(programCounter.regstr);
-    programCounter.regstr++;
+    BYTE imm = fetchByte();
     writeMem(regHL.regstr, imm);
 
     //cout << "LD_HL_n" << endl;
@@ -2326,9 +3990,7 @@ int Emulator::LD_A_DE() {
     Flags affected(znhc): ----
  */
 int Emulator::LD_A_nn() {
-    WORD nn = readMem(programCounter.regstr + 1) << 8;
-    nn |= readMem(programCounter.regstr);
-    programCounter.regstr += 2;
+    WORD nn = fetchWord();
     regAF.high = readMem(nn);
 
     //cout << "LD_A_nn" << endl;
@@ -2382,9 +4044,7 @@ int Emulator::LD_DE_A() {
     Flags affected(znhc): ----
  */
 int Emulator::LD_nn_A() {
-    WORD nn = readMem(programCounter.regstr + 1) << 8;
-    nn |= readMem(programCounter.regstr);
-    programCounter.regstr += 2;
+    WORD nn = fetchWord();
     writeMem(nn, regAF.high);
 
     //cout << "LD_nn_A" << endl;
@@ -2403,8 +4063,7 @@ int Emulator::LD_nn_A() {
     Flags affected(znhc): ----
  */
 int Emulator::LD_A_FF00n() {
-    BYTE n = readMem(programCounter.regstr);
-    programCounter.regstr++;
+    BYTE n = fetchByte();
     regAF.high = readMem(0xFF00 + n);
 
     //cout << "LD_A_FF00n" << endl;
@@ -2423,8 +4082,7 @@ int Emulator::LD_A_FF00n() {
     Flags affected(znhc): ----
  */
 int Emulator::LD_FF00n_A() {
-    BYTE n = readMem(programCounter.regstr);
-    programCounter.regstr++;
+    BYTE n = fetchByte();
     writeMem(0xFF00 + n, regAF.high);
 
     //cout << "LD_FF00n_A" << endl;
@@ -2557,9 +4215,7 @@ int Emulator::LDD_A_HL() {
     Flags affected(znhc): ----
  */
 int Emulator::LD_rr_nn(Register& reg) {
-    WORD nn = readMem(programCounter.regstr + 1) << 8;
-    nn |= readMem(programCounter.regstr);
-    programCounter.regstr += 2;
+    WORD nn = fetchWord();
     reg.regstr = nn;
 
     //cout << "LD_rr_nn" << endl;
@@ -2594,9 +4250,7 @@ int Emulator::LD_SP_HL() {
     Flags affected(znhc): ----
  */
 int Emulator::LD_nn_SP() {
-    WORD nn = readMem(programCounter.regstr + 1) << 8;
-    nn |= readMem(programCounter.regstr);
-    programCounter.regstr += 2;
+    WORD nn = fetchWord();
 
     writeMem(nn + 1, stackPointer.high);
     writeMem(nn, stackPointer.low);
@@ -2674,24 +4328,9 @@ int Emulator::POP_rr(Register& reg) {
  */
 int Emulator::ADD_A_r(BYTE regR) {
     BYTE result = regAF.high + regR;
-    
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Half carry flag 
-    if (((regR ^ regAF.high ^ result) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
 
-    // Carry flag
-    if (result < regAF.high) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_ADD, regAF.high, regR, result);
 
     regAF.high = result;
 
@@ -2714,27 +4353,11 @@ int Emulator::ADD_A_r(BYTE regR) {
     - c: Set if carry from bit 7
  */
 int Emulator::ADD_A_n() {
-    BYTE n = readMem(programCounter.regstr);
-    programCounter.regstr++;
-    BYTE result = regAF.high + n;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    BYTE operand = fetchByte();
+    BYTE result = regAF.high + operand;
 
-    // Half carry flag 
-    if (((n ^ regAF.high ^ result) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (result < regAF.high) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_ADD, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -2757,26 +4380,11 @@ int Emulator::ADD_A_n() {
     - c: Set if carry from bit 7
  */
 int Emulator::ADD_A_HL() {
-    BYTE toAdd = readMem(regHL.regstr);
-    BYTE result = regAF.high + toAdd;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Half carry flag 
-    if (((toAdd ^ regAF.high ^ result) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (result < regAF.high) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    BYTE operand = readMem(regHL.regstr);
+    BYTE result = regAF.high + operand;
+
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_ADD, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -2800,27 +4408,12 @@ int Emulator::ADD_A_HL() {
     - c: Set if carry from bit 7
  */
 int Emulator::ADC_A_r(BYTE reg) {
-    BYTE carry = isBitSet(regAF.low, FLAG_CARRY) ? 0x01 : 0x00;
-    BYTE toAdd = carry + reg;
-    BYTE result = regAF.high + toAdd;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Half carry flag 
-    if (((toAdd ^ regAF.high ^ result) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
+    BYTE carry = lazyCarry() ? 0x01 : 0x00;
+    BYTE operand = carry + reg;
+    BYTE result = regAF.high + operand;
 
-    // Carry flag
-    if (result < regAF.high) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_ADD, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -2843,29 +4436,12 @@ int Emulator::ADC_A_r(BYTE reg) {
     - c: Set if carry from bit 7
  */
 int Emulator::ADC_A_n() {
-    BYTE carry = isBitSet(regAF.low, FLAG_CARRY) ? 0x01 : 0x00;
-    BYTE toAdd = carry + readMem(programCounter.regstr);
-    BYTE result = regAF.high + toAdd;
-    programCounter.regstr++;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Half carry flag 
-    if (((toAdd ^ regAF.high ^ result) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-        assert(((regAF.high & 0x0F) + (toAdd & 0x0F)) > 0x0F);
-    }
+    BYTE carry = lazyCarry() ? 0x01 : 0x00;
+    BYTE operand = carry + fetchByte();
+    BYTE result = regAF.high + operand;
 
-    // Carry flag
-    if (result < regAF.high) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_ADD, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -2888,27 +4464,12 @@ int Emulator::ADC_A_n() {
     - c: Set if carry from bit 7
  */
 int Emulator::ADC_A_HL() {
-    BYTE carry = isBitSet(regAF.low, FLAG_CARRY) ? 0x01 : 0x00;
-    BYTE toAdd = carry + readMem(regHL.regstr);
-    BYTE result = regAF.high + toAdd;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Half carry flag 
-    if (((toAdd ^ regAF.high ^ result) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
+    BYTE carry = lazyCarry() ? 0x01 : 0x00;
+    BYTE operand = carry + readMem(regHL.regstr);
+    BYTE result = regAF.high + operand;
 
-    // Carry flag
-    if (result < regAF.high) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_ADD, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -2934,27 +4495,8 @@ int Emulator::ADC_A_HL() {
 int Emulator::SUB_r(BYTE reg) {
     BYTE result = regAF.high - reg;
 
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of r, set HCF
-    if ((regAF.high & 0x0F) < (reg & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (regAF.high < reg) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, reg, result);
 
     regAF.high = result;
 
@@ -2977,33 +4519,11 @@ int Emulator::SUB_r(BYTE reg) {
     - c: Set if A less than n
  */
 int Emulator::SUB_n() {
-    BYTE n = readMem(programCounter.regstr);
-    programCounter.regstr++;
-
-    BYTE result = regAF.high - n;
-
-    // Reset the flags
-    regAF.low &= 0x00;
+    BYTE operand = fetchByte();
+    BYTE result = regAF.high - operand;
 
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of n, set HCF
-    if ((regAF.high & 0x0F) < (n & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (regAF.high < n) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-        assert((regAF.high & 0xFF) < (n & 0xFF));
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -3026,30 +4546,11 @@ int Emulator::SUB_n() {
     - c: Set if A less than (HL)
  */
 int Emulator::SUB_HL() {
-    BYTE toSub = readMem(regHL.regstr);
-    BYTE result = regAF.high - toSub;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
+    BYTE operand = readMem(regHL.regstr);
+    BYTE result = regAF.high - operand;
 
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of toSub, set HCF
-    if ((regAF.high & 0x0F) < (toSub & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (regAF.high < toSub) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -3073,31 +4574,12 @@ int Emulator::SUB_HL() {
     - c: Set if A less than toSub
  */
 int Emulator::SBC_A_r(BYTE reg) {
-    BYTE carry = isBitSet(regAF.low, FLAG_CARRY) ? 0x1 : 0x0;
-    BYTE toSub = carry + reg;
-    BYTE result = regAF.high - toSub;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of toSub, set HCF
-    if ((regAF.high & 0x0F) < (toSub & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
+    BYTE carry = lazyCarry() ? 0x01 : 0x00;
+    BYTE operand = carry + reg;
+    BYTE result = regAF.high - operand;
 
-    // Carry flag
-    if (regAF.high < toSub) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -3120,33 +4602,12 @@ int Emulator::SBC_A_r(BYTE reg) {
     - c: Set if A less than toSub
  */
 int Emulator::SBC_A_n() {
-    BYTE carry = isBitSet(regAF.low, FLAG_CARRY) ? 0x1 : 0x0;
-    BYTE toSub = carry + readMem(programCounter.regstr);
-    programCounter.regstr++;
-
-    BYTE result = regAF.high - toSub;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
+    BYTE carry = lazyCarry() ? 0x01 : 0x00;
+    BYTE operand = carry + fetchByte();
+    BYTE result = regAF.high - operand;
 
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of toSub, set HCF
-    if ((regAF.high & 0x0F) < (toSub & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (regAF.high < toSub) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -3169,31 +4630,12 @@ int Emulator::SBC_A_n() {
     - c: Set if A less than toSub
  */
 int Emulator::SBC_A_HL() {
-    BYTE carry = isBitSet(regAF.low, FLAG_CARRY) ? 0x1 : 0x0;
-    BYTE toSub = carry + readMem(regHL.regstr);
-    BYTE result = regAF.high - toSub;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of toSub, set HCF
-    if ((regAF.high & 0x0F) < (toSub & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
+    BYTE carry = lazyCarry() ? 0x01 : 0x00;
+    BYTE operand = carry + readMem(regHL.regstr);
+    BYTE result = regAF.high - operand;
 
-    // Carry flag
-    if (regAF.high < toSub) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     regAF.high = result;
 
@@ -3218,17 +4660,9 @@ int Emulator::SBC_A_HL() {
  */
 int Emulator::AND_r(BYTE reg) {
     BYTE result = regAF.high & reg;
-    
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
 
-    // Half carry flag 
-    regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_AND, 0, 0, result);
 
     regAF.high = result;
 
@@ -3251,19 +4685,11 @@ int Emulator::AND_r(BYTE reg) {
     - c: 0
  */
 int Emulator::AND_n() {
-    BYTE result = regAF.high & readMem(programCounter.regstr);
-    programCounter.regstr++;
-    
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    BYTE operand = fetchByte();
+    BYTE result = regAF.high & operand;
 
-    // Half carry flag 
-    regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_AND, 0, 0, result);
 
     regAF.high = result;
 
@@ -3286,18 +4712,11 @@ int Emulator::AND_n() {
     - c: 0
  */
 int Emulator::AND_HL() {
-    BYTE result = regAF.high & readMem(regHL.regstr);
-    
-    // Reset the flags
-    regAF.low &= 0x00;
+    BYTE operand = readMem(regHL.regstr);
+    BYTE result = regAF.high & operand;
 
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Half carry flag 
-    regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_AND, 0, 0, result);
 
     regAF.high = result;
 
@@ -3322,13 +4741,8 @@ int Emulator::AND_HL() {
 int Emulator::XOR_r(BYTE reg) {
     BYTE result = regAF.high ^ reg;
 
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_OR, 0, 0, result);
 
     regAF.high = result;
 
@@ -3351,16 +4765,11 @@ int Emulator::XOR_r(BYTE reg) {
     - c: 0
  */
 int Emulator::XOR_n() {
-    BYTE result = regAF.high ^ readMem(programCounter.regstr);
-    programCounter.regstr++;
+    BYTE operand = fetchByte();
+    BYTE result = regAF.high ^ operand;
 
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_OR, 0, 0, result);
 
     regAF.high = result;
 
@@ -3383,15 +4792,11 @@ int Emulator::XOR_n() {
     - c: 0
  */
 int Emulator::XOR_HL() {
-    BYTE result = regAF.high ^ readMem(regHL.regstr);
+    BYTE operand = readMem(regHL.regstr);
+    BYTE result = regAF.high ^ operand;
 
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_OR, 0, 0, result);
 
     regAF.high = result;
 
@@ -3417,13 +4822,8 @@ int Emulator::XOR_HL() {
 int Emulator::OR_r(BYTE reg) {
     BYTE result = regAF.high | reg;
 
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_OR, 0, 0, result);
 
     regAF.high = result;
 
@@ -3446,16 +4846,11 @@ int Emulator::OR_r(BYTE reg) {
     - c: 0
  */
 int Emulator::OR_n() {
-    BYTE result = regAF.high | readMem(programCounter.regstr);
-    programCounter.regstr++;
-
-    // Reset the flags
-    regAF.low &= 0x00;
+    BYTE operand = fetchByte();
+    BYTE result = regAF.high | operand;
 
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_OR, 0, 0, result);
 
     regAF.high = result;
 
@@ -3478,15 +4873,11 @@ int Emulator::OR_n() {
     - c: 0
  */
 int Emulator::OR_HL() {
-    BYTE result = regAF.high | readMem(regHL.regstr);
-
-    // Reset the flags
-    regAF.low &= 0x00;
+    BYTE operand = readMem(regHL.regstr);
+    BYTE result = regAF.high | operand;
 
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_OR, 0, 0, result);
 
     regAF.high = result;
 
@@ -3513,28 +4904,8 @@ int Emulator::OR_HL() {
 int Emulator::CP_r(BYTE reg) {
     BYTE result = regAF.high - reg;
 
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of r, set HCF
-    if ((regAF.high & 0x0F) < (reg & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (regAF.high < reg) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-        assert((regAF.high & 0xFF) < (reg & 0xFF));
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, reg, result);
 
     //cout << "CP_r" << endl;
 
@@ -3556,33 +4927,11 @@ int Emulator::CP_r(BYTE reg) {
     - c: Set if A less than n
  */
 int Emulator::CP_n() {
-    BYTE n = readMem(programCounter.regstr);
-    programCounter.regstr++;
-
-    BYTE result = regAF.high - n;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of n, set HCF
-    if ((regAF.high & 0x0F) < (n & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
+    BYTE operand = fetchByte();
+    BYTE result = regAF.high - operand;
 
-    // Carry flag
-    if (regAF.high < n) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-        assert((regAF.high & 0xFF) < (n & 0xFF));
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     //cout << "CP_n" << endl;
 
@@ -3604,30 +4953,11 @@ int Emulator::CP_n() {
     - c: Set if A less than (HL)
  */
 int Emulator::CP_HL() {
-    BYTE toSub = readMem(regHL.regstr);
-    BYTE result = regAF.high - toSub;
-
-    // Reset the flags
-    regAF.low &= 0x00;
-
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    }
+    BYTE operand = readMem(regHL.regstr);
+    BYTE result = regAF.high - operand;
 
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
-
-    // Half carry flag 
-    // If lower nibble of A is less than lower nibble of toSub, set HCF
-    if ((regAF.high & 0x0F) < (toSub & 0x0F)) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    }
-
-    // Carry flag
-    if (regAF.high < toSub) {
-        regAF.low = bitSet(regAF.low, FLAG_CARRY);
-    }
+    // Z N H C are only worked out when F is read
+    setLazyFlags(FLAGS_SUB, regAF.high, operand, result);
 
     //cout << "CP_HL" << endl;
 
@@ -3649,28 +4979,12 @@ int Emulator::CP_HL() {
     - c: Not affected
  */
 int Emulator::INC_r(BYTE& reg) {
-    bool wasBit3Set = isBitSet(reg, 3);
-    reg++;
-    bool afterBit3Set = isBitSet(reg, 3);
-    
-    // Zero flag
-    if (reg == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    } else {
-        regAF.low = bitReset(regAF.low, FLAG_ZERO);
-    }
+    BYTE result = reg + 1;
 
-    // Subtract flag
-    regAF.low = bitReset(regAF.low, FLAG_SUB);
+    // Z N H are only worked out when F is read, C is kept
+    setLazyFlags(FLAGS_INC, preservedFlags(), 0, result);
 
-    // Half carry flag 
-    // Set if bit 3 was set before the increment, then not set after the increment
-    if (wasBit3Set && !afterBit3Set) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    } 
-    else {
-        regAF.low = bitReset(regAF.low, FLAG_HALFCARRY);
-    }
+    reg = result;
 
     //cout << "INC_r" << endl;
 
@@ -3691,31 +5005,12 @@ int Emulator::INC_r(BYTE& reg) {
     - c: Not affected
  */
 int Emulator::INC_HL() {
-    BYTE HLdata = readMem(regHL.regstr);
-    bool wasBit3Set = isBitSet(HLdata, 3);
-    HLdata++;
-    bool afterBit3Set = isBitSet(HLdata, 3);
-    
-    // Zero flag
-    if (HLdata == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    } else {
-        regAF.low = bitReset(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitReset(regAF.low, FLAG_SUB);
+    BYTE result = readMem(regHL.regstr) + 1;
 
-    // Half carry flag 
-    // Set if bit 3 was set before the increment, then not set after the increment
-    if (wasBit3Set && !afterBit3Set) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    } 
-    else {
-        regAF.low = bitReset(regAF.low, FLAG_HALFCARRY);
-    }
+    // Z N H are only worked out when F is read, C is kept
+    setLazyFlags(FLAGS_INC, preservedFlags(), 0, result);
 
-    writeMem(regHL.regstr, HLdata);
+    writeMem(regHL.regstr, result);
 
     //cout << "INC_HL" << endl;
 
@@ -3738,24 +5033,9 @@ int Emulator::INC_HL() {
  */
 int Emulator::DEC_r(BYTE& reg) {
     BYTE result = reg - 1;
-    
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    } else {
-        regAF.low = bitReset(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
 
-    // Half carry flag 
-    if (((result ^ reg ^ 0x1) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    } 
-    else {
-        regAF.low = bitReset(regAF.low, FLAG_HALFCARRY);
-    }
+    // Z N H are only worked out when F is read, C is kept
+    setLazyFlags(FLAGS_DEC, preservedFlags(), 0, result);
 
     reg = result;
 
@@ -3778,26 +5058,10 @@ int Emulator::DEC_r(BYTE& reg) {
     - c: Not affected
  */
 int Emulator::DEC_HL() {
-    BYTE initial = readMem(regHL.regstr);
-    BYTE result =  initial - 1;
-    
-    // Zero flag
-    if (result == 0x0) {
-        regAF.low = bitSet(regAF.low, FLAG_ZERO);
-    } else {
-        regAF.low = bitReset(regAF.low, FLAG_ZERO);
-    }
-
-    // Subtract flag
-    regAF.low = bitSet(regAF.low, FLAG_SUB);
+    BYTE result = readMem(regHL.regstr) - 1;
 
-    // Half carry flag 
-    if ((((result ^ initial ^ 0x1)) & 0x10) == 0x10) {
-        regAF.low = bitSet(regAF.low, FLAG_HALFCARRY);
-    } 
-    else {
-        regAF.low = bitReset(regAF.low, FLAG_HALFCARRY);
-    }
+    // Z N H are only worked out when F is read, C is kept
+    setLazyFlags(FLAGS_DEC, preservedFlags(), 0, result);
 
     writeMem(regHL.regstr, result);
 
@@ -4004,8 +5268,7 @@ int Emulator::DEC_rr(WORD& rr) {
 int Emulator::ADD_SP_dd() {
 
     WORD before = stackPointer.regstr;
-    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(readMem(programCounter.regstr));
-    programCounter.regstr++;
+    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(fetchByte());
 
     // Adding dd to SP and storing result in SP
     WORD result = before + dd;
@@ -4048,8 +5311,7 @@ int Emulator::ADD_SP_dd() {
 int Emulator::LD_HL_SPdd() {
 
     WORD before = stackPointer.regstr;
-    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(readMem(programCounter.regstr));
-    programCounter.regstr++;
+    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(fetchByte());
 
     // Adding dd to SP, and load result into HL
     WORD result = stackPointer.regstr + dd;
@@ -5276,6 +6538,9 @@ int Emulator::EI() {
 
     InterruptMasterEnabled = true;
 
+    // Pending interrupts are serviced after this instruction
+    nextSyncCycle = cycleCounter;
+
     //cout << "EI" << endl;
 
     return 4;
@@ -5299,10 +6564,7 @@ Jump Commands
 */
 int Emulator::JP_nn() {
 
-    WORD lowByte = readMem(programCounter.regstr);
-    WORD highByte = readMem(programCounter.regstr + 1);
-
-    programCounter.regstr = (highByte << 8) | lowByte;
+    programCounter.regstr = fetchWord();
 
     //cout << "JP_nn" << endl;
     return 16;
@@ -5346,10 +6608,7 @@ int Emulator::JP_HL() {
 int Emulator::JP_f_nn(BYTE opcode) {
 
     // Get nn
-    WORD lowByte = readMem(programCounter.regstr);
-    WORD highByte = readMem(programCounter.regstr + 1);
-    WORD nn = (highByte << 8) | lowByte;
-    programCounter.regstr += 2;
+    WORD nn = fetchWord();
 
     bool jump = false;
     switch ((opcode >> 3) & 0x03) {
@@ -5390,8 +6649,7 @@ int Emulator::JP_f_nn(BYTE opcode) {
 */
 int Emulator::JR_PCdd() {
 
-    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(readMem(programCounter.regstr));
-    programCounter.regstr++;
+    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(fetchByte());
 
     programCounter.regstr += dd;
 
@@ -5417,8 +6675,7 @@ int Emulator::JR_PCdd() {
 */
 int Emulator::JR_f_PCdd(BYTE opcode) {
 
-    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(readMem(programCounter.regstr));
-    programCounter.regstr++;
+    SIGNED_BYTE dd = static_cast<SIGNED_BYTE>(fetchByte());
 
     bool jump = false;
     switch ((opcode >> 3) & 0x03) {
@@ -5459,10 +6716,7 @@ int Emulator::JR_f_PCdd(BYTE opcode) {
 int Emulator::CALL_nn() {
 
     // Get nn
-    WORD lowByte = readMem(programCounter.regstr);
-    WORD highByte = readMem(programCounter.regstr + 1);
-    programCounter.regstr += 2;
-    WORD nn = (highByte << 8) | lowByte;
+    WORD nn = fetchWord();
 
     // Push PC onto stack
     stackPointer.regstr--;
@@ -5496,10 +6750,7 @@ int Emulator::CALL_nn() {
 int Emulator::CALL_f_nn(BYTE opcode) {
 
     // Get nn
-    WORD lowByte = readMem(programCounter.regstr);
-    WORD highByte = readMem(programCounter.regstr + 1);
-    programCounter.regstr += 2;
-    WORD nn = (highByte << 8) | lowByte;
+    WORD nn = fetchWord();
 
     bool call = false;
     switch ((opcode >> 3) & 0x03) {
@@ -5639,8 +6890,9 @@ int Emulator::RETI() {
     // Set PC to address
     programCounter.regstr = (highByte << 8) | lowByte;
 
-    // Enable interrupts
+    // Enable interrupts, pending ones are serviced after this instruction
     InterruptMasterEnabled = true;
+    nextSyncCycle = cycleCounter;
 
     //cout << "RETI" << endl;
 
@@ -2,6 +2,19 @@
 #include <string>
 #include <cassert>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <utility>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 // For the flag bits in register F
 #define FLAG_ZERO 7
@@ -15,6 +28,12 @@
 #define TMA 0xFF06
 #define TAC 0xFF07
 
+// The JIT (JIT.cpp) emits x86-64 code, other hosts and the WebAssembly build 
+// only have the interpreter
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define JIT_X64
+#endif
+
 using namespace std;
 
 typedef unsigned char BYTE;
@@ -30,6 +49,94 @@ union Register {
     };
 };
 
+// A ROM file mapped read-only and shared by every Emulator that loads it 
+// (ROMImage.cpp)
+class ROMImage {
+
+    public:
+        static shared_ptr<const ROMImage> open(const string&);
+        static shared_ptr<const ROMImage> empty();
+
+        ROMImage(const ROMImage&) = delete;
+        ROMImage& operator=(const ROMImage&) = delete;
+        ~ROMImage();
+
+        const BYTE* data() const { return bytes; }
+        size_t size() const { return fileSize; }
+        uint64_t hash() const { return contentHash; } // of the file, save states check it
+
+    private:
+        ROMImage();
+
+        void* mapping;
+        size_t mappingSize;
+        vector<BYTE> buffer; // without mmap
+        const BYTE* bytes;
+        size_t fileSize;
+        uint64_t contentHash;
+
+};
+
+// Hands out the large buffers of Emulators from big blocks and keeps freed 
+// ones for reuse, so many Emulators pack tightly (MemoryArena.cpp). It has to 
+// outlive the Emulators using it
+class MemoryArena {
+
+    public:
+        explicit MemoryArena(size_t blockSize = 0x400000);
+        MemoryArena(const MemoryArena&) = delete;
+        MemoryArena& operator=(const MemoryArena&) = delete;
+
+        BYTE* allocate(size_t);
+        void release(BYTE*, size_t);
+        size_t reserved() const; // bytes taken from the system
+
+    private:
+        static size_t roundSize(size_t);
+
+        mutable mutex lock;
+        size_t blockSize;
+        vector<unique_ptr<BYTE[]>> blocks;
+        size_t reservedBytes;
+        size_t blockUsed; // in the last block
+        unordered_map<size_t, vector<BYTE*>> freeBuffers; // by size
+
+};
+
+// Writes files on a background thread, through a temporary file and a 
+// rename (FileWriter.cpp)
+class FileWriter {
+
+    public:
+        static FileWriter& shared();
+        ~FileWriter();
+
+        // Queues it. written, if given, is called on the writer thread with 
+        // whether the file was written
+        void write(const string& path, vector<BYTE> contents, function<void(bool)> written = nullptr);
+        void flush(); // waits for the queued writes
+
+    private:
+        FileWriter();
+        void run();
+        static bool writeFile(const string&, const vector<BYTE>&);
+
+        mutex lock;
+        condition_variable queued;
+        condition_variable done;
+        struct PendingFile {
+            string path;
+            vector<BYTE> contents;
+            function<void(bool)> written;
+        };
+
+        deque<PendingFile> pending;
+        bool stopping;
+        bool busy; // writing one that is no longer in pending
+        thread worker;
+
+};
+
 enum COLOUR {
     WHITE,
     LIGHT_GRAY,
@@ -41,13 +148,30 @@ class Emulator {
 
     public:
         // ATTRIBUTES
-        uint32_t displayPixels[160 * 144];
+        // Framebuffers, 160 * 144 (see FRAMEBUFFERS)
+        BYTE* shadePixels = nullptr; // a COLOUR per pixel, always drawn
+        uint32_t* displayPixels = nullptr; // ARGB8888, nullptr while turned off
+        BYTE* packedPixels = nullptr; // 2 bits per pixel, nullptr unless turned on
 
         // FUNCTIONS
         bool loadGame(string);
-        void saveGame(string);
-        void loadState(string);
-        void saveState(string);
+        uint64_t getROMHash() const;
+        void saveGame(string); // battery RAM, if it changed since the last call
+        bool loadState(string);
+        // Written in the background (see FILE WRITER), saved is called with 
+        // whether it was, on the writer thread
+        void saveState(string, function<void(bool)> saved = nullptr);
+
+        // Save states in memory, same format as the files (see SAVING AND 
+        // LOADING STATES)
+        void writeState(vector<BYTE>&);
+        bool readState(const vector<BYTE>&);
+
+        // Snapshots into a buffer of snapshotSize bytes, aligned to 8 bytes. 
+        // They don't allocate and only restore into the same ROM (see SNAPSHOTS)
+        static const size_t snapshotSize = 0xC300;
+        void snapshot(void*) const;
+        bool restore(const void*);
 
         void resetCPU();
         void update();
@@ -55,19 +179,178 @@ class Emulator {
         void buttonReleased(int);
         void setRenderGraphics(void(*funcPtr)());
 
+        // Palette, the ARGB8888 colours of white, light gray, dark gray and 
+        // black (see PALETTES)
+        static const array<uint32_t, 4> greyPalette; // the default
+        static const array<uint32_t, 4> greenPalette; // the original screen
+        void setPalette(const array<uint32_t, 4>&);
+        array<uint32_t, 4> getPalette() const;
+
+        // Frame skip, draws one frame in every n + 1, off (0) by default 
+        // (see FRAME SKIP)
+        void setFrameSkip(int);
+        int getFrameSkip() const;
+
+        // Framebuffers filled besides shadePixels, displayPixels is on and
+        // packedPixels off by default (see FRAMEBUFFERS)
+        void setARGBOutputEnabled(bool);
+        bool isARGBOutputEnabled() const;
+        void setPackedOutputEnabled(bool);
+        bool isPackedOutputEnabled() const;
+        void shadesToARGB(const BYTE* shades, uint32_t* pixels, int count) const; // count a multiple of 8
+        void updateFramebuffers(); // from shadePixels, after writing to it
+
+        // Batch execution (see BATCH EXECUTION)
+        struct RunResult {
+            uint64_t cycles; // cycles run by the call
+            int overshoot; // cycles run past the budget, taken off the next run
+            bool conditionMet; // stopped at the PC or memory value
+        };
+
+        static const int cyclesPerFrame = 70224;
+
+        RunResult runCycles(uint64_t);
+        RunResult runFrames(int);
+        RunResult runUntilPC(WORD address, uint64_t budget);
+        RunResult runUntilMemory(WORD address, BYTE value, uint64_t budget);
+
+        // JIT, off by default
+        void setJITEnabled(bool);
+        bool isJITEnabled() const;
+
+        // Idle loop detection, on by default
+        void setIdleLoopDetection(bool);
+        bool isIdleLoopDetectionEnabled() const;
+        uint64_t getIdleCyclesSkippedInRun() const; // in total over the last update() or run
+
+        // Pages written since the last takeDirtyPages (see DIRTY PAGES)
+        struct DirtyPages {
+            bitset<0x100> memory; // 256 byte pages of 0x0000-0xFFFF, by address >> 8
+            bitset<0x80> RAM; // 256 byte pages of the RAM banks
+        };
+
+        DirtyPages takeDirtyPages();
+
+        // Memory, see MEMORY LAYOUT
+        void setMemoryArena(MemoryArena*); // moves the buffers already allocated
+        size_t memoryFootprint() const; // bytes used, without the shared ROM and JIT code
+
         // Utility
         bool isBitSet(BYTE, int) const;
         BYTE bitSet(BYTE, int) const;
         BYTE bitReset(BYTE, int) const;
 
     private:
+        // TYPES
+        // Lazy flags, F as left by the last ALU instruction (see LAZY FLAGS)
+        enum FlagOperation {
+            FLAGS_READY, FLAGS_ADD, FLAGS_SUB, FLAGS_AND, FLAGS_OR, FLAGS_INC, FLAGS_DEC
+        };
+
+        enum StopCondition { STOP_NONE, STOP_AT_PC, STOP_AT_MEMORY };
+
+        typedef int (Emulator::*OpcodeHandler)();
+
+        struct DecodedInstruction {
+            OpcodeHandler handler;
+            BYTE operand[2];
+            BYTE length;
+            BYTE opcode;
+        };
+
+        struct CodeBlock {
+            vector<DecodedInstruction> instructions;
+            WORD start;
+            WORD end;
+            int executionCount; // times entered while the JIT is enabled
+            const BYTE* nativeCode; // compiled by the JIT, or nullptr
+            size_t idleLoopLength; // instructions up to a side effect free branch back to start, or 0
+        };
+
+        // Executable memory holding the emitted code, writable only while 
+        // code is emitted. It belongs to a single Emulator, so it can be moved
+        // but not copied
+        struct JITCodeBuffer {
+            BYTE* memory = nullptr;
+            size_t used = 0;
+
+            JITCodeBuffer() = default;
+            JITCodeBuffer(const JITCodeBuffer&) = delete;
+            JITCodeBuffer& operator=(const JITCodeBuffer&) = delete;
+            JITCodeBuffer(JITCodeBuffer&&);
+            JITCodeBuffer& operator=(JITCodeBuffer&&);
+            ~JITCodeBuffer();
+
+            bool allocate();
+            void clear();
+            bool setWritable(bool);
+        };
+
+        // A large buffer of one Emulator, from its MemoryArena or from new[]. 
+        // It can be moved but not copied (see MEMORY LAYOUT)
+        struct ArenaBuffer {
+            BYTE* memory = nullptr;
+            size_t size = 0;
+            MemoryArena* arena = nullptr;
+
+            ArenaBuffer() = default;
+            ArenaBuffer(const ArenaBuffer&) = delete;
+            ArenaBuffer& operator=(const ArenaBuffer&) = delete;
+            ArenaBuffer(ArenaBuffer&&);
+            ArenaBuffer& operator=(ArenaBuffer&&);
+            ~ArenaBuffer();
+
+            void allocate(size_t, MemoryArena*);
+            void moveTo(MemoryArena*);
+            void release();
+        };
+
+        // What snapshot copies, in the caller's buffer
+        struct SnapshotData {
+            uint64_t ROMHash;
+            uint64_t cycleCounter;
+            uint64_t lastSyncCycle;
+            uint64_t nextSyncCycle;
+            uint64_t runTargetCycle;
+            int32_t timerCounter;
+            int32_t timerUpdateConstant;
+            int32_t dividerCounter;
+            int32_t scanlineCycleCount;
+            int32_t framesToSkip;
+            uint32_t RAMSize;
+            FlagOperation flagOperation;
+            Register registers[6]; // AF BC DE HL SP PC
+            BYTE flagOperand1;
+            BYTE flagOperand2;
+            BYTE flagResult;
+            BYTE currentROMBank;
+            BYTE currentRAMBank;
+            bool enableRAM;
+            bool MBC1;
+            bool MBC2;
+            bool ROMBanking;
+            bool InterruptMasterEnabled;
+            bool isHalted;
+            BYTE joypadState;
+            BYTE VRAM[0x2000];
+            BYTE workRAM[0x2000];
+            BYTE highMem[0x200]; // 0xFE00-0xFFFF
+            BYTE RAM[0x8000]; // RAMSize bytes are used
+        };
+
+        class JITCompiler;
+
         // ATTRIBUTES
+        static const int maxCycles = cyclesPerFrame;
+
+        // Hot state, used by every instruction or sync. It comes first and 
+        // fits in the first few cache lines (see MEMORY LAYOUT)
 
         //8 bit registers, which are paired to behave like a 16 bit register
         //To accesss the first register, RegXX.high
         //To access the second register, RegXX.low
         //To access both, RegXX.regstr
-        Register regAF;
+        alignas(64) Register regAF;
         Register regBC;
         Register regDE;
         Register regHL;
@@ -76,42 +359,206 @@ class Emulator {
         Register programCounter;
         Register stackPointer;
 
-        // Memory items
-        BYTE internalMem[0x10000]; // internal memory from 0x0000 - 0xFFFF
-        BYTE cartridgeMem[0x200000]; // Catridge memory up to 2MB (2 * 2^20)
-        BYTE currentROMBank; // tells which ROM bank the game is using
-        BYTE RAMBanks[0x8000]; // all RAM banks
-        BYTE currentRAMBank; // tells which RAM bank the game is using
-        
-        bool enableRAM;
-        bool MBC1;
-        bool MBC2;
-        bool ROMBanking;
+        // Lazy flags
+        FlagOperation flagOperation;
+        BYTE flagOperand1;
+        BYTE flagOperand2;
+        BYTE flagResult;
+
+        // Scheduler
+        uint64_t cycleCounter; // cycles run since resetCPU
+        uint64_t lastSyncCycle; // hardware is up to date until here
+        uint64_t nextSyncCycle; // hardware has to be updated by here
+
+        // Batch execution
+        uint64_t runEndCycle; // where the current run ends
+        uint64_t runTargetCycle; // where the last run should have ended
+        StopCondition stopCondition;
+        WORD stopAddress;
+        BYTE stopValue;
 
         // Timer attributes
         int timerCounter;
         int timerUpdateConstant;
         int dividerCounter;
 
+        // Graphics
+        int scanlineCycleCount;
+        int framesToSkip; // before the next frame that is drawn
+        int frameSkip = 0;
+
         // Interrupt
         bool InterruptMasterEnabled; // Interrupt Master Enabledswitch
         bool isHalted;
 
+        // Banking
+        BYTE currentROMBank; // tells which ROM bank the game is using
+        BYTE currentRAMBank; // tells which RAM bank the game is using
+        bool enableRAM;
+        bool MBC1;
+        bool MBC2;
+        bool ROMBanking;
+
+        // Block cache
+        CodeBlock* currentBlock;
+        size_t blockIndex;
+        const BYTE* nextOperand; // operand bytes of the instruction being run from a block
+        WORD nextBlockAddress;
+        BYTE decodedOperand[2];
+        uint32_t blockCacheGeneration; // changes whenever cached blocks may be stale
+        uint32_t blockLookups;
+        bool idleLoopDetection = true;
+        bool JITEnabled = false;
+
+        // Memory items
+        // Host pointers to each 256 byte page, or nullptr where readMem and 
+        // writeMem have to check the address (see MEMORY MANAGEMENT)
+        const BYTE* readPages[0x100];
+        BYTE* writePages[0x100];
+
+        // One byte per 256 byte page, non-zero once the page is written
+        BYTE dirtyPages[0x100];
+        BYTE dirtyRAMPages[0x80];
+
+        BYTE internalMem[0x10000]; // internal memory from 0x0000 - 0xFFFF
+        shared_ptr<const ROMImage> ROM = ROMImage::empty(); // shared between Emulators
+        const BYTE* cartridgeMem = ROM->data(); // Catridge memory, at least 64KB
+        MemoryArena* arena = nullptr; // where RAMBanks, the framebuffers and tileBuffer come from
+        ArenaBuffer RAMBanks; // RAM banks, as many as the cartridge header asks for
+        bool RAMBanksChanged; // since saveGame last wrote them
+        static const size_t maxRAMSize = 0x8000; // the four banks MBC1 can switch between
+
         // Joypad
         BYTE joypadState;
 
         // Graphics
-        int scanlineCycleCount;
+        ArenaBuffer shadeBuffer; // holds shadePixels
+        ArenaBuffer displayBuffer; // holds displayPixels
+        ArenaBuffer packedBuffer; // holds packedPixels
+        static const size_t shadeBytes = 160 * 144;
+        static const size_t displayBytes = 160 * 144 * sizeof(uint32_t);
+        static const size_t packedBytes = 160 * 144 / 4;
+        bool ARGBOutput = true;
+        bool packedOutput = false;
+        ArenaBuffer tileBuffer; // holds tileRows
+        BYTE (*tileRows)[8]; // 384 tiles of 8 rows of colour numbers (see TILE CACHE)
+        static const size_t tileRowCount = 384 * 8;
+        array<uint32_t, 4> shades = greyPalette; // set by setPalette
+        BYTE paletteShades[3][4]; // the shade of each colour number in BGP, OBP0 and OBP1
+        BYTE lineSprites[144][10]; // OAM numbers of the sprites on each line, by priority
+        BYTE lineSpriteCounts[144];
+        bool spritesChanged; // OAM was written since selectSprites
+        bool spritesTall; // selected as 8x16
         void(*doRenderPtr)();
 
+        // Block cache
+        static const int maxBlockLength = 32;
+        unordered_map<uint32_t, CodeBlock> blockCache; // keyed on (ROM bank, address)
+        uint32_t codeBytes[0x4000 / 32]; // bytes in 0xC000-0xFFFF covered by cached blocks
+        vector<WORD> RAMBlocks[0x40]; // starts of the cached blocks in 0xC000-0xFFFF, by each page they cover
+
+        // Idle loops
+        uint64_t idleCyclesSkipped;
+        CodeBlock* idleLoopBlock; // block of the last loop iteration that was started, or nullptr
+        WORD idleLoopRegisters[5]; // AF BC DE HL SP when it started
+        uint64_t idleLoopCycle;
+        uint64_t idleLoopSyncCycle;
+        uint32_t idleLoopLookups;
+
+        // JIT
+        static const int JITThreshold = 16; // block entries before compiling
+        JITCodeBuffer JITCode;
+        uint32_t JITEntryGeneration;
+
         // FUNCTIONS
         int executeNextOpcode();
         int executeOpcode(BYTE);
         int executeCBOpcode();
 
+        BYTE fetchByte();
+        WORD fetchWord();
+
+        // Batch execution
+        RunResult runBatch(uint64_t);
+        bool run(uint64_t);
+        bool stopConditionMet() const;
+
+        // Scheduler
+        void syncHardware();
+        void catchUpHardware();
+        void scheduleNextSync();
+        int haltCycles();
+        bool LCDStatusChanging();
+
+        // Idle loops
+        void skipIdleLoop();
+
+        // Lazy flags
+        void setLazyFlags(FlagOperation, BYTE, BYTE, BYTE);
+        void materializeFlags();
+        BYTE currentFlags() const;
+        bool lazyCarry() const;
+        BYTE preservedFlags() const;
+
+        // Opcode dispatch tables, generated at compile time
+        static const array<OpcodeHandler, 256> opcodeTable;
+        static const array<OpcodeHandler, 256> CBOpcodeTable;
+
+        template <size_t... opcodes>
+        static constexpr array<OpcodeHandler, 256> makeOpcodeTable(index_sequence<opcodes...>);
+        template <size_t... opcodes>
+        static constexpr array<OpcodeHandler, 256> makeCBOpcodeTable(index_sequence<opcodes...>);
+
+        template <int opcode> int executeOp();
+        template <int opcode> int executeCBOp();
+        template <int op, int r> int executeALU();
+        template <int r> BYTE& reg8();
+        template <int rr> Register& reg16();
+        template <int rr> Register& reg16Stack();
+
+        // Block cache
+        CodeBlock* lookupBlock(WORD);
+        CodeBlock decodeBlock(WORD, WORD);
+        WORD codeRegionEnd(WORD) const;
+        bool isCodeByte(WORD) const;
+        void markCodeBytes(const CodeBlock&);
+        void invalidateBlocks(WORD);
+        void invalidateBlocks(WORD, WORD);
+        void clearBlockCache();
+
+        // JIT
+        bool runCompiledBlock();
+
         // Memory
         void writeMem(WORD, BYTE);
         BYTE readMem(WORD) const;
+        BYTE readUnmapped(WORD) const;
+        void writeUnmapped(WORD, BYTE);
+        void mapMemory();
+        void mapWorkRAMWrites();
+        bool pageHasCode(int) const;
+        void allocateRAMBanks(BYTE);
+        void markDirty(WORD);
+        void markAllDirty();
+
+        // I/O registers, dispatch tables generated at compile time
+        typedef BYTE (Emulator::*IOReadHandler)(WORD) const;
+        typedef void (Emulator::*IOWriteHandler)(WORD, BYTE);
+
+        static const array<IOReadHandler, 0x80> IOReadTable;
+        static const array<IOWriteHandler, 0x80> IOWriteTable;
+        static constexpr array<IOReadHandler, 0x80> makeIOReadTable();
+        static constexpr array<IOWriteHandler, 0x80> makeIOWriteTable();
+
+        BYTE readIORegister(WORD) const;
+        BYTE readJoypad(WORD) const;
+        void writeIORegister(WORD, BYTE);
+        void writeTimingRegister(WORD, BYTE);
+        void writeDivider(WORD, BYTE);
+        void writeTimerControl(WORD, BYTE);
+        void writeScanline(WORD, BYTE);
+        void writeDMA(WORD, BYTE);
+        void writePalette(WORD, BYTE);
         void handleBanking(WORD, BYTE);
         void doRAMBankEnable(WORD, BYTE);
         void doChangeLoROMBank(BYTE);
@@ -139,7 +586,14 @@ class Emulator {
         void drawScanLine();
         void renderTiles(BYTE);
         void renderSprites(BYTE);
+        void selectSprites(bool use8x16);
         COLOUR getColour(BYTE, WORD) const;
+        void updatePalettes();
+        void allocateFramebuffers();
+        void outputLine(int);
+
+        void decodeTileRow(int);
+        void decodeAllTiles();
 
         void doDMATransfer(BYTE);
 
@@ -267,3 +721,93 @@ class Emulator {
         ////////// end of opcodes //////////
 
 };
+
+// The last few minutes of save states, kept as compressed deltas so the 
+// front end can step back through them (Rewind.cpp)
+class RewindBuffer {
+
+    public:
+        explicit RewindBuffer(size_t maxBytes = 0x400000);
+
+        void capture(Emulator&); // after every frame
+        bool stepBack(Emulator&); // to the snapshot captured before the last one
+        void clear();
+
+        // Metrics
+        size_t frames() const; // states there are to step back to
+        size_t memoryUsed() const; // bytes held, deltas and the latest state
+        double captureMicroseconds() const; // average cost of capture
+
+    private:
+        void encodeDelta(const BYTE*, const BYTE*, vector<BYTE>&) const;
+        void applyDelta(const vector<BYTE>&, BYTE*) const;
+
+        size_t maxBytes;
+        uint64_t ROMHash; // of the snapshots held
+        vector<uint64_t> latest; // the last captured snapshot, whole
+        vector<uint64_t> captured; // reused by capture
+        deque<vector<BYTE>> deltas; // back() takes latest to the state before it
+        size_t deltaBytes;
+        uint64_t captureCount;
+        double captureSeconds;
+
+};
+
+// Inputs recorded frame by frame, with a hash of every frame drawn so that a 
+// playback can be checked against the recording (Movie.cpp)
+class Movie {
+
+    public:
+        static const int defaultKeyframeInterval = 1800; // frames
+
+        // Recording, one frame is one update()
+        void startRecording(Emulator&, bool fromPowerOn, int keyframeInterval = defaultKeyframeInterval);
+        void recordInput(int key, bool pressed); // before the frame it happens in
+        void recordFrame(Emulator&); // after every frame
+        void stopRecording();
+        bool isRecording() const;
+        bool save(const string&) const;
+
+        // Playback, into an Emulator that loaded the same ROM
+        bool load(const string&);
+        bool startPlayback(Emulator&);
+        bool playFrame(Emulator&); // false once the movie is over
+        bool seek(Emulator&, int frame);
+        int getFrame() const;
+        int getFrameCount() const;
+        int getFirstMismatch() const; // first frame that drew something else, or -1
+
+        static uint64_t hashFrame(const BYTE*); // shadePixels
+
+    private:
+        struct Input {
+            uint32_t frame;
+            BYTE key;
+            bool pressed;
+        };
+
+        // Sprites behind the background and a disabled background show
+        // what the last frame drew, so the picture goes with the state
+        struct Keyframe {
+            uint32_t frame; // frames run before it
+            vector<BYTE> state;
+            vector<BYTE> pixels; // shadePixels
+        };
+
+        static void captureKeyframe(Emulator&, Keyframe&);
+        bool loadKeyframe(Emulator&, const Keyframe&);
+
+        bool recording = false;
+        bool fromPowerOn = true;
+        uint64_t ROMHash = 0;
+        int keyframeInterval = defaultKeyframeInterval;
+        Keyframe start; // empty from power on
+        vector<Input> inputs; // in frame order
+        vector<uint64_t> frameHashes;
+        vector<Keyframe> keyframes;
+
+        int frame = 0;
+        size_t nextInput = 0;
+        int firstMismatch = -1;
+
+};
@@ -0,0 +1,143 @@
+#include "Emulator.hpp"
+
+#include <cstdio>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <unistd.h>
+#endif
+
+/*
+********************************************************************************
+FILE WRITER
+********************************************************************************
+*/
+
+/*
+
+Save states and battery RAM are written on a background thread, so saving 
+doesn't hold up the frame it happens in. The emulation thread only copies the
+state into a buffer and queues it, the I/O thread writes it.
+
+Every file is written to <path>.tmp first, flushed to disk and then renamed 
+over <path>. A crash or a full disk leaves the old file, never half of the new
+one.
+
+Writes happen in the order they were queued. flush waits for all of them, 
+loadState calls it so that a state saved a moment ago can be loaded. The 
+queue is drained when the program exits. A write that fails leaves a message
+on stdout, and the callback given with it, if any, is called with false. It 
+runs on the writer thread.
+
+The WebAssembly build has no threads, its files are in memory anyway. It
+writes straight away.
+
+*/
+
+FileWriter& FileWriter::shared() {
+    static FileWriter writer;
+    return writer;
+}
+
+FileWriter::FileWriter() : stopping(false), busy(false) {
+#ifndef __EMSCRIPTEN__
+    worker = thread(&FileWriter::run, this);
+#endif
+}
+
+FileWriter::~FileWriter() {
+#ifndef __EMSCRIPTEN__
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    queued.notify_all();
+    worker.join();
+#endif
+}
+
+void FileWriter::write(const string& path, vector<BYTE> contents, function<void(bool)> written) {
+
+#ifdef __EMSCRIPTEN__
+    bool succeeded = writeFile(path, contents);
+    if (written) {
+        written(succeeded);
+    }
+#else
+    {
+        lock_guard<mutex> guard(lock);
+        pending.push_back({path, move(contents), move(written)});
+    }
+    queued.notify_all();
+#endif
+
+}
+
+void FileWriter::flush() {
+#ifndef __EMSCRIPTEN__
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [this]() { return pending.empty() && !busy; });
+#endif
+}
+
+void FileWriter::run() {
+
+    unique_lock<mutex> guard(lock);
+
+    while (true) {
+        queued.wait(guard, [this]() { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            return;
+        }
+
+        PendingFile file = move(pending.front());
+        pending.pop_front();
+        busy = true;
+
+        guard.unlock();
+        bool succeeded = writeFile(file.path, file.contents);
+        if (file.written) {
+            file.written(succeeded);
+        }
+        guard.lock();
+
+        busy = false;
+        done.notify_all();
+    }
+
+}
+
+bool FileWriter::writeFile(const string& path, const vector<BYTE>& contents) {
+
+    string temporaryPath = path + ".tmp";
+
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) {
+        cout << "Could not write " << temporaryPath << endl;
+        return false;
+    }
+
+    bool written = (fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+    written = (fflush(file) == 0) && written;
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+    written = (fsync(fileno(file)) == 0) && written;
+#endif
+    written = (fclose(file) == 0) && written;
+
+    if (!written) {
+        cout << "Could not write " << temporaryPath << endl;
+        remove(temporaryPath.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    // rename doesn't replace files on Windows
+    remove(path.c_str());
+#endif
+    if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        cout << "Could not replace " << path << endl;
+        return false;
+    }
+
+    return true;
+
+}
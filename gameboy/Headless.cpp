@@ -0,0 +1,341 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "Emulator.hpp"
+
+using namespace std;
+
+/*
+
+gbheadless: runs a ROM without SDL or a window, for CI and benchmarking.
+Build with the command in headlessFlags.txt.
+
+Usage: gbheadless <rom> <frames> [input script] [frame dump]
+       gbheadless <rom> --play <movie>
+
+The input script has one event per line, "<frame> <press|release> <button>",
+where button is one of right, left, up, down, a, b, select, start. The event
+happens before that frame is run. Lines starting with # are ignored. Pass -
+to run without a script.
+
+If a frame dump is given, the last frame is written to it as a PPM image.
+--no-argb draws shades only, without the ARGB8888 framebuffer, and converts 
+just the frame dump.
+
+The options --jit and --no-idle-loops turn the JIT on and idle loop detection
+off. --frame-skip <n> draws only one frame in every n + 1, the frame dump is 
+the last one drawn. --verify-snapshots runs every frame twice, the second time
+from a snapshot taken before it, and checks that both runs end in the same 
+state and draw the same frame, the exit status is 1 if any differ. 
+--compare-jit runs the ROM with the JIT and, next to it, with the interpreter
+alone, and checks the same after every frame.
+
+--record <movie> records the run as a movie from power on, with the inputs of
+the script. --play <movie> plays one back as fast as it goes and checks every
+frame against the hashes in it, the exit status is 1 if any differ. Neither
+works with --frame-skip.
+
+*/
+
+struct InputEvent {
+    int frame;
+    bool pressed;
+    int key;
+};
+
+// Same key numbers as processInput in Main.cpp
+int buttonKey(const string& name) {
+    const char* names[] = {"right", "left", "up", "down", "a", "b", "select", "start"};
+    for (int key = 0; key < 8; key++) {
+        if (name == names[key]) {
+            return key;
+        }
+    }
+    return -1;
+}
+
+bool readInputScript(const string& path, vector<InputEvent>& events) {
+
+    ifstream file(path);
+    if (!file.good()) {
+        cout << "Could not open input script " << path << endl;
+        return false;
+    }
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        istringstream fields(line);
+        InputEvent event;
+        string action, button;
+        fields >> event.frame >> action >> button;
+        event.key = buttonKey(button);
+        event.pressed = (action == "press");
+
+        if (fields.fail() || event.key == -1 || (action != "press" && action != "release")) {
+            cout << path << ":" << lineNumber << ": expected <frame> <press|release> <button>" << endl;
+            return false;
+        }
+        events.push_back(event);
+    }
+
+    // Events are applied in frame order
+    stable_sort(events.begin(), events.end(), [](const InputEvent& a, const InputEvent& b) {
+        return a.frame < b.frame;
+    });
+    return true;
+
+}
+
+bool writeFrame(const string& path, Emulator* emulator) {
+
+    vector<uint32_t> pixels(160 * 144);
+    emulator->shadesToARGB(emulator->shadePixels, pixels.data(), pixels.size());
+
+    ofstream file(path, ios::binary);
+    if (!file.good()) {
+        cout << "Could not write frame dump " << path << endl;
+        return false;
+    }
+
+    file << "P6\n160 144\n255\n";
+    for (int i = 0; i < 160 * 144; i++) {
+        char rgb[3] = {
+            (char)((pixels[i] >> 16) & 0xFF),
+            (char)((pixels[i] >> 8) & 0xFF),
+            (char)(pixels[i] & 0xFF)
+        };
+        file.write(rgb, 3);
+    }
+    return true;
+
+}
+
+int playMovie(Emulator* emulator, const string& moviePath) {
+
+    Movie movie;
+    if (!movie.load(moviePath) || !movie.startPlayback(*emulator)) {
+        return 1;
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+    while (movie.playFrame(*emulator)) {}
+    double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+    int frames = movie.getFrameCount();
+    printf("%s: %d frames in %.3fs, %.1f frames/s\n", moviePath.c_str(), frames, seconds, frames / seconds);
+
+    if (movie.getFirstMismatch() != -1) {
+        printf("Frame %d differs from the recording\n", movie.getFirstMismatch());
+        return 1;
+    }
+    printf("All frames match the recording\n");
+    return 0;
+
+}
+
+int main(int argc, char** argv) {
+
+    vector<string> arguments;
+    bool JIT = false;
+    bool idleLoops = true;
+    bool verifySnapshots = false;
+    bool compareJIT = false;
+    int frameSkip = 0;
+    bool ARGB = true;
+    string recordPath, playPath;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if (argument == "--jit") JIT = true;
+        else if (argument == "--no-idle-loops") idleLoops = false;
+        else if (argument == "--verify-snapshots") verifySnapshots = true;
+        else if (argument == "--compare-jit") compareJIT = JIT = true;
+        else if (argument == "--frame-skip" && i + 1 < argc) frameSkip = atoi(argv[++i]);
+        else if (argument == "--no-argb") ARGB = false;
+        else if (argument == "--record" && i + 1 < argc) recordPath = argv[++i];
+        else if (argument == "--play" && i + 1 < argc) playPath = argv[++i];
+        else arguments.push_back(argument);
+    }
+
+    bool playing = !playPath.empty();
+    if ((!playing && (arguments.size() < 2 || arguments.size() > 4)) || (playing && arguments.size() != 1)) {
+        cout << "Usage: gbheadless <rom> <frames> [input script|-] [frame dump] [--jit] [--no-idle-loops] [--frame-skip <n>] [--no-argb] [--verify-snapshots] [--compare-jit] [--record <movie>]" << endl;
+        cout << "       gbheadless <rom> --play <movie> [--jit] [--no-idle-loops]" << endl;
+        return 1;
+    }
+
+    // Movies hash every frame, skipped ones would be hashed as the last 
+    // frame drawn left them
+    if ((!recordPath.empty() || playing) && frameSkip != 0) {
+        cout << "--record and --play can't be used with --frame-skip" << endl;
+        return 1;
+    }
+
+    if (verifySnapshots && compareJIT) {
+        cout << "--verify-snapshots and --compare-jit can't be used together" << endl;
+        return 1;
+    }
+
+    string romPath = arguments[0];
+    int frames = playing ? 0 : atoi(arguments[1].c_str());
+
+    vector<InputEvent> events;
+    if (arguments.size() > 2 && arguments[2] != "-" && !readInputScript(arguments[2], events)) {
+        return 1;
+    }
+
+    if (!ifstream(romPath).good()) {
+        cout << "Could not open ROM " << romPath << endl;
+        return 1;
+    }
+
+    // The Emulator is too big for the stack
+    Emulator* emulator = new Emulator();
+    emulator->resetCPU();
+    emulator->loadGame(romPath);
+    emulator->setJITEnabled(JIT);
+    emulator->setIdleLoopDetection(idleLoops);
+    emulator->setFrameSkip(frameSkip);
+    emulator->setARGBOutputEnabled(ARGB);
+
+    // The same without the JIT, for --compare-jit
+    Emulator* reference = nullptr;
+    if (compareJIT) {
+        reference = new Emulator();
+        reference->resetCPU();
+        reference->loadGame(romPath);
+        reference->setIdleLoopDetection(idleLoops);
+        reference->setFrameSkip(frameSkip);
+        reference->setARGBOutputEnabled(ARGB);
+    }
+
+    if (playing) {
+        int status = playMovie(emulator, playPath);
+        delete emulator;
+        return status;
+    }
+
+    // A movie counts frames in update() calls
+    Movie movie;
+    bool recording = !recordPath.empty();
+    if (recording) {
+        movie.startRecording(*emulator, true);
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+    uint64_t cycles = 0;
+
+    // Snapshots before and after a frame, and after running it again (or
+    // running it with the interpreter, for --compare-jit)
+    vector<uint64_t> snapshots(3 * Emulator::snapshotSize / sizeof(uint64_t));
+    void* before = &snapshots[0];
+    void* after = &snapshots[Emulator::snapshotSize / sizeof(uint64_t)];
+    void* again = &snapshots[2 * Emulator::snapshotSize / sizeof(uint64_t)];
+    vector<BYTE> frame(160 * 144);
+    int mismatches = 0;
+    double snapshotSeconds = 0;
+
+    // Without input, all frames run in one go
+    if (events.empty() && !verifySnapshots && !compareJIT && !recording) {
+        cycles = emulator->runFrames(frames).cycles;
+    } else {
+        size_t next = 0;
+        for (int frameNumber = 0; frameNumber < frames; frameNumber++) {
+            for (; next < events.size() && events[next].frame <= frameNumber; next++) {
+                for (Emulator* target : {emulator, reference}) {
+                    if (target == nullptr) {
+                        continue;
+                    }
+                    if (events[next].pressed) {
+                        target->buttonPressed(events[next].key);
+                    } else {
+                        target->buttonReleased(events[next].key);
+                    }
+                }
+                movie.recordInput(events[next].key, events[next].pressed);
+            }
+
+            if (recording) {
+                emulator->update();
+                movie.recordFrame(*emulator);
+                cycles += Emulator::cyclesPerFrame;
+                continue;
+            }
+
+            if (compareJIT) {
+                cycles += emulator->runFrames(1).cycles;
+                reference->runFrames(1);
+                emulator->snapshot(after);
+                reference->snapshot(again);
+
+                if (memcmp(after, again, Emulator::snapshotSize) != 0
+                        || !equal(emulator->shadePixels, emulator->shadePixels + frame.size(), reference->shadePixels)) {
+                    cout << "Frame " << frameNumber << " differs from the interpreter" << endl;
+                    mismatches++;
+                }
+                continue;
+            }
+
+            if (!verifySnapshots) {
+                cycles += emulator->runFrames(1).cycles;
+                continue;
+            }
+
+            auto snapshotStart = chrono::high_resolution_clock::now();
+            emulator->snapshot(before);
+            snapshotSeconds += chrono::duration<double>(chrono::high_resolution_clock::now() - snapshotStart).count();
+
+            cycles += emulator->runFrames(1).cycles;
+            emulator->snapshot(after);
+            copy_n(emulator->shadePixels, frame.size(), frame.begin());
+
+            snapshotStart = chrono::high_resolution_clock::now();
+            emulator->restore(before);
+            snapshotSeconds += chrono::duration<double>(chrono::high_resolution_clock::now() - snapshotStart).count();
+            emulator->runFrames(1);
+            emulator->snapshot(again);
+
+            if (memcmp(after, again, Emulator::snapshotSize) != 0
+                    || !equal(frame.begin(), frame.end(), emulator->shadePixels)) {
+                cout << "Frame " << frameNumber << " differs when run from a snapshot" << endl;
+                mismatches++;
+            }
+        }
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    double seconds = chrono::duration<double>(end - start).count();
+
+    printf("%s: %d frames in %.3fs, %.1f frames/s, %.2f emulated MHz\n",
+        romPath.c_str(), frames, seconds, frames / seconds, cycles / seconds / 1e6);
+    printf("%zu bytes per Emulator\n", emulator->memoryFootprint());
+    if (verifySnapshots) {
+        printf("%d of %d frames differ from a snapshot, %.2fus per snapshot and restore\n",
+            mismatches, frames, snapshotSeconds / frames * 1e6);
+    }
+    if (compareJIT) {
+        printf("%d of %d frames differ from the interpreter\n", mismatches, frames);
+    }
+
+    if (arguments.size() > 3 && !writeFrame(arguments[3], emulator)) {
+        return 1;
+    }
+
+    if (recording && !movie.save(recordPath)) {
+        return 1;
+    }
+
+    delete emulator;
+    delete reference;
+    return (mismatches > 0) ? 1 : 0;
+
+}
@@ -0,0 +1,1514 @@
+#include "Emulator.hpp"
+
+#ifdef JIT_X64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+********************************************************************************
+JIT
+********************************************************************************
+*/
+
+/*
+
+Blocks from the block cache that are entered often enough (JITThreshold) are
+translated into x86-64 code. The interpreter stays the reference. These 
+instructions are translated:
+
+- NOP, LD r, R, LD r, n, LD r, (HL), LD (HL), r, LD (HL), n
+- LD A, (BC)/(DE)/(HL+)/(HL-)/(nn)/(FF00+n) and the matching stores
+- LD rr, nn, INC rr, DEC rr (not SP)
+- INC r, DEC r, INC (HL), DEC (HL), CPL, SCF, CCF, DAA
+- ALU A, r/n/(HL)
+- RLCA, RRCA, RLA, RRA and the CB instructions on registers
+- JR, JR f, JP nn, JP f, nn
+
+Any other instruction (mostly the stack, calls and returns, and the CB 
+instructions on (HL)) calls its handler through interpret(), with the 
+registers stored to the Emulator around the call. A block stops before HALT
+or STOP, which are left to run().
+
+While a block runs, A F B C D E H L live in host registers:
+AF - r12, BC - r13, DE - r14, HL - r15
+rbx holds the Emulator and rbp the cycles left before the next sync or the
+end of the run (whichever comes first). These are callee saved, so they 
+survive the calls back into the emulator.
+
+Cycles are counted while compiling. After each instruction the code compares
+rbp with the cycles counted since it was loaded. Only when that reaches it, 
+the code calls tick(), which adds them to cycleCounter and syncs the way 
+run() does, and goes on unless an interrupt was serviced or the run is over.
+A branch back to the start of the block adds them and loops in native code, 
+any other branch leaves it. So the timing is exactly that of the interpreter
+without a call per instruction.
+
+Reads and writes go through readPages and writePages like readMem and 
+writeMem do. Writes to HRAM store to internalMem unless the byte holds 
+cached code. Only unmapped addresses (I/O, OAM, banking, cached code) call 
+readMem/writeMem, and after such a write the block returns to run() if an
+interrupt was serviced, the run is over, or the write invalidated cached 
+code or switched ROM bank.
+
+Idle loops (see IDLE LOOPS) are compiled up to their branch back and return
+to run() after each pass, so that skipIdleLoop still sees them.
+
+Flags are taken from the host: LAHF copies ZF, AF (the host's half carry) and
+CF into AH, and a 256 byte table at the start of the code buffer maps that to
+the Z, H and C bits of F. The rotates take C from CF and Z from the result,
+DAA looks the new A and F up in a table made from DAA().
+
+gbheadless --compare-jit runs the interpreter next to the JIT and checks that
+every frame ends in the same state. Frames per second, best of 5 runs of 3000
+frames on x86-64:
+                        interpreter     JIT
+    CPU bound test ROM  2860            5620
+    random code ROM     3640            6650
+    game ROM            1185            1465
+Most of the time of the game goes to the hardware (syncHardware), which runs
+the same with and without the JIT.
+
+*/
+
+#ifdef JIT_X64
+
+// Mapped when the JIT is turned on. Games compile to well under this, once
+// it is full all blocks are thrown away and compiled again as needed
+static const size_t JITCodeSize = 1024 * 1024;
+static const size_t flagTableSize = 256;
+
+// Upper bounds on the code emitted for one instruction, and for the prologue
+// and epilogue of a block
+static const size_t maxInstructionSize = 256;
+static const size_t maxBlockOverhead = 256;
+
+// Host registers
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Host register holding AH (only without a REX prefix)
+static const int AH = 4;
+
+// Condition codes
+enum {
+    COND_EQUAL = 0x4,
+    COND_NOT_EQUAL = 0x5,
+    COND_ABOVE = 0x7,
+    COND_LESS_OR_EQUAL = 0xE,
+    COND_ALWAYS = -1
+};
+
+// 32 bit ALU instructions, register to register and with an immediate
+enum {
+    ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29,
+    ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85
+};
+enum {
+    IMM_ADD = 0, IMM_OR = 1, IMM_AND = 4, IMM_SUB = 5, IMM_XOR = 6, IMM_CMP = 7
+};
+enum {
+    SHIFT_LEFT = 4, SHIFT_RIGHT = 5
+};
+
+// AF after DAA, by A and the Z N H C bits of F (AF >> 4), as DAA() computes
+// it. The low bits of F are left to the caller
+static constexpr array<WORD, 0x1000> makeDAATable() {
+
+    array<WORD, 0x1000> table {};
+    for (int index = 0; index < 0x1000; index++) {
+        int result = index >> 4;
+        int flags = (index & 0xF) << 4;
+
+        if (!(flags & (1 << FLAG_SUB))) {
+            if ((flags & (1 << FLAG_HALFCARRY)) || ((result & 0xF) > 9)) {
+                result += 0x06;
+            }
+            if ((flags & (1 << FLAG_CARRY)) || (result > 0x9F)) {
+                result += 0x60;
+            }
+        } else {
+            if (flags & (1 << FLAG_HALFCARRY)) {
+                result = (result - 0x06) & 0xFF;
+            }
+            if (flags & (1 << FLAG_CARRY)) {
+                result -= 0x60;
+            }
+        }
+
+        flags &= ~(1 << FLAG_HALFCARRY);
+        if ((result & 0x100) == 0x100) {
+            flags |= (1 << FLAG_CARRY);
+        }
+        result &= 0xFF;
+        flags = (result == 0) ? (flags | (1 << FLAG_ZERO)) : (flags & ~(1 << FLAG_ZERO));
+
+        table[index] = WORD((result << 8) | flags);
+    }
+    return table;
+
+}
+
+static constexpr array<WORD, 0x1000> DAATable = makeDAATable();
+
+class Emulator::JITCompiler {
+
+    public:
+        JITCompiler(Emulator& emulator, BYTE* code)
+            : emulator(emulator), start(code), code(code) {}
+
+        const BYTE* compile(const CodeBlock&);
+        size_t size() const { return code - start; }
+
+        // Called from the emitted code
+        static BYTE readMem(Emulator*, WORD);
+        static void writeMem(Emulator*, WORD, BYTE);
+        static int tick(Emulator*, int, WORD);
+        static int interpret(Emulator*, const DecodedInstruction*, WORD, WORD);
+        static int finishInstruction(Emulator*, int);
+        static void syncIfDue(Emulator*);
+
+    private:
+        Emulator& emulator;
+        BYTE* start;
+        BYTE* code;
+
+        const BYTE* loopStart;
+        WORD blockStart;
+        bool loops; // a branch to the start loops in native code
+        vector<BYTE*> exits; // jumps to the epilogue
+        vector<BYTE*> syncs; // jumps to the epilogue that sync first if it is due
+        int pending; // cycles not added to cycleCounter yet
+
+        // Syncing because the cycles ran out after an instruction, the block 
+        // goes on at resume unless it has to stop
+        struct SyncExit {
+            BYTE* jump;
+            int pending;
+            WORD nextPC;
+            const BYTE* resume;
+        };
+        vector<SyncExit> syncExits;
+
+        bool compileInstruction(const DecodedInstruction&, WORD);
+        bool compileCBInstruction(BYTE, WORD);
+        void interpretInstruction(const DecodedInstruction&, WORD);
+
+        // SM83 level helpers
+        int pairOf(int) const;
+        void loadRegisters();
+        void storeRegisters();
+        void loadR8(int, int);
+        void storeR8(int);
+        void storeFlags();
+        void hostFlags();
+        void readHL();
+        void readAddress(WORD);
+        void readMemory();
+        void writeMemory(int, WORD);
+        void writeAddress(WORD, int, WORD);
+        void endWrite(int, WORD, BYTE*);
+        void doALU(int);
+        void incDec(bool);
+        void rotate(int, int, bool);
+        void zeroFlag();
+        void loadCyclesLeft();
+        void endInstruction(int, WORD);
+        void addCycles(int32_t);
+        void exitTo(WORD, int);
+        void branchTo(WORD, int);
+        int32_t offsetOf(const void*) const;
+
+        // x86-64 encoding
+        void byte(int);
+        void dword(uint32_t);
+        void rex(bool, int, int, int = 0);
+        void modrm(int, int, int);
+        void memRBX(int, int32_t);
+        void mov(int, int);
+        void mov64(int, int);
+        void movImm(int, uint32_t);
+        void movImm64(int, uint64_t);
+        void alu(int, int, int);
+        void alu64(int, int, int);
+        void aluImm(int, int, uint32_t);
+        void aluImm64(int, int, uint32_t);
+        void aluMem64(int, int, int32_t);
+        void aluMemImm64(int, int32_t, uint32_t);
+        void cmovMem64(int, int, int32_t);
+        void testImm(int, uint32_t);
+        void shiftImm(int, int, int);
+        void alu8(int, int, int);
+        void movzx8(int, int);
+        void load64(int, int32_t);
+        void loadPage(int, int, int32_t);
+        void loadWord(int, int32_t);
+        void storeWord(int32_t, int);
+        void storeWordImm(int32_t, WORD);
+        void loadByte(int, int32_t);
+        void loadByteBase(int, int, int);
+        void storeByte(int32_t, int);
+        void storeByteImm(int32_t, BYTE);
+        void storeByteImmIndexed(int, int32_t, BYTE);
+        void storeByteBase(int, int, int);
+        void testMemImm(int32_t, uint32_t);
+        void call(const void*);
+        BYTE* jump(int);
+        void jumpTo(const BYTE*, int);
+        void bind(BYTE*);
+
+};
+
+/*
+********************************************************************************
+CODE BUFFER
+********************************************************************************
+*/
+
+Emulator::JITCodeBuffer::JITCodeBuffer(JITCodeBuffer&& other)
+    : memory(other.memory), used(other.used) {
+    other.memory = nullptr;
+    other.used = 0;
+}
+
+Emulator::JITCodeBuffer& Emulator::JITCodeBuffer::operator=(JITCodeBuffer&& other) {
+    if (this != &other) {
+        if (memory != nullptr) munmap(memory, JITCodeSize);
+        memory = other.memory;
+        used = other.used;
+        other.memory = nullptr;
+        other.used = 0;
+    }
+    return *this;
+}
+
+Emulator::JITCodeBuffer::~JITCodeBuffer() {
+    if (memory != nullptr) munmap(memory, JITCodeSize);
+}
+
+bool Emulator::JITCodeBuffer::allocate() {
+
+    if (memory != nullptr) {
+        return true;
+    }
+
+    void* mapped = mmap(nullptr, JITCodeSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    memory = static_cast<BYTE*>(mapped);
+
+    // LAHF puts SF ZF - AF - PF - CF in AH, map it to Z - H C - - - - in F
+    for (int ah = 0; ah < 256; ah++) {
+        BYTE flags = 0;
+        if (ah & 0x40) flags |= (1 << FLAG_ZERO);
+        if (ah & 0x10) flags |= (1 << FLAG_HALFCARRY);
+        if (ah & 0x01) flags |= (1 << FLAG_CARRY);
+        memory[ah] = flags;
+    }
+
+    used = flagTableSize;
+    if (!setWritable(false)) {
+        munmap(memory, JITCodeSize);
+        memory = nullptr;
+        return false;
+    }
+    return true;
+
+}
+
+void Emulator::JITCodeBuffer::clear() {
+    if (memory != nullptr) used = flagTableSize;
+}
+
+// The buffer is never writable and executable at once. Code is emitted from
+// used on, so only the pages from there to the end change
+bool Emulator::JITCodeBuffer::setWritable(bool writable) {
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t from = (writable ? used : 0) & ~(pageSize - 1);
+    int protection = writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC);
+
+    return mprotect(memory + from, JITCodeSize - from, protection) == 0;
+
+}
+
+/*
+********************************************************************************
+RUNNING COMPILED BLOCKS
+********************************************************************************
+*/
+
+void Emulator::setJITEnabled(bool enabled) {
+    if (enabled && !JITCode.allocate()) {
+        cout << "JIT: could not map executable memory, using the interpreter" << endl;
+        enabled = false;
+    }
+    JITEnabled = enabled;
+}
+
+bool Emulator::isJITEnabled() const {
+    return JITEnabled;
+}
+
+// Runs the compiled block at PC, where the interpreter would start a new 
+// block. Returns false if the interpreter has to execute the next instruction
+// instead
+bool Emulator::runCompiledBlock() {
+
+    currentBlock = lookupBlock(programCounter.regstr);
+    blockIndex = 0;
+    nextBlockAddress = programCounter.regstr;
+
+    if (currentBlock == nullptr) {
+        return false;
+    }
+
+    if (currentBlock->nativeCode == nullptr) {
+        if (currentBlock->executionCount == JITThreshold) {
+            return false; // could not be compiled
+        }
+        if (++currentBlock->executionCount < JITThreshold) {
+            return false;
+        }
+
+        // Start over once the buffer is full
+        if (JITCode.used + maxInstructionSize * maxBlockLength + maxBlockOverhead > JITCodeSize) {
+            for (auto& cached : blockCache) {
+                cached.second.nativeCode = nullptr;
+                cached.second.executionCount = 0;
+            }
+            JITCode.clear();
+        }
+
+        currentBlock->executionCount = JITThreshold;
+        if (!JITCode.setWritable(true)) {
+            return false;
+        }
+        JITCompiler compiler(*this, JITCode.memory + JITCode.used);
+        currentBlock->nativeCode = compiler.compile(*currentBlock);
+        JITCode.used += compiler.size();
+        if (!JITCode.setWritable(false)) {
+            currentBlock->nativeCode = nullptr;
+        }
+        if (currentBlock->nativeCode == nullptr) {
+            return false;
+        }
+    }
+
+    typedef void (*NativeBlock)(Emulator*);
+    NativeBlock native = reinterpret_cast<NativeBlock>(
+        const_cast<BYTE*>(currentBlock->nativeCode));
+
+    // The emitted code works on F directly
+    materializeFlags();
+
+    JITEntryGeneration = blockCacheGeneration;
+    native(this);
+
+    // Back at the start of an idle loop, as if the interpreter had run it 
+    // up to the branch, so that skipIdleLoop sees the pass. currentBlock is 
+    // gone if the block threw away cached code or switched ROM bank
+    if ((currentBlock != nullptr) && (currentBlock->idleLoopLength > 0) 
+            && (programCounter.regstr == currentBlock->start)) {
+        blockIndex = currentBlock->idleLoopLength;
+        nextBlockAddress = currentBlock->end;
+        return true;
+    }
+
+    // PC is wherever the block stopped
+    currentBlock = nullptr;
+    return true;
+
+}
+
+BYTE Emulator::JITCompiler::readMem(Emulator* emulator, WORD address) {
+    return emulator->readMem(address);
+}
+
+void Emulator::JITCompiler::writeMem(Emulator* emulator, WORD address, BYTE data) {
+    emulator->writeMem(address, data);
+}
+
+// Called after a write that writeMem had to handle, which may have changed 
+// the timing, invalidated cached code or switched ROM bank. Returns non zero 
+// if the block has to stop (see finishInstruction)
+int Emulator::JITCompiler::tick(Emulator* emulator, int cycles, WORD nextPC) {
+    emulator->programCounter.regstr = nextPC;
+    return finishInstruction(emulator, cycles);
+}
+
+// Runs an instruction that is not translated the way executeNextOpcode does,
+// with the registers in the Emulator. Returns non zero if the block has to 
+// stop, which it also does after a jump. The handler may write over the 
+// block and free the instruction, so nextPC comes from the compiler
+int Emulator::JITCompiler::interpret(Emulator* emulator, const DecodedInstruction* instruction, WORD address, WORD nextPC) {
+
+    emulator->decodedOperand[0] = instruction->operand[0];
+    emulator->decodedOperand[1] = instruction->operand[1];
+    emulator->nextOperand = &emulator->decodedOperand[0];
+    emulator->programCounter.regstr = address + 1;
+
+    int cycles = (emulator->*instruction->handler)();
+    emulator->nextOperand = nullptr;
+    emulator->materializeFlags();
+
+    return finishInstruction(emulator, cycles) || (emulator->programCounter.regstr != nextPC);
+
+}
+
+// The same as one pass through the loop in update() after the instruction, 
+// returns non zero if the block has to stop: when an interrupt was serviced,
+// when the run is over, or when cached code was invalidated or the ROM bank
+// switched
+int Emulator::JITCompiler::finishInstruction(Emulator* emulator, int cycles) {
+
+    emulator->cycleCounter += cycles;
+
+    if (emulator->cycleCounter >= emulator->nextSyncCycle) {
+        bool wasEnabled = emulator->InterruptMasterEnabled;
+        emulator->syncHardware();
+        if (wasEnabled && !emulator->InterruptMasterEnabled) {
+            return 1;
+        }
+    }
+
+    return (emulator->cycleCounter >= emulator->runEndCycle)
+        || (emulator->blockCacheGeneration != emulator->JITEntryGeneration);
+
+}
+
+// Called when a block leaves after an instruction that may have reached the
+// next sync
+void Emulator::JITCompiler::syncIfDue(Emulator* emulator) {
+    if (emulator->cycleCounter >= emulator->nextSyncCycle) {
+        emulator->syncHardware();
+    }
+}
+
+/*
+********************************************************************************
+BLOCK TRANSLATION
+********************************************************************************
+*/
+
+const BYTE* Emulator::JITCompiler::compile(const CodeBlock& block) {
+
+    blockStart = block.start;
+    pending = 0;
+
+    // An idle loop goes back to run() after each pass, so that skipIdleLoop
+    // sees it. Only the loop itself is compiled (see IDLE LOOPS)
+    loops = !(emulator.idleLoopDetection && (block.idleLoopLength > 0));
+    size_t count = loops ? block.instructions.size() : block.idleLoopLength;
+
+    // Prologue, 6 pushes and 8 bytes keep the stack 16 byte aligned for calls
+    byte(0x53); // push rbx
+    byte(0x55); // push rbp
+    byte(0x41); byte(0x54); // push r12
+    byte(0x41); byte(0x55); // push r13
+    byte(0x41); byte(0x56); // push r14
+    byte(0x41); byte(0x57); // push r15
+    aluImm64(IMM_SUB, RSP, 8);
+    mov64(RBX, RDI);
+    loadRegisters();
+    loadCyclesLeft();
+    loopStart = code;
+
+    // HALT and STOP are left to run(), any other instruction that is not 
+    // translated runs through its handler
+    size_t translated = 0;
+    WORD address = block.start;
+    for (; translated < count; translated++) {
+        const DecodedInstruction& instruction = block.instructions[translated];
+        if ((instruction.opcode == 0x76) || (instruction.opcode == 0x10)) {
+            break;
+        }
+        if (!compileInstruction(instruction, address)) {
+            interpretInstruction(instruction, address);
+        }
+        address += instruction.length;
+    }
+
+    if (translated == 0) {
+        code = start;
+        return nullptr;
+    }
+
+    exitTo(address, 0);
+
+    // Epilogue, syncs first when leaving after the instruction that reached 
+    // the next sync, as run() would
+    for (BYTE* sync : syncs) {
+        bind(sync);
+    }
+    mov64(RDI, RBX);
+    call(reinterpret_cast<const void*>(&JITCompiler::syncIfDue));
+    for (BYTE* exit : exits) {
+        bind(exit);
+    }
+    const BYTE* epilogue = code;
+    storeRegisters();
+    aluImm64(IMM_ADD, RSP, 8);
+    byte(0x41); byte(0x5F); // pop r15
+    byte(0x41); byte(0x5E); // pop r14
+    byte(0x41); byte(0x5D); // pop r13
+    byte(0x41); byte(0x5C); // pop r12
+    byte(0x5D); // pop rbp
+    byte(0x5B); // pop rbx
+    byte(0xC3); // ret
+
+    // tick() counts the pending cycles and syncs, the way run() does after 
+    // an instruction. If the block goes on, cycleCounter goes back to where 
+    // the code at resume expects it
+    for (const SyncExit& exit : syncExits) {
+        bind(exit.jump);
+        mov64(RDI, RBX);
+        movImm(RSI, exit.pending);
+        movImm(RDX, exit.nextPC);
+        call(reinterpret_cast<const void*>(&JITCompiler::tick));
+        alu(ALU_TEST, RAX, RAX);
+        jumpTo(epilogue, COND_NOT_EQUAL);
+        addCycles(-exit.pending);
+        loadCyclesLeft();
+        jumpTo(exit.resume, COND_ALWAYS);
+    }
+
+    assert(size() <= maxInstructionSize * block.instructions.size() + maxBlockOverhead);
+    return start;
+
+}
+
+// Emits one instruction and counts its cycles, returns false if the
+// instruction is left to the interpreter
+bool Emulator::JITCompiler::compileInstruction(const DecodedInstruction& instruction, WORD address) {
+
+    BYTE opcode = instruction.opcode;
+    BYTE n = instruction.operand[0];
+    WORD nn = (instruction.operand[1] << 8) | instruction.operand[0];
+    WORD next = address + instruction.length;
+
+    int x = opcode >> 6;
+    int y = (opcode >> 3) & 0x7;
+    int z = opcode & 0x7;
+    int p = y >> 1;
+    int q = y & 0x1;
+
+    // LD r, R / LD r, (HL) / LD (HL), r
+    if (x == 1) {
+        if (y == 6) {
+            loadR8(RDX, z);
+            mov(RSI, R15);
+            writeMemory(8, next);
+        } else if (z == 6) {
+            readHL();
+            storeR8(y);
+            endInstruction(8, next);
+        } else {
+            loadR8(RAX, z);
+            storeR8(y);
+            endInstruction(4, next);
+        }
+        return true;
+    }
+
+    // ALU A, r / ALU A, (HL)
+    if (x == 2) {
+        if (z == 6) {
+            readHL();
+            mov(RCX, RAX);
+        } else {
+            loadR8(RCX, z);
+        }
+        doALU(y);
+        endInstruction((z == 6) ? 8 : 4, next);
+        return true;
+    }
+
+    // ALU A, n
+    if ((x == 3) && (z == 6)) {
+        movImm(RCX, n);
+        doALU(y);
+        endInstruction(8, next);
+        return true;
+    }
+
+    switch (opcode) {
+
+        case 0x00: // NOP
+            endInstruction(4, next);
+            return true;
+
+        case 0x02: // LD (BC), A
+        case 0x12: // LD (DE), A
+            loadR8(RDX, 7);
+            mov(RSI, (opcode == 0x02) ? R13 : R14);
+            writeMemory(8, next);
+            return true;
+
+        case 0x0A: // LD A, (BC)
+        case 0x1A: // LD A, (DE)
+            mov(RSI, (opcode == 0x0A) ? R13 : R14);
+            readMemory();
+            storeR8(7);
+            endInstruction(8, next);
+            return true;
+
+        case 0x22: // LDI (HL), A
+        case 0x32: // LDD (HL), A
+            // HL changes before the write, which may leave the block
+            loadR8(RDX, 7);
+            mov(RSI, R15);
+            byte(0x66); byte(0x41); byte(0xFF); byte((opcode == 0x22) ? 0xC7 : 0xCF); // inc/dec r15w
+            writeMemory(8, next);
+            return true;
+
+        case 0x2A: // LDI A, (HL)
+        case 0x3A: // LDD A, (HL)
+            readHL();
+            storeR8(7);
+            byte(0x66); byte(0x41); byte(0xFF); byte((opcode == 0x2A) ? 0xC7 : 0xCF); // inc/dec r15w
+            endInstruction(8, next);
+            return true;
+
+        case 0x36: // LD (HL), n
+            movImm(RDX, n);
+            mov(RSI, R15);
+            writeMemory(12, next);
+            return true;
+
+        case 0x07: // RLCA
+        case 0x0F: // RRCA
+        case 0x17: // RLA
+        case 0x1F: // RRA
+            rotate(y, 7, false);
+            endInstruction(4, next);
+            return true;
+
+        case 0x27: // DAA
+            mov(RAX, R12);
+            shiftImm(SHIFT_RIGHT, RAX, 4);
+            movImm64(RDX, reinterpret_cast<uint64_t>(DAATable.data()));
+            byte(0x0F); byte(0xB7); byte(0x04); byte(0x42); // movzx eax, word [rdx + rax * 2]
+            aluImm(IMM_AND, R12, 0x0F);
+            alu(ALU_OR, R12, RAX);
+            endInstruction(4, next);
+            return true;
+
+        case 0xCB:
+            return compileCBInstruction(n, next);
+
+        case 0x2F: // CPL
+            aluImm(IMM_XOR, R12, 0xFF00);
+            aluImm(IMM_OR, R12, (1 << FLAG_SUB) | (1 << FLAG_HALFCARRY));
+            endInstruction(4, next);
+            return true;
+
+        case 0x37: // SCF
+        case 0x3F: // CCF
+            aluImm(IMM_AND, R12, 0xFFFF & ~((1 << FLAG_SUB) | (1 << FLAG_HALFCARRY)));
+            aluImm((opcode == 0x37) ? IMM_OR : IMM_XOR, R12, 1 << FLAG_CARRY);
+            endInstruction(4, next);
+            return true;
+
+        case 0xEA: // LD (nn), A
+            loadR8(RDX, 7);
+            writeAddress(nn, 16, next);
+            return true;
+
+        case 0xFA: // LD A, (nn)
+            readAddress(nn);
+            storeR8(7);
+            endInstruction(16, next);
+            return true;
+
+        case 0xE0: // LD (FF00+n), A
+            loadR8(RDX, 7);
+            writeAddress(0xFF00 + n, 12, next);
+            return true;
+
+        case 0xF0: // LD A, (FF00+n)
+            readAddress(0xFF00 + n);
+            storeR8(7);
+            endInstruction(12, next);
+            return true;
+
+        case 0x18: // JR PC + dd
+            branchTo(next + static_cast<SIGNED_BYTE>(n), 12);
+            return true;
+
+        case 0xC3: // JP nn
+            branchTo(nn, 16);
+            return true;
+
+        default:
+            break;
+
+    }
+
+    // JR f, PC + dd and JP f, nn
+    if (((x == 0) && (z == 0) && (y >= 4)) || ((x == 3) && (z == 2) && (y < 4))) {
+
+        bool relative = (x == 0);
+        int f = y & 0x3;
+        WORD target = relative ? WORD(next + static_cast<SIGNED_BYTE>(n)) : nn;
+
+        // NZ, Z test the zero flag, NC, C the carry flag
+        testImm(R12, (f < 2) ? (1 << FLAG_ZERO) : (1 << FLAG_CARRY));
+        BYTE* notTaken = jump((f & 0x1) ? COND_EQUAL : COND_NOT_EQUAL);
+
+        branchTo(target, relative ? 12 : 16);
+
+        bind(notTaken);
+        endInstruction(relative ? 8 : 12, next);
+        return true;
+
+    }
+
+    // LD rr, nn / INC rr / DEC rr, not for SP which stays in memory
+    if ((x == 0) && (p < 3)) {
+        int pair = R13 + p;
+        if (z == 1 && q == 0) {
+            movImm(pair, nn);
+            endInstruction(12, next);
+            return true;
+        }
+        if (z == 3) {
+            byte(0x66);
+            rex(false, 0, pair);
+            byte(0xFF);
+            modrm(3, q, pair); // inc/dec r16
+            endInstruction(8, next);
+            return true;
+        }
+    }
+
+    // INC r / DEC r / INC (HL) / DEC (HL)
+    if ((x == 0) && ((z == 4) || (z == 5))) {
+        if (y == 6) {
+            readHL();
+            incDec(z == 5);
+            mov(RDX, RAX);
+            mov(RSI, R15);
+            writeMemory(12, next);
+        } else {
+            loadR8(RAX, y);
+            incDec(z == 5);
+            storeR8(y);
+            endInstruction(4, next);
+        }
+        return true;
+    }
+
+    // LD r, n
+    if ((x == 0) && (z == 6) && (y != 6)) {
+        movImm(RAX, n);
+        storeR8(y);
+        endInstruction(8, next);
+        return true;
+    }
+
+    return false;
+
+}
+
+// CB prefixed instructions on registers, the ones on (HL) are left to the
+// interpreter
+bool Emulator::JITCompiler::compileCBInstruction(BYTE opcode, WORD next) {
+
+    int x = opcode >> 6;
+    int y = (opcode >> 3) & 0x7;
+    int z = opcode & 0x7;
+
+    if (z == 6) {
+        return false;
+    }
+
+    // Bit y of r in its host register
+    int pair = pairOf(z);
+    uint32_t bit = 1u << (((z == 7) || ((z & 0x1) == 0)) ? (y + 8) : y);
+
+    if (x == 0) {
+        // RLC RRC RL RR SLA SRA SWAP SRL
+        rotate(y, z, true);
+    } else if (x == 1) {
+        // BIT, Z is set if the bit is 0, C and the unused bits of F are kept
+        mov(RCX, R12);
+        aluImm(IMM_AND, RCX, 0x1F);
+        aluImm(IMM_OR, RCX, 1 << FLAG_HALFCARRY);
+        testImm(pair, bit);
+        zeroFlag();
+        storeFlags();
+    } else if (x == 2) {
+        aluImm(IMM_AND, pair, 0xFFFF & ~bit); // RES
+    } else {
+        aluImm(IMM_OR, pair, bit); // SET
+    }
+
+    endInstruction(8, next);
+    return true;
+
+}
+
+/*
+********************************************************************************
+SM83 HELPERS
+********************************************************************************
+*/
+
+// Host register holding the pair of 8 bit register r (B C D E H L - A)
+int Emulator::JITCompiler::pairOf(int r) const {
+    return (r == 7) ? R12 : (R13 + (r >> 1));
+}
+
+// host = r, in the low byte
+void Emulator::JITCompiler::loadR8(int host, int r) {
+    mov(host, pairOf(r));
+    if ((r == 7) || ((r & 0x1) == 0)) {
+        shiftImm(SHIFT_RIGHT, host, 8);
+    }
+}
+
+// r = al, clobbers eax
+void Emulator::JITCompiler::storeR8(int r) {
+    int pair = pairOf(r);
+    movzx8(RAX, RAX);
+    if ((r == 7) || ((r & 0x1) == 0)) {
+        aluImm(IMM_AND, pair, 0x00FF);
+        shiftImm(SHIFT_LEFT, RAX, 8);
+    } else {
+        aluImm(IMM_AND, pair, 0xFF00);
+    }
+    alu(ALU_OR, pair, RAX);
+}
+
+// AF BC DE HL from the Emulator
+void Emulator::JITCompiler::loadRegisters() {
+    loadWord(R12, offsetOf(&emulator.regAF));
+    loadWord(R13, offsetOf(&emulator.regBC));
+    loadWord(R14, offsetOf(&emulator.regDE));
+    loadWord(R15, offsetOf(&emulator.regHL));
+}
+
+// AF BC DE HL back to the Emulator
+void Emulator::JITCompiler::storeRegisters() {
+    storeWord(offsetOf(&emulator.regAF), R12);
+    storeWord(offsetOf(&emulator.regBC), R13);
+    storeWord(offsetOf(&emulator.regDE), R14);
+    storeWord(offsetOf(&emulator.regHL), R15);
+}
+
+// F = ecx
+void Emulator::JITCompiler::storeFlags() {
+    aluImm(IMM_AND, R12, 0xFF00);
+    alu(ALU_OR, R12, RCX);
+}
+
+// ecx = Z H C of the last host instruction, as bits of F
+void Emulator::JITCompiler::hostFlags() {
+    byte(0x9F); // lahf
+    movzx8(RCX, AH);
+
+    // lea rdx, [rip + flag table]
+    byte(0x48); byte(0x8D); byte(0x15);
+    dword(uint32_t(emulator.JITCode.memory - (code + 4)));
+
+    // movzx ecx, byte [rdx + rcx]
+    byte(0x0F); byte(0xB6); byte(0x0C); byte(0x0A);
+}
+
+// al = (HL)
+void Emulator::JITCompiler::readHL() {
+    mov(RSI, R15);
+    readMemory();
+}
+
+// al = (address), where the address is known when compiling
+void Emulator::JITCompiler::readAddress(WORD address) {
+
+    // Same as readMem, which only treats these ranges differently. ROM is
+    // not in internalMem.
+    bool direct = (address >= 0x8000)
+        && !((address >= 0xA000) && (address <= 0xBFFF))
+        && !((address >= 0xE000) && (address <= 0xFDFF))
+        && !((address >= 0xFEA0) && (address <= 0xFEFF))
+        && (address != 0xFF00);
+
+    if (direct) {
+        loadByte(RAX, offsetOf(&emulator.internalMem[address]));
+    } else {
+        movImm(RSI, address);
+        readMemory();
+    }
+
+}
+
+// al = (esi)
+void Emulator::JITCompiler::readMemory() {
+
+    // Pages in readPages are read directly, as in readMem
+    mov(RAX, RSI);
+    shiftImm(SHIFT_RIGHT, RAX, 8);
+    loadPage(RCX, RAX, offsetOf(&emulator.readPages[0]));
+    alu64(ALU_TEST, RCX, RCX);
+    BYTE* unmapped = jump(COND_EQUAL);
+    mov(RDX, RSI);
+    aluImm(IMM_AND, RDX, 0xFF);
+    loadByteBase(RAX, RCX, RDX);
+    BYTE* loaded = jump(COND_ALWAYS);
+
+    bind(unmapped);
+    mov64(RDI, RBX);
+    call(reinterpret_cast<const void*>(&JITCompiler::readMem));
+
+    bind(loaded);
+
+}
+
+// (esi) = dl, as the whole of an instruction that takes cycles and continues
+// at nextPC
+void Emulator::JITCompiler::writeMemory(int cycles, WORD nextPC) {
+
+    // Pages in writePages are written directly, as in writeMem
+    mov(RAX, RSI);
+    shiftImm(SHIFT_RIGHT, RAX, 8);
+    loadPage(RCX, RAX, offsetOf(&emulator.writePages[0]));
+    alu64(ALU_TEST, RCX, RCX);
+    BYTE* unmapped = jump(COND_EQUAL);
+    mov(RDI, RSI);
+    aluImm(IMM_AND, RDI, 0xFF);
+    storeByteBase(RCX, RDI, RDX);
+    storeByteImmIndexed(RAX, offsetOf(&emulator.dirtyPages[0]), 1);
+    endWrite(cycles, nextPC, unmapped);
+
+}
+
+// Ends a write instruction after the direct write, and emits the write 
+// through writeMem that unmapped jumps to. writeMem catches the hardware up 
+// to the cycles before this instruction, tick() counts the instruction and
+// syncs if it is due. If the block goes on, cycleCounter goes back to where
+// the direct write leaves it
+void Emulator::JITCompiler::endWrite(int cycles, WORD nextPC, BYTE* unmapped) {
+
+    aluImm64(IMM_CMP, RBP, pending + cycles);
+    SyncExit exit = {jump(COND_LESS_OR_EQUAL), pending + cycles, nextPC, nullptr};
+    size_t written = syncExits.size();
+    syncExits.push_back(exit);
+    BYTE* done = jump(COND_ALWAYS);
+
+    bind(unmapped);
+    addCycles(pending);
+    movzx8(RDX, RDX);
+    mov64(RDI, RBX);
+    call(reinterpret_cast<const void*>(&JITCompiler::writeMem));
+    mov64(RDI, RBX);
+    movImm(RSI, cycles);
+    movImm(RDX, nextPC);
+    call(reinterpret_cast<const void*>(&JITCompiler::tick));
+    alu(ALU_TEST, RAX, RAX);
+    exits.push_back(jump(COND_NOT_EQUAL));
+    addCycles(-(pending + cycles));
+    loadCyclesLeft();
+
+    bind(done);
+    syncExits[written].resume = code;
+    pending += cycles;
+
+}
+
+// Calls interpret() for an instruction that is not translated, which counts
+// its cycles and syncs if it is due
+void Emulator::JITCompiler::interpretInstruction(const DecodedInstruction& instruction, WORD address) {
+    addCycles(pending);
+    pending = 0;
+    storeRegisters();
+    mov64(RDI, RBX);
+    movImm64(RSI, reinterpret_cast<uint64_t>(&instruction));
+    movImm(RDX, address);
+    movImm(RCX, (WORD)(address + instruction.length));
+    call(reinterpret_cast<const void*>(&JITCompiler::interpret));
+    loadRegisters();
+    alu(ALU_TEST, RAX, RAX);
+    exits.push_back(jump(COND_NOT_EQUAL));
+    loadCyclesLeft();
+}
+
+// (address) = dl, where the address is known when compiling
+void Emulator::JITCompiler::writeAddress(WORD address, int cycles, WORD nextPC) {
+
+    // HRAM is not in writePages, but only writes over cached code do more 
+    // than store the byte
+    if ((address >= 0xFF80) && (address <= 0xFFFE)) {
+        int bit = address - 0xC000;
+        movImm(RSI, address);
+        testMemImm(offsetOf(&emulator.codeBytes[bit >> 5]), 1u << (bit & 0x1F));
+        BYTE* cached = jump(COND_NOT_EQUAL);
+        storeByte(offsetOf(&emulator.internalMem[address]), RDX);
+        storeByteImm(offsetOf(&emulator.dirtyPages[address >> 8]), 1);
+        endWrite(cycles, nextPC, cached);
+        return;
+    }
+
+    movImm(RSI, address);
+    writeMemory(cycles, nextPC);
+
+}
+// A = A op ecx, op as in the opcode's y field
+void Emulator::JITCompiler::doALU(int op) {
+
+    static const BYTE hostOpcodes[8] = {
+        0x00, 0x00, 0x28, 0x28, // add, add, sub, sub
+        0x20, 0x30, 0x08, 0x38  // and, xor, or, cmp
+    };
+
+    // ADC and SBC add the carry to the operand first, within 8 bits
+    if ((op == 1) || (op == 3)) {
+        mov(RDX, R12);
+        shiftImm(SHIFT_RIGHT, RDX, FLAG_CARRY);
+        aluImm(IMM_AND, RDX, 0x1);
+        alu(ALU_ADD, RCX, RDX);
+    }
+
+    loadR8(RAX, 7);
+    alu8(hostOpcodes[op], RAX, RCX);
+    hostFlags();
+
+    if ((op == 2) || (op == 3) || (op == 7)) {
+        aluImm(IMM_OR, RCX, 1 << FLAG_SUB);
+    } else if (op == 4) {
+        aluImm(IMM_AND, RCX, 1 << FLAG_ZERO);
+        aluImm(IMM_OR, RCX, 1 << FLAG_HALFCARRY);
+    } else if ((op == 5) || (op == 6)) {
+        aluImm(IMM_AND, RCX, 1 << FLAG_ZERO);
+    }
+
+    // CP leaves A alone
+    if (op != 7) {
+        storeR8(7);
+    }
+    storeFlags();
+
+}
+
+// al = al + 1 or al - 1, with the flags of INC/DEC. C and the unused bits of
+// F are kept
+void Emulator::JITCompiler::incDec(bool decrement) {
+
+    byte(0xFE); modrm(3, decrement ? 1 : 0, RAX); // inc/dec al
+    hostFlags();
+
+    aluImm(IMM_AND, RCX, (1 << FLAG_ZERO) | (1 << FLAG_HALFCARRY));
+    if (decrement) {
+        aluImm(IMM_OR, RCX, 1 << FLAG_SUB);
+    }
+    mov(RDX, R12);
+    aluImm(IMM_AND, RDX, 0x1F);
+    alu(ALU_OR, RCX, RDX);
+    storeFlags();
+
+}
+
+// r = r rotated or shifted, op as in the y field of the CB opcodes (RLC RRC 
+// RL RR SLA SRA SWAP SRL). C is the bit shifted out, N and H are reset and 
+// Z is set from the result if zero is true, reset otherwise (RLCA and the 
+// other rotates of A). The unused bits of F are kept
+void Emulator::JITCompiler::rotate(int op, int r, bool zero) {
+
+    static const BYTE extensions[8] = {
+        0, 1, 2, 3, // rol, ror, rcl, rcr
+        4, 7, 0, 5  // shl, sar, (swap), shr
+    };
+
+    loadR8(RAX, r);
+
+    if (op == 6) {
+        byte(0xC0); modrm(3, 0, RAX); byte(4); // rol al, 4
+        alu(ALU_XOR, RCX, RCX);
+    } else {
+        // RL and RR shift the carry in
+        if ((op == 2) || (op == 3)) {
+            byte(0x41); byte(0x0F); byte(0xBA); modrm(3, 4, R12); byte(FLAG_CARRY); // bt r12d, C
+        }
+        byte(0xD0); modrm(3, extensions[op], RAX); // op al, 1
+        alu(0x19, RCX, RCX); // sbb ecx, ecx
+        aluImm(IMM_AND, RCX, 1 << FLAG_CARRY);
+    }
+
+    if (zero) {
+        alu8(0x84, RAX, RAX); // test al, al
+        zeroFlag();
+    }
+
+    mov(RDX, R12);
+    aluImm(IMM_AND, RDX, 0x0F);
+    alu(ALU_OR, RCX, RDX);
+    storeR8(r);
+    storeFlags();
+
+}
+
+// ecx |= Z if the host's ZF is set
+void Emulator::JITCompiler::zeroFlag() {
+    byte(0x0F); byte(0x94); byte(0xC2); // setz dl
+    movzx8(RDX, RDX);
+    shiftImm(SHIFT_LEFT, RDX, FLAG_ZERO);
+    alu(ALU_OR, RCX, RDX);
+}
+
+// rbp = cycles left before the next sync or the end of the run, from 
+// cycleCounter as it is in the Emulator. The cycles counted since (pending)
+// are compared against it after each instruction
+void Emulator::JITCompiler::loadCyclesLeft() {
+    load64(RBP, offsetOf(&emulator.nextSyncCycle));
+    aluMem64(ALU_CMP, RBP, offsetOf(&emulator.runEndCycle));
+    cmovMem64(COND_ABOVE, RBP, offsetOf(&emulator.runEndCycle));
+    aluMem64(ALU_SUB, RBP, offsetOf(&emulator.cycleCounter));
+}
+
+// Counts the cycles of an instruction and syncs if that reaches the next 
+// sync or the end of the run
+void Emulator::JITCompiler::endInstruction(int cycles, WORD nextPC) {
+    pending += cycles;
+    aluImm64(IMM_CMP, RBP, pending);
+    BYTE* due = jump(COND_LESS_OR_EQUAL);
+    SyncExit exit = {due, pending, nextPC, code};
+    syncExits.push_back(exit);
+}
+
+// cycleCounter += cycles
+void Emulator::JITCompiler::addCycles(int32_t cycles) {
+    if (cycles != 0) {
+        aluMemImm64(IMM_ADD, offsetOf(&emulator.cycleCounter), cycles);
+    }
+}
+
+// Leaves the block at nextPC, after an instruction that took cycles
+void Emulator::JITCompiler::exitTo(WORD nextPC, int cycles) {
+    addCycles(pending + cycles);
+    storeWordImm(offsetOf(&emulator.programCounter), nextPC);
+    aluImm64(IMM_CMP, RBP, pending + cycles);
+    syncs.push_back(jump(COND_LESS_OR_EQUAL));
+    exits.push_back(jump(COND_ALWAYS));
+}
+
+// Branch taking cycles, back to the start of the block loops unless that 
+// reaches the next sync or the end of the run
+void Emulator::JITCompiler::branchTo(WORD target, int cycles) {
+    if (loops && (target == blockStart)) {
+        addCycles(pending + cycles);
+        aluImm64(IMM_SUB, RBP, pending + cycles);
+        SyncExit exit = {jump(COND_LESS_OR_EQUAL), 0, target, loopStart};
+        syncExits.push_back(exit);
+        jumpTo(loopStart, COND_ALWAYS);
+    } else {
+        exitTo(target, cycles);
+    }
+}
+
+// Displacement of an Emulator member from rbx
+int32_t Emulator::JITCompiler::offsetOf(const void* member) const {
+    return static_cast<const BYTE*>(member) - reinterpret_cast<const BYTE*>(&emulator);
+}
+
+/*
+********************************************************************************
+X86-64 ENCODING
+********************************************************************************
+*/
+
+void Emulator::JITCompiler::byte(int value) {
+    *code++ = BYTE(value);
+}
+
+void Emulator::JITCompiler::dword(uint32_t value) {
+    memcpy(code, &value, sizeof(value));
+    code += sizeof(value);
+}
+
+void Emulator::JITCompiler::rex(bool wide, int reg, int rm, int index) {
+    BYTE prefix = 0x40 | (wide << 3) | ((reg & 0x8) >> 1) | ((index & 0x8) >> 2) | ((rm & 0x8) >> 3);
+    if (prefix != 0x40) byte(prefix);
+}
+
+void Emulator::JITCompiler::modrm(int mod, int reg, int rm) {
+    byte((mod << 6) | ((reg & 0x7) << 3) | (rm & 0x7));
+}
+
+// ModRM for [rbx + disp32]
+void Emulator::JITCompiler::memRBX(int reg, int32_t disp) {
+    modrm(2, reg, RBX);
+    dword(disp);
+}
+
+// mov dst32, src32
+void Emulator::JITCompiler::mov(int dst, int src) {
+    alu(0x89, dst, src);
+}
+
+// mov dst64, src64
+void Emulator::JITCompiler::mov64(int dst, int src) {
+    rex(true, src, dst);
+    byte(0x89);
+    modrm(3, src, dst);
+}
+
+// mov dst32, imm32
+void Emulator::JITCompiler::movImm(int dst, uint32_t imm) {
+    rex(false, 0, dst);
+    byte(0xB8 + (dst & 0x7));
+    dword(imm);
+}
+
+// mov dst64, imm64
+void Emulator::JITCompiler::movImm64(int dst, uint64_t imm) {
+    rex(true, 0, dst);
+    byte(0xB8 + (dst & 0x7));
+    dword(uint32_t(imm));
+    dword(uint32_t(imm >> 32));
+}
+
+// op dst32, src32
+void Emulator::JITCompiler::alu(int opcode, int dst, int src) {
+    rex(false, src, dst);
+    byte(opcode);
+    modrm(3, src, dst);
+}
+
+// op dst64, src64
+void Emulator::JITCompiler::alu64(int opcode, int dst, int src) {
+    rex(true, src, dst);
+    byte(opcode);
+    modrm(3, src, dst);
+}
+
+// op dst64, qword [rbx + disp], for the opcodes that are not TEST
+void Emulator::JITCompiler::aluMem64(int opcode, int dst, int32_t disp) {
+    rex(true, dst, RBX);
+    byte(opcode | 0x2);
+    memRBX(dst, disp);
+}
+
+// cmovcc dst64, qword [rbx + disp]
+void Emulator::JITCompiler::cmovMem64(int condition, int dst, int32_t disp) {
+    rex(true, dst, RBX);
+    byte(0x0F); byte(0x40 + condition);
+    memRBX(dst, disp);
+}
+
+// op dst32, imm32
+void Emulator::JITCompiler::aluImm(int extension, int dst, uint32_t imm) {
+    rex(false, 0, dst);
+    byte(0x81);
+    modrm(3, extension, dst);
+    dword(imm);
+}
+
+// op dst64, imm32 sign extended
+void Emulator::JITCompiler::aluImm64(int extension, int dst, uint32_t imm) {
+    rex(true, 0, dst);
+    byte(0x81);
+    modrm(3, extension, dst);
+    dword(imm);
+}
+
+// op qword [rbx + disp], imm32 sign extended
+void Emulator::JITCompiler::aluMemImm64(int extension, int32_t disp, uint32_t imm) {
+    rex(true, 0, RBX);
+    byte(0x81);
+    memRBX(extension, disp);
+    dword(imm);
+}
+
+// test dst32, imm32
+void Emulator::JITCompiler::testImm(int dst, uint32_t imm) {
+    rex(false, 0, dst);
+    byte(0xF7);
+    modrm(3, 0, dst);
+    dword(imm);
+}
+
+// shl/shr dst32, imm8
+void Emulator::JITCompiler::shiftImm(int extension, int dst, int amount) {
+    rex(false, 0, dst);
+    byte(0xC1);
+    modrm(3, extension, dst);
+    byte(amount);
+}
+
+// op dst8, src8, for al, cl, dl and bl only
+void Emulator::JITCompiler::alu8(int opcode, int dst, int src) {
+    byte(opcode);
+    modrm(3, src, dst);
+}
+
+// movzx dst32, src8, src is al, cl, dl, bl or ah
+void Emulator::JITCompiler::movzx8(int dst, int src) {
+    rex(false, dst, 0);
+    byte(0x0F); byte(0xB6);
+    modrm(3, dst, src);
+}
+
+// mov dst64, qword [rbx + disp]
+void Emulator::JITCompiler::load64(int dst, int32_t disp) {
+    rex(true, dst, RBX);
+    byte(0x8B);
+    memRBX(dst, disp);
+}
+
+// mov dst64, qword [rbx + index * 8 + disp], a page from readPages or 
+// writePages
+void Emulator::JITCompiler::loadPage(int dst, int index, int32_t disp) {
+    rex(true, dst, RBX, index);
+    byte(0x8B);
+    modrm(2, dst, 4);
+    byte(0xC0 | ((index & 0x7) << 3) | RBX); // SIB, scale 8
+    dword(disp);
+}
+
+// movzx dst32, word [rbx + disp]
+void Emulator::JITCompiler::loadWord(int dst, int32_t disp) {
+    rex(false, dst, RBX);
+    byte(0x0F); byte(0xB7);
+    memRBX(dst, disp);
+}
+
+// mov word [rbx + disp], src16
+void Emulator::JITCompiler::storeWord(int32_t disp, int src) {
+    byte(0x66);
+    rex(false, src, RBX);
+    byte(0x89);
+    memRBX(src, disp);
+}
+
+// mov word [rbx + disp], imm16
+void Emulator::JITCompiler::storeWordImm(int32_t disp, WORD imm) {
+    byte(0x66);
+    byte(0xC7);
+    memRBX(0, disp);
+    byte(imm & 0xFF);
+    byte(imm >> 8);
+}
+
+// movzx dst32, byte [rbx + disp]
+void Emulator::JITCompiler::loadByte(int dst, int32_t disp) {
+    rex(false, dst, RBX);
+    byte(0x0F); byte(0xB6);
+    memRBX(dst, disp);
+}
+
+// movzx dst32, byte [base + index], base is not rbp or r13
+void Emulator::JITCompiler::loadByteBase(int dst, int base, int index) {
+    rex(false, dst, base, index);
+    byte(0x0F); byte(0xB6);
+    modrm(0, dst, 4);
+    byte(((index & 0x7) << 3) | (base & 0x7)); // SIB
+}
+
+// mov byte [rbx + disp], src8, src is al, cl, dl or bl
+void Emulator::JITCompiler::storeByte(int32_t disp, int src) {
+    byte(0x88);
+    memRBX(src, disp);
+}
+
+// mov byte [rbx + disp], imm8
+void Emulator::JITCompiler::storeByteImm(int32_t disp, BYTE imm) {
+    byte(0xC6);
+    memRBX(0, disp);
+    byte(imm);
+}
+
+// mov byte [rbx + index + disp], imm8
+void Emulator::JITCompiler::storeByteImmIndexed(int index, int32_t disp, BYTE imm) {
+    rex(false, 0, RBX, index);
+    byte(0xC6);
+    modrm(2, 0, 4);
+    byte(((index & 0x7) << 3) | RBX); // SIB
+    dword(disp);
+    byte(imm);
+}
+
+// mov byte [base + index], src8, src is al, cl, dl or bl and base is not rbp
+// or r13
+void Emulator::JITCompiler::storeByteBase(int base, int index, int src) {
+    rex(false, src, base, index);
+    byte(0x88);
+    modrm(0, src, 4);
+    byte(((index & 0x7) << 3) | (base & 0x7)); // SIB
+}
+
+// test dword [rbx + disp], imm32
+void Emulator::JITCompiler::testMemImm(int32_t disp, uint32_t imm) {
+    byte(0xF7);
+    memRBX(0, disp);
+    dword(imm);
+}
+
+void Emulator::JITCompiler::call(const void* function) {
+    movImm64(RAX, reinterpret_cast<uint64_t>(function));
+    byte(0xFF); byte(0xD0); // call rax
+}
+
+// Jump with a rel32 to be filled in by bind()
+BYTE* Emulator::JITCompiler::jump(int condition) {
+    if (condition == COND_ALWAYS) {
+        byte(0xE9);
+    } else {
+        byte(0x0F); byte(0x80 + condition);
+    }
+    BYTE* rel32 = code;
+    dword(0);
+    return rel32;
+}
+
+void Emulator::JITCompiler::jumpTo(const BYTE* target, int condition) {
+    BYTE* rel32 = jump(condition);
+    int32_t offset = target - (rel32 + 4);
+    memcpy(rel32, &offset, sizeof(offset));
+}
+
+// Points a jump from jump() at the current position
+void Emulator::JITCompiler::bind(BYTE* rel32) {
+    int32_t offset = code - (rel32 + 4);
+    memcpy(rel32, &offset, sizeof(offset));
+}
+
+#else
+
+/*
+Without JIT_X64 there is no code buffer and setJITEnabled has no effect.
+*/
+
+Emulator::JITCodeBuffer::JITCodeBuffer(JITCodeBuffer&&) {}
+
+Emulator::JITCodeBuffer& Emulator::JITCodeBuffer::operator=(JITCodeBuffer&&) {
+    return *this;
+}
+
+Emulator::JITCodeBuffer::~JITCodeBuffer() {}
+
+bool Emulator::JITCodeBuffer::allocate() {
+    return false;
+}
+
+void Emulator::JITCodeBuffer::clear() {}
+
+bool Emulator::JITCodeBuffer::setWritable(bool) {
+    return false;
+}
+
+void Emulator::setJITEnabled(bool enabled) {
+    JITEnabled = false;
+}
+
+bool Emulator::isJITEnabled() const {
+    return JITEnabled;
+}
+
+bool Emulator::runCompiledBlock() {
+    return false;
+}
+
+#endif
@@ -19,9 +19,12 @@ const chrono::duration<float, milli> timePerFrame(millisPerFrame);
 SDL_Renderer* sdlRenderer;
 SDL_Texture* sdlTexture;
 Emulator emulator;
+RewindBuffer rewindBuffer; // about 3 minutes of Tetris in the default 4MB
+Movie movie; // M starts and stops recording one
 bool gameRunning;
 bool pauseGame;
 bool saveGame;
+bool rewinding;
 
 void render(SDL_Renderer* renderer, SDL_Texture* texture, Emulator& emu) {
 
@@ -39,6 +42,18 @@ void doRender() {
 
 }
 
+// Records from the current state, movie.gbm plays back with gbheadless --play
+void toggleRecording() {
+    if (movie.isRecording()) {
+        movie.stopRecording();
+        movie.save("movie.gbm");
+        cout << "recorded " << movie.getFrameCount() << " frames to movie.gbm" << endl;
+    } else {
+        movie.startRecording(emulator, false);
+        cout << "recording" << endl;
+    }
+}
+
 void processInput(Emulator& emulator, SDL_Event& event) {
 
     if (event.type == SDL_KEYDOWN) {
@@ -53,12 +68,15 @@ void processInput(Emulator& emulator, SDL_Event& event) {
             case SDLK_UP:       key = 2; break;
             case SDLK_DOWN:     key = 3; break;
             case SDLK_ESCAPE:   gameRunning = false; break;
+            case SDLK_BACKSPACE: rewinding = true; break;
             #ifndef __EMSCRIPTEN__
             case SDLK_i:        saveGame = true; break;
+            case SDLK_m:        toggleRecording(); break;
             #endif
         }
         if (key != -1) {
             emulator.buttonPressed(key);
+            movie.recordInput(key, true);
         }
     } else if (event.type == SDL_KEYUP) {
         int key = -1;
@@ -71,9 +89,15 @@ void processInput(Emulator& emulator, SDL_Event& event) {
             case SDLK_LEFT:     key = 1; break;
             case SDLK_UP:       key = 2; break;
             case SDLK_DOWN:     key = 3; break;
+            case SDLK_BACKSPACE:
+                rewinding = false;
+                printf("rewind: %zu frames in %zuKB, %.1fus per capture\n", rewindBuffer.frames(),
+                    rewindBuffer.memoryUsed() / 1024, rewindBuffer.captureMicroseconds());
+                break;
         }
         if (key != -1) {
             emulator.buttonReleased(key);
+            movie.recordInput(key, false);
         }
     }
 
@@ -105,10 +129,18 @@ void load(string romFile) {
         cout << "Something wrong occured while loading!" << endl;
         exit(4);
     }
+    rewindBuffer.clear();
 
 }
 }
 
+// Held down to rewind, for the client's rewind button
+extern "C" {
+void setRewinding(bool rewind) {
+    rewinding = rewind;
+}
+}
+
 extern "C" {
 void loadState(string saveFile) {
     emulator.loadState(saveFile);
@@ -145,7 +177,19 @@ void mainloop() {
             processInput(emulator, event);
         }
 
-        emulator.update();
+        // While rewinding, go back a frame and run it again to draw it. 
+        // Otherwise every frame is kept to rewind to. A movie can't be 
+        // rewound, so there is no rewinding while recording one
+        if (rewinding && !movie.isRecording()) {
+            if (rewindBuffer.stepBack(emulator)) {
+                emulator.update();
+            }
+        } else {
+            emulator.update();
+            movie.recordFrame(emulator);
+            rewindBuffer.capture(emulator);
+        }
+
         if (saveGame) {
             cout << "saving game now" << endl;
             emulator.saveState("savefile.sav");
@@ -0,0 +1,219 @@
+#include "Emulator.hpp"
+
+/*
+********************************************************************************
+MEMORY LAYOUT
+********************************************************************************
+*/
+
+/*
+
+An Emulator is meant to be cheap enough to run hundreds of them at once, so it
+only holds what every instance needs:
+
+- The hot state (registers, lazy flags, scheduler and run cycles, timers,
+  banking and the block cache cursor) comes first and is aligned to a cache
+  line. The interpreter loop and syncHardware touch little else, and all of
+  it fits in the first three cache lines.
+- Then the page tables and internalMem, which the JIT addresses relative to
+  the Emulator.
+- Cold state (block cache, idle loop and JIT bookkeeping) comes last.
+
+The ROM is shared between Emulators (see ROM IMAGES). The framebuffers, the
+tile cache and the external RAM banks live outside the Emulator, in 
+ArenaBuffers. The RAM banks are sized from the cartridge header (0x149), from
+one 8KB bank up to the four banks MBC1 can switch between. Carts without RAM
+keep one bank, which reads and writes the way the fixed 32KB array did, and 
+banks past the ones the cartridge has wrap around.
+
+Buffers come from new[] unless setMemoryArena gives the Emulator a
+MemoryArena. The arena carves them out of big blocks and keeps released ones
+for the next Emulator of the same shape, so a pool of Emulators costs a few
+large allocations and reuses them as instances come and go.
+
+Resident memory per Emulator, 1000 of them running Tetris for 200 frames on
+x86-64 (memoryFootprint() gives the same figure for one):
+    with the buffers inline:    196920 byte Emulator, 211KB, 4970 per GB
+    with ArenaBuffers:          72128 byte Emulator, 183KB, 5710 per GB
+The ARGB8888 framebuffer (90KB) and internalMem (64KB) are most of what is 
+left. Emulators that only need shades can turn the first off (see 
+FRAMEBUFFERS).
+
+*/
+
+MemoryArena::MemoryArena(size_t blockSize)
+    : blockSize(blockSize), reservedBytes(0), blockUsed(blockSize) {}
+
+// Buffers are whole cache lines, so they never share one
+size_t MemoryArena::roundSize(size_t size) {
+    return (size + 63) & ~(size_t)63;
+}
+
+BYTE* MemoryArena::allocate(size_t size) {
+
+    size = roundSize(size);
+    lock_guard<mutex> guard(lock);
+
+    vector<BYTE*>& reusable = freeBuffers[size];
+    if (!reusable.empty()) {
+        BYTE* buffer = reusable.back();
+        reusable.pop_back();
+        return buffer;
+    }
+
+    // Bigger than a block, it gets a block of its own
+    if (size > blockSize) {
+        blocks.emplace_back(new BYTE[size + 63]);
+        reservedBytes += size + 63;
+        return reinterpret_cast<BYTE*>(roundSize(reinterpret_cast<uintptr_t>(blocks.back().get())));
+    }
+
+    if (blockUsed + size > blockSize) {
+        blocks.emplace_back(new BYTE[blockSize + 63]);
+        reservedBytes += blockSize + 63;
+        blockUsed = 0;
+    }
+
+    BYTE* start = reinterpret_cast<BYTE*>(roundSize(reinterpret_cast<uintptr_t>(blocks.back().get())));
+    BYTE* buffer = start + blockUsed;
+    blockUsed += size;
+    return buffer;
+
+}
+
+void MemoryArena::release(BYTE* buffer, size_t size) {
+    lock_guard<mutex> guard(lock);
+    freeBuffers[roundSize(size)].push_back(buffer);
+}
+
+size_t MemoryArena::reserved() const {
+    lock_guard<mutex> guard(lock);
+    return reservedBytes;
+}
+
+Emulator::ArenaBuffer::ArenaBuffer(ArenaBuffer&& other)
+    : memory(other.memory), size(other.size), arena(other.arena) {
+    other.memory = nullptr;
+    other.size = 0;
+}
+
+Emulator::ArenaBuffer& Emulator::ArenaBuffer::operator=(ArenaBuffer&& other) {
+    if (this != &other) {
+        release();
+        memory = other.memory;
+        size = other.size;
+        arena = other.arena;
+        other.memory = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+Emulator::ArenaBuffer::~ArenaBuffer() {
+    release();
+}
+
+// Replaces the buffer with a zeroed one of newSize bytes
+void Emulator::ArenaBuffer::allocate(size_t newSize, MemoryArena* from) {
+
+    release();
+
+    arena = from;
+    size = newSize;
+    memory = (arena != nullptr) ? arena->allocate(size) : new BYTE[size];
+    memset(memory, 0, size);
+
+}
+
+// Copies the buffer into one from another arena (or new[]) and releases the
+// old one
+void Emulator::ArenaBuffer::moveTo(MemoryArena* to) {
+
+    if (memory == nullptr) {
+        arena = to;
+        return;
+    }
+
+    BYTE* newMemory = (to != nullptr) ? to->allocate(size) : new BYTE[size];
+    memcpy(newMemory, memory, size);
+
+    size_t oldSize = size;
+    release();
+    memory = newMemory;
+    size = oldSize;
+    arena = to;
+
+}
+
+void Emulator::ArenaBuffer::release() {
+
+    if (memory != nullptr) {
+        if (arena != nullptr) {
+            arena->release(memory, size);
+        } else {
+            delete[] memory;
+        }
+    }
+
+    memory = nullptr;
+    size = 0;
+
+}
+
+// Buffers already handed out move to the new arena with their contents, so 
+// it can be called at any time
+void Emulator::setMemoryArena(MemoryArena* newArena) {
+
+    arena = newArena;
+    shadeBuffer.moveTo(arena);
+    shadePixels = shadeBuffer.memory;
+    displayBuffer.moveTo(arena);
+    displayPixels = reinterpret_cast<uint32_t*>(displayBuffer.memory);
+    packedBuffer.moveTo(arena);
+    packedPixels = packedBuffer.memory;
+    tileBuffer.moveTo(arena);
+    tileRows = reinterpret_cast<BYTE(*)[8]>(tileBuffer.memory);
+    RAMBanks.moveTo(arena);
+
+    // The external RAM pages point into the RAM banks
+    if (RAMBanks.memory != nullptr) {
+        mapMemory();
+    }
+
+}
+
+// Sizes the RAM banks from the RAM size byte of the cartridge header. They
+// keep their contents if the size doesn't change
+void Emulator::allocateRAMBanks(BYTE headerSize) {
+
+    static const size_t sizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+    size_t size = (headerSize < 6) ? sizes[headerSize] : 0;
+
+    // A power of two, so bank offsets can wrap around with a mask
+    size = min(max(size, (size_t)0x2000), (size_t)maxRAMSize);
+
+    if (RAMBanks.size != size) {
+        RAMBanks.allocate(size, arena);
+        RAMBanksChanged = false;
+    }
+
+}
+
+size_t Emulator::memoryFootprint() const {
+
+    size_t bytes = sizeof(Emulator) + shadeBuffer.size + displayBuffer.size + packedBuffer.size
+        + tileBuffer.size + RAMBanks.size;
+
+    // Cached blocks, leaving out the allocator's overhead
+    bytes += blockCache.bucket_count() * sizeof(void*);
+    for (const auto& entry : blockCache) {
+        bytes += sizeof(entry) + sizeof(void*);
+        bytes += entry.second.instructions.capacity() * sizeof(DecodedInstruction);
+    }
+    for (const vector<WORD>& starts : RAMBlocks) {
+        bytes += starts.capacity() * sizeof(WORD);
+    }
+
+    return bytes;
+
+}
@@ -0,0 +1,350 @@
+#include "Emulator.hpp"
+
+/*
+********************************************************************************
+MOVIES
+********************************************************************************
+*/
+
+/*
+
+A movie is a start, the buttons pressed and released, and a hash of every
+frame. A frame is one update(), and the buttons change between frames, so the
+frame number pins down the exact cycle an input lands on. Playing it back
+applies the same inputs before the same frames and checks that every frame
+draws the same picture. Frames are hashed and kept as shades (shadePixels),
+so the palette and the framebuffers turned on don't matter.
+
+A movie starts either from power on (resetCPU, with the ROM already loaded)
+or from a save state embedded in it. Every keyframeInterval frames a save
+state is kept as a keyframe, so seek only has to run the frames since the
+last keyframe before it. The start and the keyframes keep the picture too,
+some frames draw over the last one instead of starting from a blank screen.
+
+Playback doesn't wait for anything, it runs as fast as the Emulator goes.
+gbheadless --play plays a movie and reports the first frame that differs.
+
+File, numbers little endian:
+    "GBMV", version (4 bytes), ROM hash (8 bytes), from power on (1 byte),
+    keyframe interval (4 bytes)
+    start state size (4 bytes), start state, pixels size (4 bytes), pixels
+    input count (4 bytes), inputs: frame (4 bytes), key, pressed
+    frame count (4 bytes), frame hashes (8 bytes each)
+    keyframe count (4 bytes), keyframes: frame (4 bytes), state size
+    (4 bytes), state, pixels size (4 bytes), pixels
+
+Pixels are the 160 * 144 bytes of shadePixels. Version 1 kept ARGB8888 
+pixels and hashed those, it can't be played back.
+
+*/
+
+static const BYTE movieMagic[4] = {'G', 'B', 'M', 'V'};
+static const uint32_t movieVersion = 2;
+static const size_t pixelBytes = 160 * 144;
+
+static void putInt(ostream& file, uint32_t value) {
+    BYTE bytes[4] = {(BYTE)value, (BYTE)(value >> 8), (BYTE)(value >> 16), (BYTE)(value >> 24)};
+    file.write(reinterpret_cast<const char*>(bytes), 4);
+}
+
+static void putLong(ostream& file, uint64_t value) {
+    putInt(file, value & 0xFFFFFFFF);
+    putInt(file, value >> 32);
+}
+
+static void putBytes(ostream& file, const vector<BYTE>& bytes) {
+    putInt(file, bytes.size());
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+static uint32_t getInt(istream& file) {
+    BYTE bytes[4] = {};
+    file.read(reinterpret_cast<char*>(bytes), 4);
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t getLong(istream& file) {
+    uint64_t low = getInt(file);
+    return low | ((uint64_t)getInt(file) << 32);
+}
+
+// Sizes are checked against what is left of the file before anything is
+// allocated
+static bool getBytes(istream& file, vector<BYTE>& bytes, uint64_t remaining) {
+    uint32_t size = getInt(file);
+    if (!file.good() || size > remaining) {
+        return false;
+    }
+    bytes.resize(size);
+    file.read(reinterpret_cast<char*>(bytes.data()), size);
+    return file.good();
+}
+
+// FNV-1a over 64 bit words, fast enough to run after every frame
+uint64_t Movie::hashFrame(const BYTE* pixels) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < pixelBytes; i += 8) {
+        uint64_t eight;
+        memcpy(&eight, &pixels[i], 8);
+        hash = (hash ^ eight) * 0x100000001B3;
+    }
+    return hash;
+}
+
+void Movie::captureKeyframe(Emulator& emulator, Keyframe& keyframe) {
+    emulator.writeState(keyframe.state);
+    keyframe.pixels.assign(emulator.shadePixels, emulator.shadePixels + pixelBytes);
+}
+
+bool Movie::loadKeyframe(Emulator& emulator, const Keyframe& keyframe) {
+    if (emulator.getROMHash() != ROMHash || !emulator.readState(keyframe.state)) {
+        return false;
+    }
+    memcpy(emulator.shadePixels, keyframe.pixels.data(), pixelBytes);
+    emulator.updateFramebuffers();
+    return true;
+}
+
+void Movie::startRecording(Emulator& emulator, bool powerOn, int interval) {
+
+    recording = true;
+    fromPowerOn = powerOn;
+    ROMHash = emulator.getROMHash();
+    keyframeInterval = max(interval, 1);
+
+    start = {};
+    inputs.clear();
+    frameHashes.clear();
+    keyframes.clear();
+    frame = 0;
+    firstMismatch = -1;
+
+    if (fromPowerOn) {
+        emulator.resetCPU();
+    } else {
+        captureKeyframe(emulator, start);
+    }
+
+}
+
+void Movie::recordInput(int key, bool pressed) {
+    if (recording) {
+        inputs.push_back({(uint32_t)frame, (BYTE)key, pressed});
+    }
+}
+
+void Movie::recordFrame(Emulator& emulator) {
+
+    if (!recording) {
+        return;
+    }
+
+    frameHashes.push_back(hashFrame(emulator.shadePixels));
+    frame++;
+
+    if (frame % keyframeInterval == 0) {
+        keyframes.push_back({(uint32_t)frame, {}, {}});
+        captureKeyframe(emulator, keyframes.back());
+    }
+
+}
+
+void Movie::stopRecording() {
+    recording = false;
+}
+
+bool Movie::isRecording() const {
+    return recording;
+}
+
+bool Movie::save(const string& path) const {
+
+    ofstream file(path, ios::binary);
+
+    file.write(reinterpret_cast<const char*>(movieMagic), 4);
+    putInt(file, movieVersion);
+    putLong(file, ROMHash);
+    file.put(fromPowerOn);
+    putInt(file, keyframeInterval);
+    putBytes(file, start.state);
+    putBytes(file, start.pixels);
+
+    putInt(file, inputs.size());
+    for (const Input& input : inputs) {
+        putInt(file, input.frame);
+        file.put(input.key);
+        file.put(input.pressed);
+    }
+
+    putInt(file, frameHashes.size());
+    for (uint64_t hash : frameHashes) {
+        putLong(file, hash);
+    }
+
+    putInt(file, keyframes.size());
+    for (const Keyframe& keyframe : keyframes) {
+        putInt(file, keyframe.frame);
+        putBytes(file, keyframe.state);
+        putBytes(file, keyframe.pixels);
+    }
+
+    if (!file.good()) {
+        cout << "Could not write movie " << path << endl;
+        return false;
+    }
+    return true;
+
+}
+
+bool Movie::load(const string& path) {
+
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file.good()) {
+        cout << "Could not open movie " << path << endl;
+        return false;
+    }
+    uint64_t size = file.tellg();
+    file.seekg(0);
+
+    BYTE magic[4] = {};
+    file.read(reinterpret_cast<char*>(magic), 4);
+    if (memcmp(magic, movieMagic, 4) != 0 || getInt(file) != movieVersion) {
+        cout << path << " is not a movie this version can play" << endl;
+        return false;
+    }
+
+    recording = false;
+    ROMHash = getLong(file);
+    fromPowerOn = file.get();
+    keyframeInterval = max((int)getInt(file), 1);
+
+    bool good = getBytes(file, start.state, size) && getBytes(file, start.pixels, size);
+    good = good && (start.pixels.size() == (fromPowerOn ? 0 : pixelBytes));
+
+    uint32_t count = getInt(file);
+    good = good && file.good() && (count <= size / 6);
+    if (good) {
+        inputs.resize(count);
+        for (Input& input : inputs) {
+            input.frame = getInt(file);
+            input.key = file.get() & 0x7;
+            input.pressed = file.get();
+        }
+    }
+
+    count = getInt(file);
+    good = good && file.good() && (count <= size / 8);
+    if (good) {
+        frameHashes.resize(count);
+        for (uint64_t& hash : frameHashes) {
+            hash = getLong(file);
+        }
+    }
+
+    count = getInt(file);
+    good = good && file.good() && (count <= size / 8);
+    if (good) {
+        keyframes.resize(count);
+        for (Keyframe& keyframe : keyframes) {
+            keyframe.frame = getInt(file);
+            good = good && getBytes(file, keyframe.state, size) && getBytes(file, keyframe.pixels, size);
+            good = good && (keyframe.pixels.size() == pixelBytes);
+        }
+    }
+
+    if (!good) {
+        cout << "Movie " << path << " is truncated" << endl;
+        return false;
+    }
+
+    frame = 0;
+    nextInput = 0;
+    firstMismatch = -1;
+    return true;
+
+}
+
+bool Movie::startPlayback(Emulator& emulator) {
+
+    if (emulator.getROMHash() != ROMHash) {
+        cout << "The movie was recorded with a different ROM" << endl;
+        return false;
+    }
+
+    if (fromPowerOn) {
+        emulator.resetCPU();
+    } else if (!loadKeyframe(emulator, start)) {
+        return false;
+    }
+
+    frame = 0;
+    nextInput = 0;
+    firstMismatch = -1;
+    return true;
+
+}
+
+bool Movie::playFrame(Emulator& emulator) {
+
+    if (frame >= getFrameCount()) {
+        return false;
+    }
+
+    for (; nextInput < inputs.size() && inputs[nextInput].frame <= (uint32_t)frame; nextInput++) {
+        if (inputs[nextInput].pressed) {
+            emulator.buttonPressed(inputs[nextInput].key);
+        } else {
+            emulator.buttonReleased(inputs[nextInput].key);
+        }
+    }
+
+    emulator.update();
+
+    if (firstMismatch == -1 && hashFrame(emulator.shadePixels) != frameHashes[frame]) {
+        firstMismatch = frame;
+    }
+    frame++;
+    return true;
+
+}
+
+// Loads the last keyframe before target and plays on from there
+bool Movie::seek(Emulator& emulator, int target) {
+
+    target = min(max(target, 0), getFrameCount());
+
+    auto after = upper_bound(keyframes.begin(), keyframes.end(), (uint32_t)target,
+        [](uint32_t frame, const Keyframe& keyframe) { return frame < keyframe.frame; });
+
+    if (after == keyframes.begin()) {
+        if (!startPlayback(emulator)) {
+            return false;
+        }
+    } else {
+        const Keyframe& keyframe = *(after - 1);
+        if (!loadKeyframe(emulator, keyframe)) {
+            return false;
+        }
+        frame = keyframe.frame;
+        nextInput = lower_bound(inputs.begin(), inputs.end(), keyframe.frame,
+            [](const Input& input, uint32_t frame) { return input.frame < frame; }) - inputs.begin();
+    }
+
+    while (frame < target) {
+        playFrame(emulator);
+    }
+    return true;
+
+}
+
+int Movie::getFrame() const {
+    return frame;
+}
+
+int Movie::getFrameCount() const {
+    return frameHashes.size();
+}
+
+int Movie::getFirstMismatch() const {
+    return firstMismatch;
+}
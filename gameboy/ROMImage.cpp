@@ -0,0 +1,160 @@
+#include "Emulator.hpp"
+
+#include <mutex>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define ROM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+********************************************************************************
+ROM IMAGES
+********************************************************************************
+*/
+
+/*
+
+A ROM file is mapped read-only once, and every Emulator that loads it shares
+the mapping through a shared_ptr. The last Emulator to let go of it unmaps it.
+Open images are found again by device, inode, size and modification time, so
+loading a ROM that is already open costs a stat(), and a ROM rebuilt in place
+is mapped again rather than shared with its old contents. Entries of images 
+nobody holds any more are dropped when the next one is opened. Each image is 
+hashed once when it is opened, save states keep the hash instead of the ROM.
+
+Emulators read at least minimumSize bytes of the ROM (bank 0 and the bank
+offsets, which wrap around at 16 bits). Smaller files are mapped over an
+anonymous zero-filled region of that size, so those reads return 0 like they
+did from the zeroed cartridgeMem array.
+
+The WebAssembly and Windows builds have no mmap, they read the file into
+memory instead. Sharing works the same, keyed on the path.
+
+*/
+
+static const size_t minimumSize = 0x10000;
+
+// FNV-1a, once per image when it is opened
+static uint64_t hashBytes(const BYTE* bytes, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+static mutex openImagesLock;
+static unordered_map<string, weak_ptr<const ROMImage>> openImages;
+
+ROMImage::ROMImage() : mapping(nullptr), mappingSize(0), bytes(nullptr), fileSize(0), contentHash(hashBytes(nullptr, 0)) {}
+
+ROMImage::~ROMImage() {
+#ifdef ROM_MMAP
+    if (mapping != nullptr) {
+        munmap(mapping, mappingSize);
+    }
+#endif
+}
+
+// An image of zeros, for Emulators that have not loaded a game yet
+shared_ptr<const ROMImage> ROMImage::empty() {
+
+    static shared_ptr<const ROMImage> image = []() {
+        shared_ptr<ROMImage> zeros(new ROMImage());
+        zeros->buffer.assign(minimumSize, 0);
+        zeros->bytes = zeros->buffer.data();
+        return shared_ptr<const ROMImage>(zeros);
+    }();
+
+    return image;
+
+}
+
+// Returns the image of the ROM at path, or nullptr if it can't be read
+shared_ptr<const ROMImage> ROMImage::open(const string& path) {
+
+#ifdef ROM_MMAP
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(file, &info) != 0) {
+        close(file);
+        return nullptr;
+    }
+    string key = to_string(info.st_dev) + ":" + to_string(info.st_ino) + ":"
+        + to_string(info.st_size) + ":" + to_string(info.st_mtime);
+#else
+    string key = path;
+#endif
+
+    lock_guard<mutex> lock(openImagesLock);
+
+    auto found = openImages.find(key);
+    if (found != openImages.end()) {
+        shared_ptr<const ROMImage> image = found->second.lock();
+        if (image != nullptr) {
+#ifdef ROM_MMAP
+            close(file);
+#endif
+            return image;
+        }
+    }
+
+    shared_ptr<ROMImage> loaded(new ROMImage());
+
+#ifdef ROM_MMAP
+    loaded->fileSize = info.st_size;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    loaded->mappingSize = (max(loaded->fileSize, minimumSize) + pageSize - 1) / pageSize * pageSize;
+
+    // Zeros past the end of the file, then the file on top
+    void* region = mmap(nullptr, loaded->mappingSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        close(file);
+        return nullptr;
+    }
+    loaded->mapping = region;
+
+    if (loaded->fileSize > 0) {
+        void* mapped = mmap(region, loaded->fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0);
+        if (mapped == MAP_FAILED) {
+            close(file);
+            return nullptr;
+        }
+    }
+    close(file);
+
+    loaded->bytes = static_cast<const BYTE*>(region);
+#else
+    ifstream file(path, ios::binary);
+    if (!file.good()) {
+        return nullptr;
+    }
+
+    file.seekg(0, ios::end);
+    loaded->fileSize = file.tellg();
+    file.seekg(0, ios::beg);
+
+    loaded->buffer.assign(max(loaded->fileSize, minimumSize), 0);
+    file.read(reinterpret_cast<char*>(loaded->buffer.data()), loaded->fileSize);
+    loaded->bytes = loaded->buffer.data();
+#endif
+
+    loaded->contentHash = hashBytes(loaded->bytes, loaded->fileSize);
+
+    for (auto entry = openImages.begin(); entry != openImages.end(); ) {
+        entry = entry->second.expired() ? openImages.erase(entry) : next(entry);
+    }
+
+    shared_ptr<const ROMImage> image = loaded;
+    openImages[key] = image;
+    return image;
+
+}
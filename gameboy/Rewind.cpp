@@ -0,0 +1,168 @@
+#include "Emulator.hpp"
+
+#include <chrono>
+
+/*
+********************************************************************************
+REWIND
+********************************************************************************
+*/
+
+/*
+
+The front end captures a snapshot (see SNAPSHOTS) after every frame. Only the
+latest one is kept whole. Every older one is kept as the XOR of itself with
+the state after it, run-length encoded:
+
+    zero run length, literal length, literal bytes, zero run length, ...
+
+with the lengths as base 128 varints. From one frame to the next most of the
+state doesn't change, so the XOR is mostly zeros and a frame takes a few
+hundred bytes. Stepping back decodes one delta into the latest snapshot and
+restores it. restore only redoes what differs, so cached blocks in RAM that
+didn't change stay compiled, and stepping back costs about as much as a 
+capture, far less than a frame.
+
+When the deltas take more than maxBytes, the oldest ones are dropped. A 
+snapshot of another ROM starts the buffer over.
+
+*/
+
+static BYTE* bytes(vector<uint64_t>& snapshot) {
+    return reinterpret_cast<BYTE*>(snapshot.data());
+}
+
+RewindBuffer::RewindBuffer(size_t maxBytes)
+    : maxBytes(maxBytes), ROMHash(0), deltaBytes(0), captureCount(0), captureSeconds(0) {}
+
+void RewindBuffer::capture(Emulator& emulator) {
+
+    auto start = chrono::high_resolution_clock::now();
+
+    // Snapshots are aligned to 8 bytes, hence the uint64_t
+    captured.resize(Emulator::snapshotSize / sizeof(uint64_t));
+    emulator.snapshot(captured.data());
+
+    if (latest.empty() || emulator.getROMHash() != ROMHash) {
+        clear();
+        ROMHash = emulator.getROMHash();
+    } else {
+        deltas.emplace_back();
+        encodeDelta(bytes(latest), bytes(captured), deltas.back());
+        deltaBytes += deltas.back().size();
+
+        while (deltaBytes > maxBytes) {
+            deltaBytes -= deltas.front().size();
+            deltas.pop_front();
+        }
+    }
+    latest.swap(captured);
+
+    captureSeconds += chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+    captureCount++;
+
+}
+
+bool RewindBuffer::stepBack(Emulator& emulator) {
+
+    if (deltas.empty()) {
+        return false;
+    }
+
+    applyDelta(deltas.back(), bytes(latest));
+    deltaBytes -= deltas.back().size();
+    deltas.pop_back();
+
+    return emulator.restore(latest.data());
+
+}
+
+void RewindBuffer::clear() {
+    latest.clear();
+    deltas.clear();
+    deltaBytes = 0;
+}
+
+size_t RewindBuffer::frames() const {
+    return deltas.size();
+}
+
+size_t RewindBuffer::memoryUsed() const {
+    return deltaBytes + latest.size() * sizeof(uint64_t);
+}
+
+double RewindBuffer::captureMicroseconds() const {
+    return (captureCount == 0) ? 0 : captureSeconds / captureCount * 1e6;
+}
+
+static void putLength(vector<BYTE>& delta, size_t length) {
+    while (length >= 0x80) {
+        delta.push_back((length & 0x7F) | 0x80);
+        length >>= 7;
+    }
+    delta.push_back(length);
+}
+
+static size_t getLength(const BYTE*& cursor) {
+    size_t length = 0;
+    for (int shift = 0; ; shift += 7) {
+        BYTE byte = *cursor++;
+        length |= (size_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return length;
+        }
+    }
+}
+
+// Encodes older ^ newer, which turns newer back into older
+void RewindBuffer::encodeDelta(const BYTE* older, const BYTE* newer, vector<BYTE>& delta) const {
+
+    size_t size = Emulator::snapshotSize;
+    size_t i = 0;
+
+    while (i < size) {
+
+        // Equal bytes, 8 at a time while they last
+        size_t zeros = i;
+        while ((zeros + 8 <= size) && (memcmp(&older[zeros], &newer[zeros], 8) == 0)) {
+            zeros += 8;
+        }
+        while ((zeros < size) && (older[zeros] == newer[zeros])) {
+            zeros++;
+        }
+
+        // Changed bytes, up to the next run of 4 equal ones
+        size_t literals = zeros;
+        size_t equal = 0;
+        while ((literals < size) && (equal < 4)) {
+            equal = (older[literals] == newer[literals]) ? equal + 1 : 0;
+            literals++;
+        }
+        literals -= equal;
+
+        putLength(delta, zeros - i);
+        putLength(delta, literals - zeros);
+        for (size_t j = zeros; j < literals; j++) {
+            delta.push_back(older[j] ^ newer[j]);
+        }
+
+        i = literals;
+    }
+
+}
+
+void RewindBuffer::applyDelta(const vector<BYTE>& delta, BYTE* state) const {
+
+    const BYTE* cursor = delta.data();
+    const BYTE* end = cursor + delta.size();
+    size_t i = 0;
+
+    while (cursor < end) {
+        i += getLength(cursor);
+        size_t literals = getLength(cursor);
+        for (size_t j = 0; j < literals; j++) {
+            state[i++] ^= *cursor++;
+        }
+    }
+
+}